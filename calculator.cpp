@@ -1,411 +1,1865 @@
-#include "llvm/ADT/APFloat.h"
+#include "calculator.h"
+#include "calculator_shm.h"
+#include "engine_internal.h"
 #include "llvm/ADT/STLExtras.h"
-#include "llvm/IR/BasicBlock.h"
-#include "llvm/IR/Constants.h"
-#include "llvm/IR/DerivedTypes.h"
-#include "llvm/IR/Function.h"
-#include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/LLVMContext.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/IR/Module.h"
-#include "llvm/IR/Type.h"
-#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace llvm;
 using namespace std; // Added to use standard library components without std:: prefix
+using namespace calculator;
 
-// Lexer
-// The lexer identifies tokens [0-255] for unknown characters, otherwise returns tokens for recognized items.
-enum Token {
-    tok_eof = -1,     // Token for end of input
-    tok_error = -2,   // Token for errors
-    tok_number = -4   // Token for numeric values
+/// BatchMode - Set by --batch: no prompts, and every expression yields one machine-readable record on stdout.
+static bool BatchMode = false;
+
+// Session Working Set
+// The object cache itself is part of the library; the tool owns the process's instance and tracks what the session evaluated on top of it.
+
+static unique_ptr<JITObjectCache> TheObjectCache;
+
+/// SessionExpr - An expression evaluated during this session, remembered so that a restarted calculator can restore its working set.
+struct SessionExpr {
+    ObjectKey Key;     // Key the expression's object is cached under.
+    uint64_t Hits = 0; // Number of evaluations, carried across restarts.
 };
 
-static double NumVal; // Stores the numeric value if tok_number is returned
+/// SessionExprs - The session's working set keyed by serialized AST. Only tracked when snapshots are enabled.
+static map<string, SessionExpr> SessionExprs;
+static mutex SessionExprsLock;
+static bool TrackSession = false;
+
+// Phase Time Report
+// With --time-report, the tool prints each expression's phase times as it goes and a summary at exit. Threads add their times to the process totals when they finish.
+
+/// ReportTimes - Set by --time-report. Phases may also be timed without it, for the metrics' latency histograms.
+static bool ReportTimes = false;
+static mutex PhaseTotalsLock;
+static PhaseTimes PhaseTotals;
+/// TimedExprs - Top-level expressions parsed so far, for the summary's per-expression averages.
+static atomic<uint64_t> TimedExprs{0};
+/// LastExprTimes - The main thread's phase times when it reported the previous expression.
+static PhaseTimes LastExprTimes;
+
+/// MergePhaseTimes - Add the calling thread's phase times to the process totals.
+static void MergePhaseTimes() {
+    lock_guard<mutex> Guard(PhaseTotalsLock);
+    for (unsigned P = 0; P < NumTimedPhases; ++P) {
+        PhaseTotals.Nanos[P] += ThreadPhaseTimes.Nanos[P];
+        for (unsigned E = 0; E < NumHardwareEvents; ++E)
+            PhaseTotals.Events[P][E] += ThreadPhaseTimes.Events[P][E];
+    }
+    ThreadPhaseTimes = PhaseTimes();
+}
+
+/// ReportExpressionTimes - Print the time each phase took since the previous report, i.e. for the expression just handled.
+static void ReportExpressionTimes() {
+    uint64_t Total = 0;
+    string Line;
+    raw_string_ostream OS(Line);
+    OS << "time #" << TimedExprs << ":";
+    for (unsigned P = 0; P < NumTimedPhases; ++P) {
+        uint64_t Nanos = ThreadPhaseTimes.Nanos[P] - LastExprTimes.Nanos[P];
+        Total += Nanos;
+        OS << ' ' << PhaseNames[P] << ' ' << format("%.1f", Nanos / 1e3) << "us";
+    }
+    OS << " total " << format("%.1f", Total / 1e3) << "us\n";
+    fputs(OS.str().c_str(), stderr);
+}
+
+/// PrintTimeReport - Print the process's accumulated phase times, in total and per expression.
+static void PrintTimeReport() {
+    uint64_t Total = 0;
+    for (unsigned P = 0; P < NumTimedPhases; ++P)
+        Total += PhaseTotals.Nanos[P];
+    uint64_t NumExprs = max<uint64_t>(TimedExprs, 1);
+
+    raw_ostream &OS = errs();
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "                      Phase timing report (" << TimedExprs << " expressions)\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << "  Phase          Total (ms)   Per expression (us)     Share\n";
+    for (unsigned P = 0; P < NumTimedPhases; ++P)
+        OS << format("  %-12s %12.3f %21.2f %8.1f%%\n", PhaseNames[P], PhaseTotals.Nanos[P] / 1e6,
+                     PhaseTotals.Nanos[P] / 1e3 / NumExprs, Total ? 100.0 * PhaseTotals.Nanos[P] / Total : 0.0);
+    OS << format("  %-12s %12.3f %21.2f %8.1f%%\n", (const char *)"total", Total / 1e6, Total / 1e3 / NumExprs, 100.0);
+}
+
+// Hardware Counter Report
+// With --hw-counters, the tool prints each expression's hardware events as it goes, and each phase's events per expression at exit. Low IPC with few cache misses points at dependency chains; many cache misses, at memory; many iTLB misses in the execute phase, at JIT code scattered over too many pages.
+
+static bool ReportCounters = false;
+
+/// FormatEvent - An event count for a report, or "-" if the machine does not count the event.
+static string FormatEvent(HardwareEvent E, double Count) {
+    if (!HardwareEventAvailable[E])
+        return "-";
+    string S;
+    raw_string_ostream(S) << format("%.0f", Count);
+    return S;
+}
+
+/// FormatIPC - Instructions per cycle, or "-" if there were no cycles to divide by.
+static string FormatIPC(const uint64_t Events[NumHardwareEvents]) {
+    if (!Events[EventCycles])
+        return "-";
+    string S;
+    raw_string_ostream(S) << format("%.2f", double(Events[EventInstructions]) / Events[EventCycles]);
+    return S;
+}
+
+/// ReportExpressionCounters - Print the hardware events since the previous report, i.e. for the expression just handled, with the execute phase's own share.
+static void ReportExpressionCounters() {
+    uint64_t Total[NumHardwareEvents] = {};
+    uint64_t Execute[NumHardwareEvents];
+    for (unsigned E = 0; E < NumHardwareEvents; ++E) {
+        for (unsigned P = 0; P < NumTimedPhases; ++P)
+            Total[E] += ThreadPhaseTimes.Events[P][E] - LastExprTimes.Events[P][E];
+        Execute[E] = ThreadPhaseTimes.Events[PhaseExecute][E] - LastExprTimes.Events[PhaseExecute][E];
+    }
+    string Line;
+    raw_string_ostream OS(Line);
+    OS << "counters #" << TimedExprs << ":";
+    for (unsigned E = 0; E < NumHardwareEvents; ++E)
+        OS << ' ' << HardwareEventNames[E] << ' ' << FormatEvent(HardwareEvent(E), Total[E]);
+    OS << " ipc " << FormatIPC(Total) << "; execute: ipc " << FormatIPC(Execute) << " itlb-misses "
+       << FormatEvent(EventITLBMisses, Execute[EventITLBMisses]) << '\n';
+    fputs(OS.str().c_str(), stderr);
+}
+
+/// PrintCounterReport - Print the process's hardware events in each phase, per expression.
+static void PrintCounterReport() {
+    uint64_t Total[NumHardwareEvents] = {};
+    for (unsigned P = 0; P < NumTimedPhases; ++P)
+        for (unsigned E = 0; E < NumHardwareEvents; ++E)
+            Total[E] += PhaseTotals.Events[P][E];
+    double NumExprs = max<uint64_t>(TimedExprs, 1);
+
+    raw_ostream &OS = errs();
+    auto PrintRow = [&](const char *Name, const uint64_t Events[NumHardwareEvents]) {
+        OS << format("  %-12s", Name);
+        for (HardwareEvent E : {EventCycles, EventInstructions})
+            OS << format(" %13s", FormatEvent(E, Events[E] / NumExprs).c_str());
+        OS << format(" %6s", FormatIPC(Events).c_str());
+        for (HardwareEvent E : {EventCacheMisses, EventBranchMisses, EventITLBMisses})
+            OS << format(" %13s", FormatEvent(E, Events[E] / NumExprs).c_str());
+        OS << '\n';
+    };
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "            Hardware events per expression (" << TimedExprs << " expressions)\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << format("  %-12s %13s %13s %6s %13s %13s %13s\n", (const char *)"Phase", (const char *)"Cycles",
+                 (const char *)"Instructions", (const char *)"IPC", (const char *)"Cache misses",
+                 (const char *)"Branch misses", (const char *)"iTLB misses");
+    for (unsigned P = 0; P < NumTimedPhases; ++P)
+        PrintRow(PhaseNames[P], PhaseTotals.Events[P]);
+    PrintRow("total", Total);
+}
+
+// Memory Report
+// With --memory-report, the tool prints what each expression took to build as it goes, and the process's memory by subsystem at exit.
+
+static bool ReportMemory = false;
+
+/// ReportExpressionMemory - Print the memory the expression just handled took to build.
+static void ReportExpressionMemory() {
+    const ExprMemory &M = LastExprMemory;
+    errs() << "memory #" << TimedExprs << ": ast " << M.ASTNodes << " nodes " << M.ASTBytes << " bytes, ir "
+           << M.IRInstructions << " instructions, module heap " << format("%+lld", (long long)M.ModuleHeapBytes)
+           << " bytes\n";
+}
+
+/// SessionBytes - The session working set's size: its keys and entries.
+static uint64_t SessionBytes() {
+    lock_guard<mutex> Lock(SessionExprsLock);
+    uint64_t Bytes = 0;
+    for (auto &Entry : SessionExprs)
+        Bytes += Entry.first.capacity() + sizeof(Entry);
+    return Bytes;
+}
+
+/// PrintMemoryReport - Print the process's memory by subsystem, and what its expressions took to build.
+static void PrintMemoryReport() {
+    MemoryUsage U = GetMemoryUsage();
+    uint64_t NumExprs = max<uint64_t>(TimedExprs, 1);
+    uint64_t NumModules = max<uint64_t>(U.ModulesMeasured, 1);
+
+    raw_ostream &OS = errs();
+    OS << "===-------------------------------------------------------------------------===\n"
+       << "                      Memory report (" << TimedExprs << " expressions)\n"
+       << "===-------------------------------------------------------------------------===\n"
+       << "  In use                       KiB\n";
+    auto Row = [&](const char *Name, uint64_t Bytes) { OS << format("  %-22s %12.1f\n", Name, Bytes / 1024.0); };
+    Row("syntax trees", U.ASTBytes);
+    Row("JIT code", U.JITCode);
+    Row("JIT read-only data", U.JITROData);
+    Row("JIT writable data", U.JITRWData);
+    Row("object cache", U.ObjectCache);
+    Row("shared object cache", U.SharedObjectCache);
+    if (TrackSession)
+        Row("session working set", SessionBytes());
+    Row("malloc heap", U.Heap);
+    Row("resident set", U.Resident);
+
+    OS << "\n  Built                      Total   Per expression\n";
+    OS << format("  %-18s %12" PRIu64 " %16.1f\n", (const char *)"AST nodes", U.ASTNodesParsed,
+                 double(U.ASTNodesParsed) / NumExprs);
+    OS << format("  %-18s %12" PRIu64 " %16.1f\n", (const char *)"AST bytes", U.ASTBytesParsed,
+                 double(U.ASTBytesParsed) / NumExprs);
+    OS << format("  %-18s %12" PRIu64 " %16.1f\n", (const char *)"IR instructions", U.IRInstructions,
+                 double(U.IRInstructions) / NumExprs);
+    OS << format("  %-18s %12.1f %16.1f   peak %.1f\n", (const char *)"module heap (KiB)", U.ModuleHeapTotal / 1024.0,
+                 U.ModuleHeapTotal / 1024.0 / NumModules, U.ModuleHeapPeak / 1024.0);
+}
+
+// Latency Statistics
+// With --latency-stats, the tool records how long requests take end to end and how long compiled code runs, reports percentiles at exit, and answers the "stats" command at the prompt, in batch input and from server clients.
+
+/// PrintLatencyStats - Print the latency percentiles recorded so far on stderr.
+static void PrintLatencyStats() {
+    if (!RecordLatencies) {
+        fprintf(stderr, "Error: latencies are not being recorded; run with --latency-stats\n");
+        return;
+    }
+    WriteLatencyStats(errs());
+}
+
+/// IsStatsCommand - Whether the current token is the "stats" command.
+static bool IsStatsCommand() {
+    return CurTok == tok_identifier && IdentifierStr == "stats";
+}
+
+// Explain
+// "explain <expression>;" prints the optimized IR and assembly of the expression's batch kernel, and llvm-mca's estimate of its cost per row on this CPU, instead of evaluating it. The expression may use variables, as a batch job's formula would.
+
+/// IsExplainCommand - Whether the current token starts an "explain" command.
+static bool IsExplainCommand() {
+    return CurTok == tok_identifier && IdentifierStr == "explain";
+}
+
+/// HandleExplain - Explain the expression after the "explain" token on stderr.
+static void HandleExplain() {
+    getNextToken(); // eat explain.
+    vector<string> Params;
+    auto Body = ParseParameterizedExpr(Params);
+    if (!Body || !ExplainBody(move(Body), move(Params), errs()))
+        getNextToken(); // Skip token for error recovery.
+}
+
+// Top-Level Parsing and JIT Driver
+
+/// DumpIR - Whether each expression's IR is printed; always true outside batch mode.
+static bool DumpIR = true;
+/// BatchSeq - Sequence number of the last batch record written.
+static uint64_t BatchSeq = 0;
+
+/// EmitBatchResult/EmitBatchError - Write one tab-separated batch record to the buffered stdout writer: sequence number, status, then the value or message.
+static void EmitBatchResult(double Val) {
+    outs() << ++BatchSeq << "\tok\t" << format("%.17g", Val) << '\n';
+}
+static void EmitBatchError(StringRef Message) {
+    outs() << ++BatchSeq << "\terror\t" << Message << '\n';
+}
 
-/// gettok - Fetch the next token from standard input.
-static int gettok() {
-    static int LastChar = ' ';
-    // Ignore whitespace characters.
-    while (isspace(LastChar))
-        LastChar = getchar();
+/// SkipBatchExpression - Discard the rest of a batch expression that failed to parse, through the ';' that ends it, so that it yields one error record and nothing else.
+static void SkipBatchExpression() {
+    while (CurTok != ';' && CurTok != tok_eof)
+        getNextToken();
+}
 
-    if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-        fprintf(stderr, "Only numeric literals and operators are permitted.\n");
-        while (isalnum((LastChar = getchar())))
-            return tok_error;
+/// ParseBatchExpr - Parse a top-level batch expression, which must run up to a ';' or the end of input. Anything else after it is an error, and the input is skipped to the ';'.
+static unique_ptr<FunctionAST> ParseBatchExpr() {
+    auto FnAST = ParseTopLevelExpr();
+    if (FnAST && CurTok != ';' && CurTok != tok_eof) {
+        LogError("expected ';' after expression");
+        FnAST = nullptr;
     }
+    if (!FnAST)
+        SkipBatchExpression();
+    return FnAST;
+}
+
+/// RecordSessionExpr - Count an evaluation of FnAST, whose code is in TheModule, towards the session's working set.
+static void RecordSessionExpr(const FunctionAST &FnAST) {
+    string AST;
+    FnAST.serialize(AST);
+    lock_guard<mutex> Lock(SessionExprsLock);
+    SessionExpr &E = SessionExprs[AST];
+    if (!E.Hits++)
+        E.Key = JITObjectCache::getModuleKey(*TheModule);
+}
+
+/// RunAnonExpr - JIT-compile the anonymous function just generated in TheModule, call it, and free its code again. Leaves a fresh module for the next expression.
+static double RunAnonExpr() {
+    PhaseTimer LinkTimer(PhaseLink);
+    // Track the JIT'd memory of the anonymous expression so it can be freed once it has run.
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    auto TSM = orc::ThreadSafeModule(move(TheModule), move(TheContext));
+    ExitOnErr(TheJIT->addIRModule(RT, move(TSM)));
+    InitializeModule();
 
-    if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-        string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (isdigit(LastChar) || LastChar == '.');
-        NumVal = strtod(NumStr.c_str(), nullptr);
-        return tok_number;
+    // Compile the expression and call it as a native function.
+    auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+    double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+    double Result;
+    {
+        PhaseTimer ExecuteTimer(PhaseExecute);
+        LatencyTimer Latency(LatencyNative);
+        Result = FP();
     }
+    NoteExecutedRows(1);
 
-    // Check if the end of the file has been reached. Do not consume the EOF character.
-    if (LastChar == EOF)
-        return tok_eof;
+    // Remove the anonymous expression, which will be every expression.
+    ExitOnErr(RT->remove());
+    return Result;
+}
 
-    // Otherwise, return the character's ASCII value.
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
+static void HandleTopLevelExpression() {
+    // Evaluate a top-level expression into an anonymous function.
+    if (auto FnAST = BatchMode ? ParseBatchExpr() : ParseTopLevelExpr()) {
+        if (auto *FnIR = FnAST->codegen()) {
+            if (DumpIR) {
+                fprintf(stderr, "Generated IR and result:\n");
+                FnIR->print(errs());
+                fprintf(stderr, "\n");
+            }
+
+            if (TrackSession)
+                RecordSessionExpr(*FnAST);
+
+            double Result = RunAnonExpr();
+            if (BatchMode)
+                EmitBatchResult(Result);
+            else
+                fprintf(stderr, "Evaluated to %f\n", Result);
+        } else {
+            // Skip token for error recovery.
+            getNextToken();
+        }
+    } else if (!BatchMode) {
+        // Skip token for error recovery.
+        getNextToken();
+    }
 }
 
-// Syntax Tree
-namespace {
+/// top ::= expression | ';'
+static void MainLoop() {
+    while (true) {
+        if (BatchMode) {
+            if (!PendingError.empty()) {
+                EmitBatchError(PendingError);
+                PendingError.clear();
+            }
+        } else {
+            fprintf(stderr, "ready> ");
+        }
+        switch (CurTok) {
+        case tok_eof:
+            return;
+        case tok_error:
+            // The lexer has reported it already. In batch mode the rest of the expression belongs to the same error record.
+            if (BatchMode)
+                SkipBatchExpression();
+            getNextToken();
+            break;
+        case ';': // Ignore top-level semicolons.
+            getNextToken();
+            break;
+        default:
+            if (IsStatsCommand()) {
+                PrintLatencyStats();
+                getNextToken();
+                break;
+            }
+            if (IsExplainCommand()) {
+                HandleExplain();
+                break;
+            }
+            TraceExpr = ++TimedExprs;
+            {
+                LatencyTimer Latency(LatencyRequest);
+                TraceSpan Span("expression", "expression");
+                HandleTopLevelExpression();
+            }
+            if (ReportTimes)
+                ReportExpressionTimes();
+            if (ReportCounters)
+                ReportExpressionCounters();
+            LastExprTimes = ThreadPhaseTimes;
+            if (ReportMemory)
+                ReportExpressionMemory();
+            break;
+        }
+    }
+}
+
+// Pipelined Batch Driver
+// With --pipeline, batch mode runs as four stages on their own threads: lexing and parsing, IR generation, JIT compilation, and execution. Bounded lock-free rings connect the stages, so throughput follows the slowest stage rather than the sum of all four.
+
+/// SPSCQueue - A bounded lock-free ring with one producer and one consumer. Each side writes only its own index and reads the other's with an acquire load. Full and empty queues are waited out by yielding.
+template <typename T, size_t Capacity> class SPSCQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    T Items[Capacity];
+    alignas(64) atomic<size_t> Head{0}; // Next item to pop; written by the consumer.
+    alignas(64) atomic<size_t> Tail{0}; // Next free slot; written by the producer.
+    const char *Name; // The name of its depth in trace events.
 
-/// ExprAST - Base class for all expression nodes.
-class ExprAST {
 public:
-    virtual ~ExprAST() = default;
-    virtual Value *codegen() = 0;
+    explicit SPSCQueue(const char *Name) : Name(Name) {}
+
+    void push(T Item) {
+        size_t Pos = Tail.load(memory_order_relaxed);
+        if (Pos - Head.load(memory_order_acquire) == Capacity) {
+            TraceSpan Wait("wait to push", "queue");
+            while (Pos - Head.load(memory_order_acquire) == Capacity)
+                std::this_thread::yield();
+        }
+        Items[Pos & (Capacity - 1)] = move(Item);
+        Tail.store(Pos + 1, memory_order_release);
+        if (TraceEvents.load(memory_order_relaxed))
+            RecordTraceCounter(Name, Pos + 1 - Head.load(memory_order_relaxed));
+    }
+
+    T pop() {
+        size_t Pos = Head.load(memory_order_relaxed);
+        if (Pos == Tail.load(memory_order_acquire)) {
+            TraceSpan Wait("wait to pop", "queue");
+            while (Pos == Tail.load(memory_order_acquire))
+                std::this_thread::yield();
+        }
+        T Item = move(Items[Pos & (Capacity - 1)]);
+        Head.store(Pos + 1, memory_order_release);
+        if (TraceEvents.load(memory_order_relaxed))
+            RecordTraceCounter(Name, Tail.load(memory_order_relaxed) - Pos - 1);
+        return Item;
+    }
 };
 
-/// NumberExprAST - Represents numeric literals like "1.0".
-class NumberExprAST : public ExprAST {
-public:
-    double Val;
-    NumberExprAST(double Val) : Val(Val) {}
-    Value *codegen() override;
+/// PipelineItem - One top-level step travelling through the pipeline. Each stage fills in what the next one needs; a failed step carries its error through to the output in order.
+struct PipelineItem {
+    enum ItemKind { Expr, Error, End } Kind = End;
+    unique_ptr<FunctionAST> FnAST;   // Parse -> codegen.
+    orc::ThreadSafeModule TSM;       // Codegen -> compile.
+    orc::ResourceTrackerSP RT;       // Compile -> execute.
+    double (*FP)() = nullptr;
+    string Message;
+    uint64_t Start = 0; // When parsing began, for end-to-end latency; 0 when latencies are not recorded.
+    uint64_t Number = 0; // The expression's number, for trace events.
 };
 
-/// BinaryExprAST - Represents binary operators.
-class BinaryExprAST : public ExprAST {
-    char Op;
-    unique_ptr<ExprAST> LHS, RHS;
+static const size_t PipelineDepth = 64;
+using PipelineQueue = SPSCQueue<PipelineItem, PipelineDepth>;
 
-public:
-    BinaryExprAST(char Op, unique_ptr<ExprAST> LHS, unique_ptr<ExprAST> RHS)
-        : Op(Op), LHS(move(LHS)), RHS(move(RHS)) {}
-    Value *codegen() override;
-};
+/// PipelineFail - Turn Item into an error record carrying the calling thread's pending error.
+static void PipelineFail(PipelineItem &Item) {
+    Item.Kind = PipelineItem::Error;
+    Item.Message = PendingError.empty() ? "invalid expression" : PendingError;
+    PendingError.clear();
+}
 
-/// PrototypeAST - Describes a function's "prototype", capturing its name and argument names, thereby defining the number of arguments. Useful for parsing input as an anonymous function.
-class PrototypeAST {
-    string Name;
-    vector<string> Args;
+/// RunCodegenStage - Generate IR for each parsed expression into a module of its own.
+static void RunCodegenStage(orc::LLJIT *JIT, PipelineQueue &In, PipelineQueue &Out) {
+    SetTraceThreadName("codegen stage");
+    CollectErrors = true;
+    TheJIT = JIT;
+    InitializeModule();
+    while (true) {
+        PipelineItem Item = In.pop();
+        TraceExpr = Item.Number;
+        if (Item.Kind == PipelineItem::Expr) {
+            if (Item.FnAST->codegen()) {
+                if (TrackSession)
+                    RecordSessionExpr(*Item.FnAST);
+                Item.TSM = orc::ThreadSafeModule(move(TheModule), move(TheContext));
+                InitializeModule();
+            } else {
+                PipelineFail(Item);
+            }
+            Item.FnAST.reset();
+        }
+        bool Done = Item.Kind == PipelineItem::End;
+        Out.push(move(Item));
+        if (Done)
+            return MergePhaseTimes();
+    }
+}
 
-public:
-    PrototypeAST(const string &Name, vector<string> Args)
-        : Name(Name), Args(move(Args)) {}
+/// RunCompileStage - JIT-compile each module. Up to PipelineDepth + 2 anonymous expressions are alive at once (queued for, or running in, the execute stage), so each goes into its own JITDylib from a pool of that size: by the time a JITDylib comes round again, the execute stage has removed its previous contents.
+static void RunCompileStage(orc::LLJIT *JIT, PipelineQueue &In, PipelineQueue &Out) {
+    SetTraceThreadName("compile stage");
+    vector<orc::JITDylib *> Dylibs;
+    for (size_t I = 0; I < PipelineDepth + 2; ++I)
+        Dylibs.push_back(&JIT->getExecutionSession().createBareJITDylib("pipeline" + to_string(I)));
+
+    for (size_t Next = 0;; ++Next) {
+        PipelineItem Item = In.pop();
+        TraceExpr = Item.Number;
+        if (Item.Kind == PipelineItem::Expr) {
+            orc::JITDylib &JD = *Dylibs[Next % Dylibs.size()];
+            PhaseTimer Timer(PhaseLink);
+            Item.RT = JD.createResourceTracker();
+            ExitOnErr(JIT->addIRModule(Item.RT, move(Item.TSM)));
+            auto ExprSymbol = ExitOnErr(JIT->lookup(JD, "__anon_expr"));
+            Item.FP = (double (*)())(intptr_t)ExprSymbol.getAddress();
+        }
+        bool Done = Item.Kind == PipelineItem::End;
+        Out.push(move(Item));
+        if (Done)
+            return MergePhaseTimes();
+    }
+}
 
-    Function *codegen();
-    const string &getName() const { return Name; }
-};
+/// RunExecuteStage - Run each compiled expression, write its batch record, and free its code.
+static void RunExecuteStage(PipelineQueue &In) {
+    SetTraceThreadName("execute stage");
+    while (true) {
+        PipelineItem Item = In.pop();
+        TraceExpr = Item.Number;
+        switch (Item.Kind) {
+        case PipelineItem::Expr: {
+            double Result;
+            {
+                PhaseTimer Timer(PhaseExecute);
+                LatencyTimer Latency(LatencyNative);
+                Result = Item.FP();
+            }
+            NoteExecutedRows(1);
+            EmitBatchResult(Result);
+            PhaseTimer Timer(PhaseLink);
+            ExitOnErr(Item.RT->remove());
+            break;
+        }
+        case PipelineItem::Error:
+            EmitBatchError(Item.Message);
+            break;
+        case PipelineItem::End:
+            return MergePhaseTimes();
+        }
+        if (Item.Start)
+            RecordLatency(LatencyRequest, LatencyClock() - Item.Start);
+    }
+}
 
-/// FunctionAST - Represents a function definition. Useful for parsing input as an anonymous function.
-class FunctionAST {
-    unique_ptr<PrototypeAST> Proto;
-    unique_ptr<ExprAST> Body;
+/// PipelinedMainLoop - The batch main loop with the later stages moved onto their own threads. The calling thread lexes and parses.
+static void PipelinedMainLoop() {
+    static PipelineQueue Parsed("parsed queue"), Generated("generated queue"), Compiled("compiled queue");
+    std::thread Codegen(RunCodegenStage, TheJIT, ref(Parsed), ref(Generated));
+    std::thread Compile(RunCompileStage, TheJIT, ref(Generated), ref(Compiled));
+    std::thread Execute(RunExecuteStage, ref(Compiled));
 
-public:
-    FunctionAST(unique_ptr<PrototypeAST> Proto, unique_ptr<ExprAST> Body)
-        : Proto(move(Proto)), Body(move(Body)) {}
+    while (true) {
+        if (!PendingError.empty()) {
+            PipelineItem Item;
+            PipelineFail(Item);
+            Parsed.push(move(Item));
+        }
+        if (CurTok == tok_eof)
+            break;
+        if (CurTok == tok_error) {
+            SkipBatchExpression();
+            getNextToken();
+        } else if (CurTok == ';') {
+            getNextToken();
+            continue;
+        }
+        if (IsStatsCommand()) {
+            // Expressions still in flight are not counted yet.
+            PrintLatencyStats();
+            getNextToken();
+            continue;
+        }
+        if (IsExplainCommand()) {
+            HandleExplain();
+            continue;
+        }
+        TraceExpr = ++TimedExprs;
+        uint64_t Start = RecordLatencies ? LatencyClock() : 0;
+        if (auto FnAST = ParseBatchExpr()) {
+            PipelineItem Item;
+            Item.Kind = PipelineItem::Expr;
+            Item.FnAST = move(FnAST);
+            Item.Start = Start;
+            Item.Number = TimedExprs;
+            Parsed.push(move(Item));
+        }
+    }
 
-    Function *codegen();
-};
+    Parsed.push(PipelineItem());
+    Codegen.join();
+    Compile.join();
+    Execute.join();
+}
 
-// Parser
+// Session Snapshots
+// A snapshot holds the session's working set: each expression's serialized AST, the key and object code it was compiled to, and its hit count. All integers are in host byte order; snapshots are only meant to be restored on the same kind of machine, and anything compiled for a different host is rebuilt from its AST.
 
-/// CurTok/getNextToken - Provides a simple token buffer. CurTok is the current token being examined by the parser. getNextToken reads another token from the lexer and updates CurTok with the result.
-static int CurTok;
-static int getNextToken() {
-    return CurTok = gettok();
+static const char SnapshotMagic[8] = {'C', 'A', 'L', 'C', 'S', 'N', 'A', 'P'};
+static const uint32_t SnapshotVersion = 1;
+
+template <typename T> static void WriteSnapshotField(raw_ostream &OS, T V) {
+    OS.write(reinterpret_cast<const char *>(&V), sizeof(V));
 }
 
-/// BinopPrecedence - Stores the precedence level for each defined binary operator.
-static map<int, int> BinopPrecedence;
+static void WriteSnapshotBlob(raw_ostream &OS, StringRef Blob) {
+    WriteSnapshotField<uint32_t>(OS, Blob.size());
+    OS << Blob;
+}
 
-/// GetTokPrecedence - Retrieves the precedence of the current binary operator token.
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
-        return -1;
+template <typename T> static bool ReadSnapshotField(StringRef &In, T &V) {
+    if (In.size() < sizeof(V))
+        return false;
+    memcpy(&V, In.data(), sizeof(V));
+    In = In.drop_front(sizeof(V));
+    return true;
+}
 
-    // Ensure it's a declared binary operator.
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0)
-        return -1;
-    return TokPrec;
+static bool ReadSnapshotBlob(StringRef &In, StringRef &Blob) {
+    uint32_t Size;
+    if (!ReadSnapshotField(In, Size) || In.size() < Size)
+        return false;
+    Blob = In.take_front(Size);
+    In = In.drop_front(Size);
+    return true;
 }
 
-/// LogError* - Helper functions for handling errors.
-unique_ptr<ExprAST> LogError(const char *Str) {
-    fprintf(stderr, "Error: %s\n", Str);
-    return nullptr;
+/// SaveSnapshot - Write the working set to Path, replacing any previous snapshot atomically.
+static bool SaveSnapshot(const string &Path) {
+    string TmpPath = Path + ".tmp";
+    error_code EC;
+    raw_fd_ostream OS(TmpPath, EC);
+    if (EC) {
+        fprintf(stderr, "Error: cannot write snapshot '%s': %s\n", TmpPath.c_str(), EC.message().c_str());
+        return false;
+    }
+
+    OS.write(SnapshotMagic, sizeof(SnapshotMagic));
+    WriteSnapshotField<uint32_t>(OS, SnapshotVersion);
+    WriteSnapshotField<uint32_t>(OS, SessionExprs.size());
+    for (auto &Entry : SessionExprs) {
+        // Every recorded expression was compiled through the cache, which keeps its object for the session.
+        StringRef Obj = TheObjectCache->lookupObject(Entry.second.Key);
+        if (Obj.empty()) {
+            fprintf(stderr, "Error: cannot write snapshot '%s': no object code for a session expression\n", Path.c_str());
+            OS.close();
+            sys::fs::remove(TmpPath);
+            return false;
+        }
+        WriteSnapshotBlob(OS, Entry.first);
+        WriteSnapshotField(OS, Entry.second.Key);
+        WriteSnapshotField<uint64_t>(OS, Entry.second.Hits);
+        WriteSnapshotBlob(OS, Obj);
+    }
+    OS.close();
+
+    if (OS.has_error() || (EC = sys::fs::rename(TmpPath, Path))) {
+        fprintf(stderr, "Error: cannot write snapshot '%s'\n", Path.c_str());
+        OS.clear_error();
+        return false;
+    }
+    return true;
 }
-unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-    LogError(Str);
-    return nullptr;
+
+/// RestoreSnapshot - Reload the working set saved at Path. Objects that still match this host are installed directly in the object cache; the rest are recompiled from their ASTs now, before any expression is read. A missing snapshot is a cold start, not an error.
+static bool RestoreSnapshot(const string &Path) {
+    auto BufOrErr = MemoryBuffer::getFile(Path);
+    if (!BufOrErr)
+        return BufOrErr.getError() == errc::no_such_file_or_directory;
+
+    StringRef In = (*BufOrErr)->getBuffer();
+    uint32_t Version, Count;
+    if (!In.consume_front(StringRef(SnapshotMagic, sizeof(SnapshotMagic))) || !ReadSnapshotField(In, Version) ||
+        Version != SnapshotVersion || !ReadSnapshotField(In, Count)) {
+        fprintf(stderr, "Error: '%s' is not a compatible snapshot\n", Path.c_str());
+        return false;
+    }
+
+    for (uint32_t I = 0; I < Count; ++I) {
+        StringRef AST, Obj;
+        ObjectKey Key;
+        uint64_t Hits;
+        if (!ReadSnapshotBlob(In, AST) || !ReadSnapshotField(In, Key) || !ReadSnapshotField(In, Hits) ||
+            !ReadSnapshotBlob(In, Obj)) {
+            fprintf(stderr, "Error: snapshot '%s' is truncated\n", Path.c_str());
+            return false;
+        }
+
+        StringRef ASTIn = AST;
+        auto Body = DeserializeExpr(ASTIn);
+        if (!Body || !ASTIn.empty()) {
+            fprintf(stderr, "Error: snapshot '%s' holds a malformed expression\n", Path.c_str());
+            return false;
+        }
+        auto Proto = make_unique<PrototypeAST>("__anon_expr", vector<string>());
+        FunctionAST FnAST(move(Proto), move(Body));
+        if (!FnAST.codegen())
+            continue;
+
+        ObjectKey CurKey = JITObjectCache::getModuleKey(*TheModule);
+        if (CurKey == Key && !Obj.empty()) {
+            TheObjectCache->addObject(Key, Obj);
+        } else {
+            // Compiled for another host or LLVM version: pay for the compile now rather than under load.
+            auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+            ExitOnErr(TheJIT->addIRModule(RT, orc::ThreadSafeModule(move(TheModule), move(TheContext))));
+            ExitOnErr(TheJIT->lookup("__anon_expr"));
+            ExitOnErr(RT->remove());
+        }
+        InitializeModule();
+
+        SessionExpr &E = SessionExprs[AST.str()];
+        E.Key = CurKey;
+        E.Hits += Hits;
+    }
+    return true;
 }
 
-static unique_ptr<ExprAST> ParseExpression();
+// Unix Sockets
 
-/// numberexpr ::= number
-static unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = make_unique<NumberExprAST>(NumVal);
-    getNextToken(); // move past the number
-    return move(Result);
+/// ListenUnix - Bind a listening stream socket at Path, replacing any stale socket file. Returns -1 on error.
+static int ListenUnix(const string &Path) {
+    sockaddr_un Addr;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(Addr.sun_path)) {
+        fprintf(stderr, "Error: socket path '%s' is too long\n", Path.c_str());
+        return -1;
+    }
+    memcpy(Addr.sun_path, Path.c_str(), Path.size());
+
+    int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(Path.c_str());
+    if (Listener < 0 || ::bind(Listener, (sockaddr *)&Addr, sizeof(Addr)) < 0 || listen(Listener, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error: cannot listen on '%s': %s\n", Path.c_str(), strerror(errno));
+        if (Listener >= 0)
+            close(Listener);
+        return -1;
+    }
+    return Listener;
 }
 
-/// parenexpr ::= '(' expression ')'
-static unique_ptr<ExprAST> ParseParenExpr() {
-    getNextToken(); // consume '('
-    auto V = ParseExpression();
-    if (!V)
-        return nullptr;
+/// ReadAll - Read exactly Size bytes from FD. Returns false on error or end of file.
+static bool ReadAll(int FD, char *Buf, size_t Size) {
+    while (Size) {
+        ssize_t N = read(FD, Buf, Size);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Buf += N;
+        Size -= N;
+    }
+    return true;
+}
 
-    if (CurTok != ')')
-        return LogError("expected ')'");
-    getNextToken(); // consume ')'
-    return V;
+/// WriteAll - Write all of Buf to FD, retrying short writes.
+static bool WriteAll(int FD, const char *Buf, size_t Size) {
+    while (Size) {
+        ssize_t N = write(FD, Buf, Size);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Buf += N;
+        Size -= N;
+    }
+    return true;
 }
 
-/// primary
-/// ::= identifierexpr
-/// ::= numberexpr
-/// ::= parenexpr
-static unique_ptr<ExprAST> ParsePrimary() {
-    switch (CurTok) {
-    default:
-        return LogError("unexpected token when expecting an expression");
-    case tok_number:
-        return ParseNumberExpr();
-    case '(':
-        return ParseParenExpr();
+// Fork Server
+// The fork server is a zygote: it initializes LLVM, the JIT, the operator table and any cache or snapshot once, then forks a child per connection that starts out warm. The JIT compiles in place on the calling thread, so the zygote has no threads that fork could break.
+
+/// RunForkServer - Accept connections on Path forever, forking a child for each one. Returns true in the child, whose standard streams are then the connection; returns false in the server on error.
+static bool RunForkServer(const string &Path) {
+    int Listener = ListenUnix(Path);
+    if (Listener < 0)
+        return false;
+
+    // Let the kernel reap finished children.
+    signal(SIGCHLD, SIG_IGN);
+    fprintf(stderr, "Fork server listening on %s\n", Path.c_str());
+
+    while (true) {
+        int Conn = accept(Listener, nullptr, nullptr);
+        if (Conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            return false;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        pid_t Pid = fork();
+        if (Pid == 0) {
+            close(Listener);
+            signal(SIGCHLD, SIG_DFL);
+            dup2(Conn, STDIN_FILENO);
+            dup2(Conn, STDOUT_FILENO);
+            dup2(Conn, STDERR_FILENO);
+            close(Conn);
+            // Children start from the zygote's working set but must not race to overwrite its snapshot.
+            TrackSession = false;
+            return true;
+        }
+        if (Pid < 0)
+            fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
+        close(Conn);
     }
 }
 
-/// binoprhs
-/// ::= ('+' primary)*
-static unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, unique_ptr<ExprAST> LHS) {
-    // If this is a binary operator, find its precedence.
+/// RunForkClient - Relay stdin to a fork server's child and its replies to stdout. The client never initializes LLVM.
+static int RunForkClient(const string &Path) {
+    int Sock = ConnectUnix(Path);
+    if (Sock < 0) {
+        fprintf(stderr, "Error: cannot connect to '%s': %s\n", Path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    pollfd Fds[2] = {{STDIN_FILENO, POLLIN, 0}, {Sock, POLLIN, 0}};
+    char Buf[1 << 16];
     while (true) {
-        int TokPrec = GetTokPrecedence();
+        if (poll(Fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (Fds[0].revents) {
+            ssize_t N = read(STDIN_FILENO, Buf, sizeof(Buf));
+            if (N > 0) {
+                if (!WriteAll(Sock, Buf, N))
+                    return 1;
+            } else {
+                // End of input: let the child see EOF, then keep draining its output.
+                shutdown(Sock, SHUT_WR);
+                Fds[0].fd = -1;
+            }
+        }
+        if (Fds[1].revents) {
+            ssize_t N = read(Sock, Buf, sizeof(Buf));
+            if (N <= 0)
+                return 0;
+            if (!WriteAll(STDOUT_FILENO, Buf, N))
+                return 1;
+        }
+    }
+}
+
+// Expression Server
+// Requests and responses are framed by a 32-bit little-endian length. A request holds one expression; its response is "ok\t<value>" or "error\t<message>". Clients may pipeline any number of requests, and each connection receives its responses in request order.
 
-        // If this operator binds less tightly than the current one, we're done.
-        if (TokPrec < ExprPrec)
-            return LHS;
+static const uint32_t MaxServerRequest = 1 << 20;
 
-        int BinOp = CurTok;
-        getNextToken(); // consume the operator
+/// EvaluateBody - Compile and run the parsed expression Body on the calling thread's context and JIT. On failure returns false with the error in PendingError.
+static bool EvaluateBody(unique_ptr<ExprAST> Body, double &Result) {
+    FunctionAST FnAST(make_unique<PrototypeAST>("__anon_expr", vector<string>()), move(Body));
+    if (!FnAST.codegen())
+        return false;
+    if (TrackSession)
+        RecordSessionExpr(FnAST);
+    Result = RunAnonExpr();
+    return true;
+}
 
-        // Parse the primary expression following the binary operator.
-        auto RHS = ParsePrimary();
-        if (!RHS)
-            return nullptr;
+/// ServerConnection - A client connection. Workers finish requests in any order; the reorder buffer releases their responses in sequence. The socket closes once the client has stopped sending and every response is out.
+class ServerConnection {
+    int FD;
+    mutex Lock;
+    uint64_t NextToSend = 0;
+    map<uint64_t, string> Finished;
 
-        // If the current operator binds less tightly with RHS than the operator after RHS, let the pending operator take RHS as its LHS.
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec + 1, move(RHS));
-            if (!RHS)
-                return nullptr;
+public:
+    ServerConnection(int FD) : FD(FD) {}
+    ~ServerConnection() { close(FD); }
+    int getFD() const { return FD; }
+
+    /// complete - Record the response to request Seq and send every response that is now in order.
+    void complete(uint64_t Seq, string Response) {
+        lock_guard<mutex> Guard(Lock);
+        Finished[Seq] = move(Response);
+        for (auto It = Finished.begin(); It != Finished.end() && It->first == NextToSend;
+             It = Finished.erase(It), ++NextToSend) {
+            char Len[4];
+            support::endian::write32le(Len, It->second.size());
+            // A client that went away just loses its responses.
+            if (WriteAll(FD, Len, sizeof(Len)))
+                WriteAll(FD, It->second.data(), It->second.size());
         }
+    }
+};
+
+struct ServerRequest {
+    shared_ptr<ServerConnection> Conn;
+    uint64_t Seq;
+    string Expr;
+    uint64_t Received; // When the request was read, for end-to-end latency; 0 when latencies are not recorded.
+};
 
-        // Combine LHS and RHS.
-        LHS = make_unique<BinaryExprAST>(BinOp, move(LHS), move(RHS));
+/// RequestQueue - Requests waiting for a worker, shared by all connections.
+class RequestQueue {
+    mutex Lock;
+    condition_variable NotEmpty;
+    deque<ServerRequest> Requests;
+
+public:
+    void push(ServerRequest R) {
+        {
+            lock_guard<mutex> Guard(Lock);
+            Requests.push_back(move(R));
+        }
+        NotEmpty.notify_one();
     }
-}
 
-/// expression
-/// ::= primary binoprhs
-static unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParsePrimary();
-    if (!LHS)
-        return nullptr;
+    ServerRequest pop() {
+        unique_lock<mutex> Guard(Lock);
+        NotEmpty.wait(Guard, [this] { return !Requests.empty(); });
+        ServerRequest R = move(Requests.front());
+        Requests.pop_front();
+        return R;
+    }
+};
+
+/// ServerFlights - The requests the workers are evaluating right now, keyed by canonical form (the serialized tree). Expressions have no side effects, so a request identical to one in flight on another worker waits for that response rather than compiling its own. Entries go as soon as their response is ready, so the table holds at most one per worker; identical requests that arrive later share compiled code through the object cache instead.
+class ServerFlights {
+    mutex Lock;
+    map<string, shared_future<string>> InFlight;
 
-    return ParseBinOpRHS(0, move(LHS));
+public:
+    /// evaluate - The response to the request Expr: ok<TAB>value or error<TAB>message.
+    string evaluate(StringRef Expr) {
+        auto Body = ParseSource(Expr, nullptr);
+        if (!Body)
+            return respond(false, 0);
+        string Canonical;
+        Body->serialize(Canonical);
+        promise<string> Response;
+        {
+            unique_lock<mutex> Guard(Lock);
+            auto It = InFlight.find(Canonical);
+            if (It != InFlight.end()) {
+                shared_future<string> Shared = It->second;
+                Guard.unlock();
+                return Shared.get();
+            }
+            InFlight.emplace(Canonical, Response.get_future().share());
+        }
+        double Result = 0;
+        bool Ok = EvaluateBody(move(Body), Result);
+        string Text = respond(Ok, Result);
+        Response.set_value(Text);
+        lock_guard<mutex> Guard(Lock);
+        InFlight.erase(Canonical);
+        return Text;
+    }
+
+private:
+    static string respond(bool Ok, double Result) {
+        string Text;
+        raw_string_ostream OS(Text);
+        if (Ok)
+            OS << "ok\t" << format("%.17g", Result);
+        else
+            OS << "error\t" << PendingError;
+        PendingError.clear();
+        return move(OS.str());
+    }
+};
+
+/// RunServerWorker - Evaluate requests forever. Each worker owns its LLVMContext, module and JIT, so workers share nothing but the object cache and the table of requests in flight.
+static void RunServerWorker(RequestQueue &Queue, ServerFlights &Flights) {
+    SetTraceThreadName("server worker");
+    CollectErrors = true;
+    auto WorkerJIT = ExitOnErr(CreateJIT(TheObjectCache.get()));
+    TheJIT = WorkerJIT.get();
+    InitializeModule();
+
+    while (true) {
+        ServerRequest R = Queue.pop();
+        string Response;
+        raw_string_ostream OS(Response);
+        if (R.Expr == "stats") {
+            if (RecordLatencies)
+                WriteLatencyStats(OS << "ok\t");
+            else
+                OS << "error\tlatencies are not being recorded; run with --latency-stats";
+            R.Conn->complete(R.Seq, move(OS.str()));
+            continue;
+        }
+        TraceSpan Span("request", "server");
+        R.Conn->complete(R.Seq, Flights.evaluate(R.Expr));
+        if (R.Received)
+            RecordLatency(LatencyRequest, LatencyClock() - R.Received);
+    }
 }
 
-/// toplevelexpr ::= expression
-static unique_ptr<FunctionAST> ParseTopLevelExpr() {
-    if (auto E = ParseExpression()) {
-        // Create an anonymous prototype to hold our binary expressions.
-        auto Proto = make_unique<PrototypeAST>("__anon_expr", vector<string>());
-        return make_unique<FunctionAST>(move(Proto), move(E));
-    }
-    return nullptr;
-}
-
-// Code Generation
-// These are the main static variables used for LLVM operations
-static unique_ptr<LLVMContext> TheContext;
-static unique_ptr<Module> TheModule;
-static unique_ptr<IRBuilder<>> Builder;
-static map<string, Value *> NamedValues;
-
-Value *LogErrorV(const char *Str) {
-    LogError(Str);
-    return nullptr;
-}
-
-Value *NumberExprAST::codegen() {
-    // All types will be of type double.
-    return ConstantFP::get(*TheContext, APFloat(Val));
-}
-
-Value *BinaryExprAST::codegen() {
-    Value *L = LHS->codegen();
-    Value *R = RHS->codegen();
-    if (!L || !R)
-        return nullptr;
-
-    switch (Op) {
-    case '+':
-        return Builder->CreateFAdd(L, R, "addtmp");
-    case '-':
-        return Builder->CreateFSub(L, R, "subtmp");
-    case '*':
-        return Builder->CreateFMul(L, R, "multmp");
-    case '/':
-        return Builder->CreateFDiv(L, R, "divtmp");
-    case '<':
-        L = Builder->CreateFCmpULT(L, R, "cmptmp");
-        // Convert boolean 0/1 to double 0.0 or 1.0
-        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-    case '>':
-        L = Builder->CreateFCmpUGT(L, R, "cmptmp");
-        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-    case '=':
-        // Handle equality comparison (==)
-        L = Builder->CreateFCmpUEQ(L, R, "cmptmp");
-        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-    default:
-        return LogErrorV("invalid binary operator");
+/// ReadServerConnection - Read framed requests from one client until it stops sending, queueing each for the workers.
+static void ReadServerConnection(shared_ptr<ServerConnection> Conn, RequestQueue &Queue) {
+    for (uint64_t Seq = 0;; ++Seq) {
+        char Len[4];
+        if (!ReadAll(Conn->getFD(), Len, sizeof(Len)))
+            return;
+        uint32_t Size = support::endian::read32le(Len);
+        if (Size > MaxServerRequest) {
+            fprintf(stderr, "Error: dropping client that sent a %u-byte request\n", Size);
+            shutdown(Conn->getFD(), SHUT_RDWR);
+            return;
+        }
+        string Expr(Size, '\0');
+        if (!ReadAll(Conn->getFD(), &Expr[0], Size))
+            return;
+        Queue.push({Conn, Seq, move(Expr), RecordLatencies ? LatencyClock() : 0});
+    }
+}
+
+/// RunServer - Serve framed expression requests on Path with NumWorkers workers. Only returns on error.
+static bool RunServer(const string &Path, unsigned NumWorkers) {
+    int Listener = ListenUnix(Path);
+    if (Listener < 0)
+        return false;
+
+    // Writes to clients that have disconnected must fail rather than kill the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    static RequestQueue Queue;
+    static ServerFlights Flights;
+    for (unsigned I = 0; I < NumWorkers; ++I)
+        std::thread(RunServerWorker, ref(Queue), ref(Flights)).detach();
+    fprintf(stderr, "Server listening on %s with %u workers\n", Path.c_str(), NumWorkers);
+
+    while (true) {
+        int Conn = accept(Listener, nullptr, nullptr);
+        if (Conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            return false;
+        }
+        std::thread(ReadServerConnection, make_shared<ServerConnection>(Conn), ref(Queue)).detach();
     }
 }
 
-Function *PrototypeAST::codegen() {
-    // Create the function type: double(double,double) etc.
-    vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+// Compile Server
+// With --compile-server, the calculator does code generation for Engines in other processes, so that LLVM's compile-time memory stays out of long-lived evaluators. An evaluator sends each expression's tree and maps only the object code that comes back; the protocol is described in engine_internal.h. Every connection gets a thread, with LLVM state of its own, and any number of evaluators can share one server.
 
-    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+/// ServeCompileConnection - Answer one evaluator's compile requests until it disconnects.
+static void ServeCompileConnection(int Conn) {
+    string Request, Response;
+    while (ReceiveFrame(Conn, Request)) {
+        ServeCompileRequest(Request, Response);
+        if (!SendFrame(Conn, Response))
+            break;
+    }
+    close(Conn);
+}
 
-    // Assign names to all arguments.
-    unsigned Idx = 0;
-    for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
+/// RunCompileServer - Serve compile requests on Path forever. Only returns on error.
+static bool RunCompileServer(const string &Path) {
+    int Listener = ListenUnix(Path);
+    if (Listener < 0)
+        return false;
+    fprintf(stderr, "Compile server listening on %s\n", Path.c_str());
 
-    return F;
+    while (true) {
+        int Conn = accept(Listener, nullptr, nullptr);
+        if (Conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            return false;
+        }
+        std::thread(ServeCompileConnection, Conn).detach();
+    }
 }
 
-Function *FunctionAST::codegen() {
-    // First, check if there is an existing function from a previous 'extern' declaration.
-    Function *TheFunction = TheModule->getFunction(Proto->getName());
+// Metrics Export
+// The library keeps the metrics and the tool publishes them. --metrics-file rewrites a file periodically, in the form that node_exporter's textfile collector reads; --metrics-socket answers every connection with the current metrics and closes it.
+
+/// MetricsFileLock - Serializes writes of the metrics file, which the exporter thread and the exit path share along with its temporary.
+static mutex MetricsFileLock;
+/// MetricsFileFinal - Set by the exit path's write, after which the exporter leaves the file alone.
+static bool MetricsFileFinal = false;
+
+/// WriteMetricsFile - Replace Path with the current metrics. The file is renamed into place, so readers never see half of it. Final marks the last write of the process.
+static bool WriteMetricsFile(const string &Path, bool Final = false) {
+    lock_guard<mutex> Guard(MetricsFileLock);
+    if (MetricsFileFinal)
+        return true;
+    MetricsFileFinal = Final;
+    string TmpPath = Path + ".tmp";
+    {
+        error_code EC;
+        raw_fd_ostream OS(TmpPath, EC);
+        if (!EC)
+            OS << FormatMetrics();
+        if (EC || OS.has_error()) {
+            fprintf(stderr, "Error: cannot write metrics to '%s'\n", TmpPath.c_str());
+            OS.clear_error();
+            return false;
+        }
+    }
+    if (rename(TmpPath.c_str(), Path.c_str()) < 0) {
+        fprintf(stderr, "Error: cannot write metrics to '%s': %s\n", Path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-    if (!TheFunction)
-        TheFunction = Proto->codegen();
-    if (!TheFunction)
-        return nullptr;
+/// RunMetricsExporter - Write the metrics file every Interval and serve connections on Listener, if either is given, forever.
+static void RunMetricsExporter(const string &Path, int Listener, chrono::seconds Interval) {
+    auto NextWrite = chrono::steady_clock::now();
+    while (true) {
+        int Timeout = -1;
+        if (!Path.empty()) {
+            auto Now = chrono::steady_clock::now();
+            if (Now >= NextWrite) {
+                WriteMetricsFile(Path);
+                NextWrite = Now + Interval;
+            }
+            Timeout = chrono::duration_cast<chrono::milliseconds>(NextWrite - Now).count() + 1;
+        }
+        if (Listener < 0) {
+            std::this_thread::sleep_for(chrono::milliseconds(Timeout));
+            continue;
+        }
 
-    // Create a new basic block to start inserting into.
-    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-    Builder->SetInsertPoint(BB);
+        pollfd Fd = {Listener, POLLIN, 0};
+        if (poll(&Fd, 1, Timeout) <= 0)
+            continue;
+        int Conn = accept(Listener, nullptr, nullptr);
+        if (Conn < 0)
+            continue;
+        string Text = FormatMetrics();
+        WriteAll(Conn, Text.data(), Text.size());
+        close(Conn);
+    }
+}
 
-    // Record the function arguments in the NamedValues map.
-    NamedValues.clear();
-    for (auto &Arg : TheFunction->args())
-        NamedValues[string(Arg.getName())] = &Arg;
+/// StartMetricsExporter - Start publishing metrics on a thread of its own. Returns false if the socket cannot be set up.
+static bool StartMetricsExporter(const string &Path, const string &SocketPath, chrono::seconds Interval) {
+    int Listener = -1;
+    if (!SocketPath.empty()) {
+        if ((Listener = ListenUnix(SocketPath)) < 0)
+            return false;
+        // A scraper that hangs up early must not take the calculator down.
+        signal(SIGPIPE, SIG_IGN);
+    }
+    std::thread(RunMetricsExporter, Path, Listener, Interval).detach();
+    return true;
+}
 
-    if (Value *RetVal = Body->codegen()) {
-        // Complete the function.
-        Builder->CreateRet(RetVal);
+// Shared-Memory Server
+// Co-located clients submit requests through the shared-memory ring described in calculator_shm.h. One engine thread serves the ring; it spins while requests keep arriving and parks on a futex when the ring stays empty.
 
-        // Verify the generated code to ensure consistency.
-        verifyFunction(*TheFunction);
+/// ShmExprs - Expressions compiled for shared-memory clients, indexed by the handle the client was given. Only the engine thread touches them.
+static vector<ExprHandle> ShmExprs;
 
-        return TheFunction;
+/// CompleteShmSlot - Record S's outcome and hand the slot back to its client. An empty Error means success.
+static void CompleteShmSlot(CalcShmSlot &S, StringRef Error) {
+    S.Status = Error.empty() ? 0 : 1;
+    if (!Error.empty()) {
+        size_t Len = min<size_t>(Error.size(), CalcShmTextSize - 1);
+        memcpy(S.Text, Error.data(), Len);
+        S.Text[Len] = '\0';
     }
 
-    // Error reading body, remove function.
-    TheFunction->eraseFromParent();
-    return nullptr;
+    S.State.store(CalcShmDone, memory_order_seq_cst);
+    if (S.ClientWaiting.load(memory_order_seq_cst))
+        CalcShmFutexWake(S.State);
 }
 
-// Top-Level Parsing and JIT Driver
+/// ServeShmSlot - Carry out the request in S on TheEngine and hand the slot back to its client.
+static void ServeShmSlot(Engine &TheEngine, CalcShmSlot &S) {
+    string Error;
+    switch (S.Op) {
+    case CalcShmCompile: {
+        ExprHandle H = TheEngine.compile(S.Text, strnlen(S.Text, CalcShmTextSize));
+        if (!H) {
+            Error = TheEngine.getError();
+            break;
+        }
+        S.Handle = ShmExprs.size();
+        S.NumArgs = H.getNumArgs();
+        ShmExprs.push_back(H);
+        break;
+    }
+    case CalcShmEval:
+        if (S.Handle >= ShmExprs.size())
+            Error = "unknown expression handle";
+        else if (S.NumArgs != ShmExprs[S.Handle].getNumArgs())
+            Error = "wrong number of arguments";
+        else {
+            PhaseTimer Timer(PhaseExecute);
+            LatencyTimer Latency(LatencyNative);
+            S.Result = TheEngine.eval(ShmExprs[S.Handle], S.Args);
+            NoteExecutedRows(1);
+        }
+        break;
+    default:
+        Error = "unknown request";
+        break;
+    }
+    CompleteShmSlot(S, Error);
+}
+
+/// ShmBatch - Valid evaluations of one expression, gathered from different clients so that a single batch kernel call serves them all.
+struct ShmBatch {
+    uint32_t Handle = 0;
+    vector<CalcShmSlot *> Slots;
+    vector<uint64_t> Taken; // When each slot was taken off the ring, while latencies are recorded.
+    chrono::steady_clock::time_point Deadline; // When to stop waiting for more.
+    vector<double> Args, Results;              // Scratch space for the kernel.
+
+    /// accepts - Whether S can join a batch at all, i.e. is a well-formed evaluation.
+    static bool accepts(const CalcShmSlot &S) {
+        return S.Op == CalcShmEval && S.Handle < ShmExprs.size() && S.NumArgs == ShmExprs[S.Handle].getNumArgs();
+    }
+
+    /// flush - Evaluate every gathered call and complete its slot.
+    void flush(Engine &TheEngine) {
+        if (Slots.size() == 1) {
+            ServeShmSlot(TheEngine, *Slots[0]);
+        } else if (!Slots.empty()) {
+            // Transpose the rows into the kernel's column-major layout, and scatter the results back.
+            size_t Count = Slots.size();
+            TraceSpan Span("batch", "shm", "rows", Count);
+            uint32_t NumArgs = ShmExprs[Handle].getNumArgs();
+            Args.resize(NumArgs * Count);
+            Results.resize(Count);
+            for (size_t I = 0; I < Count; ++I)
+                for (uint32_t J = 0; J < NumArgs; ++J)
+                    Args[J * Count + I] = Slots[I]->Args[J];
+            {
+                PhaseTimer Timer(PhaseExecute);
+                LatencyTimer Latency(LatencyBatch);
+                ShmExprs[Handle].evalBatch(Args.data(), Results.data(), Count);
+            }
+            NoteExecutedRows(Count);
+            for (size_t I = 0; I < Count; ++I) {
+                Slots[I]->Result = Results[I];
+                CompleteShmSlot(*Slots[I], StringRef());
+            }
+        }
+        if (!Taken.empty()) {
+            uint64_t Now = LatencyClock();
+            for (uint64_t T : Taken)
+                RecordLatency(LatencyRequest, Now - T);
+            Taken.clear();
+        }
+        Slots.clear();
+    }
+};
 
-static void InitializeModule() {
-    // Open a new context and module.
-    TheContext = make_unique<LLVMContext>();
-    TheModule = make_unique<Module>("jit", *TheContext);
+/// PollShmRing - Take the slot index published at position Head, if it has been.
+static bool PollShmRing(CalcShmRegion *R, uint64_t Head, uint32_t &Slot) {
+    CalcShmCell &Cell = R->Ring[Head % CalcShmNumSlots];
+    if (Cell.Seq.load(memory_order_acquire) != Head + 1)
+        return false;
+    Slot = Cell.Slot;
+    Cell.Seq.store(Head + CalcShmNumSlots, memory_order_release);
+    return true;
+}
 
-    // Create a new builder for the module.
-    Builder = make_unique<IRBuilder<>>(*TheContext);
+/// ReclaimShmSlots - Free the slots of clients that exited without releasing them. A submitted slot is left until the engine has completed it, so that a slot is never handed out while its index is still on the ring.
+static void ReclaimShmSlots(CalcShmRegion *R) {
+    for (CalcShmSlot &S : R->Slots) {
+        uint32_t State = S.State.load(memory_order_acquire);
+        int32_t Owner = S.OwnerPid.load(memory_order_relaxed);
+        if ((State != CalcShmClaimed && State != CalcShmDone) || !Owner || CalcShmAlive(Owner))
+            continue;
+        S.OwnerPid.store(0, memory_order_relaxed);
+        S.State.store(CalcShmFree, memory_order_release);
+    }
 }
 
-static void HandleTopLevelExpression() {
-    // Evaluate a top-level expression into an anonymous function.
-    if (auto FnAST = ParseTopLevelExpr()) {
-        if (auto *FnIR = FnAST->codegen()) {
-            fprintf(stderr, "Generated IR and result:\n");
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
+/// WaitShmRing - Wait for the slot index at position Head: spin first, then park on the engine's futex. Slots of dead clients are reclaimed before parking, and again every second while parked, so that a client finding every slot taken can retry.
+static uint32_t WaitShmRing(CalcShmRegion *R, uint64_t Head) {
+    CalcShmCell &Cell = R->Ring[Head % CalcShmNumSlots];
+    uint32_t Slot;
+    for (unsigned Spins = 0; !PollShmRing(R, Head, Slot);) {
+        if (++Spins < CalcShmSpins) {
+            CalcShmPoll(Spins);
+            continue;
+        }
+        ReclaimShmSlots(R);
+        // Park. A client that publishes after we re-check sees EngineWaiting and bumps EngineWake, so the wait cannot miss it.
+        uint32_t Wake = R->EngineWake.load(memory_order_seq_cst);
+        R->EngineWaiting.store(1, memory_order_seq_cst);
+        static const timespec ReclaimPeriod = {1, 0};
+        if (Cell.Seq.load(memory_order_seq_cst) != Head + 1)
+            CalcShmFutexWait(R->EngineWake, Wake, &ReclaimPeriod);
+        R->EngineWaiting.store(0, memory_order_relaxed);
+        // A client's wake means requests are coming, so spin again; a timeout just reclaims and parks again.
+        if (R->EngineWake.load(memory_order_relaxed) != Wake)
+            Spins = 0;
+    }
+    return Slot;
+}
 
-            // Remove the anonymous expression which will be every expression.
-            FnIR->eraseFromParent();
+/// RunShmServer - Create the region at Path and serve it forever. Evaluations of the same expression that arrive within Window of each other are batched, up to MaxBatch at a time. Expressions are compiled by the compile server at CompileServer, if one is given. Only returns on error.
+static bool RunShmServer(const string &Path, size_t MaxBatch, chrono::microseconds Window,
+                         const string &CompileServer) {
+    CalcShmRegion *R = CalcShmMap(Path.c_str(), /*Create=*/true);
+    if (!R && errno == EADDRINUSE) {
+        fprintf(stderr, "Error: shared-memory region '%s' is already served by a running engine\n", Path.c_str());
+        return false;
+    }
+    if (!R) {
+        fprintf(stderr, "Error: cannot create shared-memory region '%s': %s\n", Path.c_str(), strerror(errno));
+        return false;
+    }
+    // Compiled expressions go through the library interface, into a JIT of their own, and are compiled out of process when a compile server is given.
+    EngineObjectCache = TheObjectCache.get();
+    Engine TheEngine(CompileServer.empty() ? nullptr : CompileServer.c_str());
+    fprintf(stderr, "Shared-memory server ready at %s\n", Path.c_str());
+    SetTraceThreadName("shm server");
+
+    ShmBatch Batch;
+    for (uint64_t Head = 0;;) {
+        uint32_t Slot;
+        if (Batch.Slots.empty()) {
+            Slot = WaitShmRing(R, Head);
         } else {
-            // Skip token for error recovery.
-            getNextToken();
+            // A batch is open: keep gathering until its window closes, then run it.
+            bool Taken;
+            unsigned Spins = 0;
+            while (!(Taken = PollShmRing(R, Head, Slot)) && chrono::steady_clock::now() < Batch.Deadline)
+                CalcShmPoll(++Spins);
+            if (!Taken) {
+                Batch.flush(TheEngine);
+                continue;
+            }
         }
+        ++Head;
+        if (Slot >= CalcShmNumSlots)
+            continue;
+
+        CalcShmSlot &S = R->Slots[Slot];
+        if (MaxBatch < 2 || !ShmBatch::accepts(S)) {
+            Batch.flush(TheEngine);
+            LatencyTimer Latency(LatencyRequest);
+            ServeShmSlot(TheEngine, S);
+            continue;
+        }
+        if (!Batch.Slots.empty() && Batch.Handle != S.Handle)
+            Batch.flush(TheEngine);
+        if (Batch.Slots.empty()) {
+            Batch.Handle = S.Handle;
+            Batch.Deadline = chrono::steady_clock::now() + Window;
+        }
+        Batch.Slots.push_back(&S);
+        if (RecordLatencies)
+            Batch.Taken.push_back(LatencyClock());
+        if (Batch.Slots.size() >= MaxBatch)
+            Batch.flush(TheEngine);
     }
 }
 
-/// top ::= expression | ';'
-static void MainLoop() {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurTok) {
-        case tok_eof:
+// Sharded Batch Coordinator
+// With --shards, the calculator splits its batch input into contiguous byte ranges and runs each through a worker process. A worker is an ordinary "calculator --batch" that reads its shard on stdin and writes batch records on stdout, so the protocol is the batch format itself. The coordinator renumbers the records and writes them out in input order; a worker that fails is re-run from the start of its shard.
+// The coordinator's memory does not grow with the input. The input is mapped from a file, and the earliest unfinished shard's records go straight to stdout. Records of later shards, which must wait for it, are spilled to temporary files.
+
+/// Shard - One byte range of the input and the worker running it.
+struct Shard {
+    StringRef Input;
+    size_t Written = 0; // Bytes of Input sent to the worker so far.
+    FILE *Spill = nullptr; // Records held back until the shards before this one are written; null once they stream.
+    string Partial;        // The start of a record whose end has not arrived yet.
+    uint64_t Seen = 0;     // Records received from the current worker so far.
+    uint64_t Emitted = 0;  // Records written to stdout, possibly by an earlier worker for this shard.
+    bool Complete = true;  // The output so far ends with a whole record.
+    pid_t Pid = -1;
+    int In = -1, Out = -1; // The worker's stdin and stdout; -1 once closed.
+    unsigned Attempts = 0;
+    bool Done = false;
+};
+
+/// SplitShards - Cut Input into NumShards ranges of about equal size. Each cut goes just after a ';': the parser is always back at the top level once a ';' has been consumed, so every shard yields exactly the records it would have yielded as part of the whole input.
+static vector<Shard> SplitShards(StringRef Input, unsigned NumShards) {
+    vector<Shard> Shards;
+    size_t Begin = 0;
+    for (unsigned I = 1; I <= NumShards && Begin < Input.size(); ++I) {
+        size_t End = Input.size() * I / NumShards;
+        if (I < NumShards && End > Begin) {
+            End = Input.find(';', End - 1);
+            End = End == StringRef::npos ? Input.size() : End + 1;
+        }
+        if (End <= Begin)
+            continue;
+        Shards.emplace_back();
+        Shards.back().Input = Input.slice(Begin, End);
+        Begin = End;
+    }
+    return Shards;
+}
+
+/// StartShard - Launch a worker for S from the beginning of its input.
+static bool StartShard(Shard &S, const vector<const char *> &WorkerArgv) {
+    int InPipe[2], OutPipe[2];
+    if (pipe2(InPipe, O_CLOEXEC) < 0)
+        return false;
+    if (pipe2(OutPipe, O_CLOEXEC) < 0) {
+        close(InPipe[0]);
+        close(InPipe[1]);
+        return false;
+    }
+
+    pid_t Pid = fork();
+    if (Pid == 0) {
+        dup2(InPipe[0], STDIN_FILENO);
+        dup2(OutPipe[1], STDOUT_FILENO);
+        execv(WorkerArgv[0], const_cast<char *const *>(WorkerArgv.data()));
+        _exit(127);
+    }
+    close(InPipe[0]);
+    close(OutPipe[1]);
+    if (Pid < 0) {
+        close(InPipe[1]);
+        close(OutPipe[0]);
+        return false;
+    }
+
+    fcntl(InPipe[1], F_SETFL, O_NONBLOCK);
+    S.Pid = Pid;
+    S.In = InPipe[1];
+    S.Out = OutPipe[0];
+    S.Written = 0;
+    // A re-run worker produces the same records again. Spilled ones are discarded; ones already written are skipped as they arrive.
+    if (S.Spill) {
+        fclose(S.Spill);
+        S.Spill = nullptr;
+    }
+    S.Partial.clear();
+    S.Seen = 0;
+    S.Complete = true;
+    ++S.Attempts;
+    // An empty shard needs no input at all.
+    if (S.Input.empty()) {
+        close(S.In);
+        S.In = -1;
+    }
+    return true;
+}
+
+/// FinishShard - Reap S's worker once its output has ended. Returns true if it ran to completion; a crash, a non-zero exit or a truncated last record all count as failure.
+static bool FinishShard(Shard &S) {
+    if (S.In >= 0)
+        close(S.In);
+    close(S.Out);
+    S.In = S.Out = -1;
+    int Status;
+    while (waitpid(S.Pid, &Status, 0) < 0 && errno == EINTR)
+        ;
+    S.Pid = -1;
+    return WIFEXITED(Status) && WEXITSTATUS(Status) == 0 && S.Complete;
+}
+
+/// EmitShardOutput - Write Data, the next bytes of S's output, to stdout, renumbering each record to follow the shards before it. Records an earlier worker already wrote are skipped, and an unfinished last record waits in S.Partial.
+static void EmitShardOutput(Shard &S, StringRef Data) {
+    while (!Data.empty()) {
+        size_t End = Data.find('\n');
+        if (End == StringRef::npos) {
+            S.Partial.append(Data.data(), Data.size());
             return;
-        case tok_error:
-        case ';': // Ignore top-level semicolons.
-            getNextToken();
-            break;
-        default:
-            HandleTopLevelExpression();
-            break;
+        }
+        StringRef Line = Data.substr(0, End);
+        Data = Data.substr(End + 1);
+        if (!S.Partial.empty())
+            Line = S.Partial.append(Line.data(), Line.size());
+        if (S.Seen++ >= S.Emitted) {
+            outs() << ++BatchSeq << Line.substr(Line.find('\t')) << '\n';
+            ++S.Emitted;
+        }
+        S.Partial.clear();
+    }
+}
+
+/// ReplaySpill - Write the records S has spilled so far, after which its output can stream straight to stdout.
+static void ReplaySpill(Shard &S, char *Buf, size_t Size) {
+    if (!S.Spill)
+        return;
+    rewind(S.Spill);
+    while (size_t N = fread(Buf, 1, Size, S.Spill))
+        EmitShardOutput(S, StringRef(Buf, N));
+    fclose(S.Spill);
+    S.Spill = nullptr;
+}
+
+/// RunShardCoordinator - Evaluate Input across NumShards workers started with WorkerArgv, retrying each failed shard up to MaxRetries times. Writes the merged records to stdout.
+static bool RunShardCoordinator(StringRef Input, unsigned NumShards, unsigned MaxRetries,
+                                const vector<const char *> &WorkerArgv) {
+    // A worker that dies mid-shard must not take the coordinator down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<Shard> Shards = SplitShards(Input, NumShards);
+    for (Shard &S : Shards) {
+        if (!StartShard(S, WorkerArgv)) {
+            fprintf(stderr, "Error: cannot start worker: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    size_t NextToEmit = 0;
+    char Buf[1 << 16];
+    while (NextToEmit < Shards.size()) {
+        vector<pollfd> Fds;
+        vector<Shard *> Owners;
+        for (Shard &S : Shards) {
+            if (S.In >= 0) {
+                Fds.push_back({S.In, POLLOUT, 0});
+                Owners.push_back(&S);
+            }
+            if (S.Out >= 0) {
+                Fds.push_back({S.Out, POLLIN, 0});
+                Owners.push_back(&S);
+            }
+        }
+        if (poll(Fds.data(), Fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        for (size_t I = 0; I < Fds.size(); ++I) {
+            Shard &S = *Owners[I];
+            if (!Fds[I].revents)
+                continue;
+            if (Fds[I].fd == S.In) {
+                ssize_t N = write(S.In, S.Input.data() + S.Written, S.Input.size() - S.Written);
+                if (N > 0)
+                    S.Written += N;
+                // Close the worker's stdin once its shard is sent, or once it has stopped reading.
+                if ((N < 0 && errno != EAGAIN && errno != EINTR) || S.Written == S.Input.size()) {
+                    close(S.In);
+                    S.In = -1;
+                }
+                continue;
+            }
+
+            ssize_t N = read(S.Out, Buf, sizeof(Buf));
+            if (N > 0) {
+                S.Complete = Buf[N - 1] == '\n';
+                if (&S == &Shards[NextToEmit]) {
+                    EmitShardOutput(S, StringRef(Buf, N));
+                } else if (!(S.Spill || (S.Spill = tmpfile())) || fwrite(Buf, 1, N, S.Spill) != size_t(N)) {
+                    fprintf(stderr, "Error: cannot spill shard records to a temporary file: %s\n", strerror(errno));
+                    return false;
+                }
+                continue;
+            }
+            if (N < 0 && errno == EINTR)
+                continue;
+            if (FinishShard(S)) {
+                S.Done = true;
+                continue;
+            }
+            if (S.Attempts > MaxRetries) {
+                fprintf(stderr, "Error: shard %zu failed after %u attempts; giving up\n", size_t(&S - Shards.data()), S.Attempts);
+                return false;
+            }
+            fprintf(stderr, "Error: worker for shard %zu failed; re-running the shard\n", size_t(&S - Shards.data()));
+            if (!StartShard(S, WorkerArgv)) {
+                fprintf(stderr, "Error: cannot start worker: %s\n", strerror(errno));
+                return false;
+            }
+        }
+
+        // Records go out in input order. Each finished shard makes way for the next, whose spilled records are written before the rest of its output streams through.
+        while (NextToEmit < Shards.size()) {
+            ReplaySpill(Shards[NextToEmit], Buf, sizeof(Buf));
+            if (!Shards[NextToEmit].Done)
+                break;
+            ++NextToEmit;
         }
     }
+    return true;
 }
 
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 
-int main() {
-    // Set up standard binary operators.
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['>'] = 10;
-    BinopPrecedence['='] = 10; // For checking if the two sides are equal
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40;
-    BinopPrecedence['/'] = 40;
+/// CalculatorCategory - The tool's own options. --help lists only these, rather than every option LLVM's libraries register.
+static cl::OptionCategory CalculatorCategory("Calculator options");
+
+static cl::opt<string> ObjectCachePath("object-cache",
+                                       cl::desc("Share compiled object code with other calculator processes through this file"),
+                                       cl::value_desc("path"), cl::cat(CalculatorCategory));
+static cl::opt<string> SnapshotPath("snapshot",
+                                    cl::desc("Restore the session from this file at startup and save it there at exit"),
+                                    cl::value_desc("path"), cl::cat(CalculatorCategory));
+static cl::opt<bool> Batch("batch", cl::desc("Read expressions without prompting and write one tab-separated record per expression to stdout"),
+                           cl::cat(CalculatorCategory));
+static cl::opt<bool> Pipeline("pipeline",
+                              cl::desc("Run batch mode as parse, codegen, compile and execute stages on separate threads (implies --batch)"),
+                              cl::cat(CalculatorCategory));
+static cl::opt<unsigned> NumShards("shards",
+                                   cl::desc("Split batch input across this many worker processes and merge their records in order (implies --batch)"),
+                                   cl::init(0), cl::cat(CalculatorCategory));
+static cl::opt<unsigned> ShardRetries("shard-retries", cl::desc("How many times a failed shard is re-run before giving up"),
+                                      cl::init(2), cl::cat(CalculatorCategory));
+static cl::opt<bool> TimeReport("time-report",
+                                cl::desc("Time each phase of handling an expression, per expression and in total, and report on stderr"),
+                                cl::cat(CalculatorCategory));
+static cl::opt<bool> HWCounters("hw-counters",
+                                cl::desc("Count cycles, instructions, cache misses, branch misses and iTLB misses in each phase with perf_event_open, and report IPC and misses per expression on stderr"),
+                                cl::cat(CalculatorCategory));
+static cl::opt<string> TracePath("trace",
+                                 cl::desc("Write Chrome trace events of every phase, expression, pipeline queue and batch to this file, for Perfetto"),
+                                 cl::value_desc("file"), cl::cat(CalculatorCategory));
+static cl::opt<bool> LatencyStats("latency-stats",
+                                  cl::desc("Record latency histograms of requests and of each execution tier; report percentiles at exit and on the 'stats' command"),
+                                  cl::cat(CalculatorCategory));
+static cl::opt<bool> MemoryReport("memory-report",
+                                  cl::desc("Report the memory each expression takes to build, and memory by subsystem at exit, on stderr"),
+                                  cl::cat(CalculatorCategory));
+static cl::opt<bool> PerfMap("perf-map",
+                             cl::desc("Append JIT-compiled functions to /tmp/perf-<pid>.map, named after their expressions"),
+                             cl::cat(CalculatorCategory));
+static cl::opt<bool> PerfJITDump("perf-jitdump", cl::desc("Write a jitdump file for 'perf inject --jit'"),
+                                 cl::cat(CalculatorCategory));
+static cl::opt<bool> BatchDumpIR("dump-ir", cl::desc("Print the IR of every expression in batch mode"),
+                                 cl::cat(CalculatorCategory));
+static cl::opt<string> ForkServerPath("fork-server",
+                                      cl::desc("Initialize once, then serve each connection on this Unix socket from a forked child"),
+                                      cl::value_desc("socket"), cl::cat(CalculatorCategory));
+static cl::opt<string> ServerPath("server",
+                                  cl::desc("Serve length-prefixed expression requests on this Unix socket"),
+                                  cl::value_desc("socket"), cl::cat(CalculatorCategory));
+static cl::opt<unsigned> ServerWorkers("workers",
+                                       cl::desc("Number of server workers, each with its own LLVM context and JIT (default: one per CPU)"),
+                                       cl::init(0), cl::cat(CalculatorCategory));
+static cl::opt<string> ShmServerPath("shm-server",
+                                     cl::desc("Serve co-located clients through a shared-memory ring at this path"),
+                                     cl::value_desc("path"), cl::cat(CalculatorCategory));
+static cl::opt<unsigned> ShmMaxBatch("shm-max-batch",
+                                     cl::desc("Largest number of evaluations the shared-memory server runs through one batch kernel call (1 disables batching)"),
+                                     cl::init(CalcShmNumSlots), cl::cat(CalculatorCategory));
+static cl::opt<unsigned> ShmBatchWindow("shm-batch-window",
+                                        cl::desc("Microseconds the shared-memory server waits for more evaluations of the same expression before running a batch"),
+                                        cl::init(2), cl::cat(CalculatorCategory));
+static cl::opt<string> CompileServerPath("compile-server",
+                                         cl::desc("Serve compile requests from other processes' engines on this Unix socket"),
+                                         cl::value_desc("socket"), cl::cat(CalculatorCategory));
+static cl::opt<string> RemoteCompilePath("remote-compile",
+                                         cl::desc("Have the shared-memory server's engine compile through the compile server at this socket"),
+                                         cl::value_desc("socket"), cl::cat(CalculatorCategory));
+static cl::opt<string> MetricsPath("metrics-file",
+                                   cl::desc("Keep the metrics in this file, in Prometheus text format, rewriting it periodically and at exit"),
+                                   cl::value_desc("path"), cl::cat(CalculatorCategory));
+static cl::opt<string> MetricsSocketPath("metrics-socket",
+                                         cl::desc("Send the metrics, in Prometheus text format, to every connection on this Unix socket"),
+                                         cl::value_desc("socket"), cl::cat(CalculatorCategory));
+static cl::opt<unsigned> MetricsInterval("metrics-interval", cl::desc("Seconds between rewrites of the metrics file"),
+                                         cl::init(10), cl::cat(CalculatorCategory));
+static cl::opt<string> ConnectPath("connect",
+                                   cl::desc("Run a session on the fork server listening on this Unix socket"),
+                                   cl::value_desc("socket"), cl::cat(CalculatorCategory));
+
+int main(int argc, char **argv) {
+    cl::HideUnrelatedOptions(CalculatorCategory);
+    cl::ParseCommandLineOptions(argc, argv, "LLVM expression calculator\n");
+
+    if (!ConnectPath.empty())
+        return RunForkClient(ConnectPath);
+
+    if (!TracePath.empty() && NumShards) {
+        fprintf(stderr, "Error: --trace cannot be combined with --shards; trace one process with --pipeline instead\n");
+        return 1;
+    }
 
-    // Initialize the first token.
-    fprintf(stderr, "ready> ");
-    getNextToken();
+    if (NumShards) {
+        // The coordinator only splits, relays and merges; the workers do the evaluating. The input is mapped rather than read, so input from a pipe is first copied to a temporary file.
+        int InputFD = STDIN_FILENO;
+        struct stat InputStat;
+        if (fstat(InputFD, &InputStat) == 0 && !S_ISREG(InputStat.st_mode)) {
+            FILE *Copy = tmpfile();
+            char Buf[1 << 16];
+            ssize_t N = 0;
+            while (Copy && (N = read(STDIN_FILENO, Buf, sizeof(Buf))) != 0) {
+                if (N < 0 && errno == EINTR)
+                    continue;
+                if (N < 0 || fwrite(Buf, 1, N, Copy) != size_t(N))
+                    break;
+            }
+            if (!Copy || N != 0 || fflush(Copy) != 0) {
+                fprintf(stderr, "Error: cannot copy input to a temporary file: %s\n", strerror(errno));
+                return 1;
+            }
+            InputFD = fileno(Copy);
+        }
+        auto InputOrErr = MemoryBuffer::getOpenFile(sys::fs::convertFDToNativeFile(InputFD), "<stdin>", -1,
+                                                    /*RequiresNullTerminator=*/false);
+        if (!InputOrErr) {
+            fprintf(stderr, "Error: cannot read input: %s\n", InputOrErr.getError().message().c_str());
+            return 1;
+        }
+        string Self = sys::fs::getMainExecutable(argv[0], (void *)&main);
+        vector<string> Args = {Self, "--batch"};
+        if (Pipeline)
+            Args.push_back("--pipeline");
+        if (BatchDumpIR)
+            Args.push_back("--dump-ir");
+        if (!ObjectCachePath.empty())
+            Args.push_back("--object-cache=" + ObjectCachePath);
+        if (PerfMap)
+            Args.push_back("--perf-map");
+        if (PerfJITDump)
+            Args.push_back("--perf-jitdump");
+        vector<const char *> WorkerArgv;
+        for (const string &Arg : Args)
+            WorkerArgv.push_back(Arg.c_str());
+        WorkerArgv.push_back(nullptr);
+
+        outs().SetBufferSize(1 << 20);
+        bool OK = RunShardCoordinator((*InputOrErr)->getBuffer(), NumShards, ShardRetries, WorkerArgv);
+        outs().flush();
+        return OK ? 0 : 1;
+    }
+
+    ReportTimes = TimeReport;
+    ReportMemory = MemoryReport;
+    RecordLatencies = LatencyStats;
+    MeasureModuleHeap = MemoryReport;
+    ReportCounters = HWCounters;
+    TimePhases.store(TimeReport || !MetricsPath.empty() || !MetricsSocketPath.empty(), memory_order_relaxed);
+    if (HWCounters) {
+        // A forked child would inherit counters that count its parent's threads.
+        if (!ForkServerPath.empty()) {
+            fprintf(stderr, "Error: hardware counters cannot be used with a fork server\n");
+            return 1;
+        }
+        if (!EnableHardwareCounters())
+            return 1;
+    }
+    if (!TracePath.empty()) {
+        if (!ForkServerPath.empty()) {
+            fprintf(stderr, "Error: a fork server cannot be traced\n");
+            return 1;
+        }
+        if (!StartTracing(TracePath))
+            return 1;
+        SetTraceThreadName("main");
+    }
+
+    // Set up the native target and the standard binary operators.
+    InitializeCalculator();
+    if (PerfMap || PerfJITDump)
+        EnablePerfSupport(PerfMap, PerfJITDump);
+
+    TrackSession = !SnapshotPath.empty();
+    if (!ObjectCachePath.empty() || TrackSession) {
+        unique_ptr<SharedObjectStore> Store;
+        if (!ObjectCachePath.empty() && !(Store = SharedObjectStore::open(ObjectCachePath)))
+            return 1;
+        TheObjectCache = make_unique<JITObjectCache>(move(Store), TrackSession);
+    }
+
+    if (!MetricsPath.empty() || !MetricsSocketPath.empty()) {
+        // The fork server must stay single-threaded until it forks.
+        if (!ForkServerPath.empty()) {
+            fprintf(stderr, "Error: metrics cannot be exported from a fork server\n");
+            return 1;
+        }
+        if (!StartMetricsExporter(MetricsPath, MetricsSocketPath, chrono::seconds(max(1u, unsigned(MetricsInterval)))))
+            return 1;
+    }
+
+    if (!CompileServerPath.empty()) {
+        // The compile server has no JIT of its own; its objects go through the cache like an Engine's would.
+        EngineObjectCache = TheObjectCache.get();
+        RunCompileServer(CompileServerPath);
+        return 1;
+    }
+
+    auto MainJIT = ExitOnErr(CreateJIT(TheObjectCache.get()));
+    TheJIT = MainJIT.get();
 
     // Create the module, which holds all the code.
     InitializeModule();
 
+    if (TrackSession && !RestoreSnapshot(SnapshotPath))
+        return 1;
+
+    if (!ForkServerPath.empty() && !RunForkServer(ForkServerPath))
+        return 1;
+
+    if (!ShmServerPath.empty()) {
+        RunShmServer(ShmServerPath, ShmMaxBatch, chrono::microseconds(ShmBatchWindow), RemoteCompilePath);
+        return 1;
+    }
+
+    if (!ServerPath.empty()) {
+        unsigned NumWorkers = ServerWorkers ? ServerWorkers : max(1u, std::thread::hardware_concurrency());
+        RunServer(ServerPath, NumWorkers);
+        return 1;
+    }
+
+    BatchMode = Batch || Pipeline;
+    CollectErrors = BatchMode;
+    DumpIR = !BatchMode || BatchDumpIR;
+    if (BatchMode)
+        outs().SetBufferSize(1 << 20);
+
+    // Initialize the first token.
+    if (!BatchMode)
+        fprintf(stderr, "ready> ");
+    getNextToken();
+
     // Run the main "interpreter loop" now.
-    MainLoop();
+    if (Pipeline)
+        PipelinedMainLoop();
+    else
+        MainLoop();
 
     // Print out all of the generated code.
-    TheModule->print(errs(), nullptr);
+    if (DumpIR)
+        TheModule->print(errs(), nullptr);
+    outs().flush();
+
+    if (ReportTimes || ReportCounters)
+        MergePhaseTimes();
+    if (ReportTimes)
+        PrintTimeReport();
+    if (ReportCounters)
+        PrintCounterReport();
+    if (ReportMemory)
+        PrintMemoryReport();
+    if (RecordLatencies)
+        PrintLatencyStats();
+    FinishTracing();
+    if (!MetricsPath.empty() && !WriteMetricsFile(MetricsPath, /*Final=*/true))
+        return 1;
+
+    if (TrackSession && !SaveSnapshot(SnapshotPath))
+        return 1;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+//===- calculator.h - Embeddable expression calculator ----------*- C++ -*-===//
+//
+// The calculator as a library. An Engine compiles an expression to native
+// code once; the handle it returns is then evaluated directly, with no
+// parsing, text formatting or I/O on the way. C callers use calculator_c.h.
+//
+// Expressions use the calculator's syntax. Their variables become arguments,
+// numbered in order of first appearance: "y * 2 + x" takes Args[0] = y and
+// Args[1] = x.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CALCULATOR_H
+#define CALCULATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+
+namespace calculator {
+
+/// ExprHandle - A compiled expression. Handles are plain values: copy them freely and evaluate them from any thread for as long as the Engine that compiled them lives.
+class ExprHandle {
+    friend class Engine;
+
+    double (*Entry)(const double *Args) = nullptr;
+    void (*Batch)(const double *Args, double *Results, uint64_t Count) = nullptr;
+    uint32_t NumArgs = 0;
+
+public:
+    /// isValid - False for the handle returned by a failed compile.
+    bool isValid() const { return Entry != nullptr; }
+    explicit operator bool() const { return isValid(); }
+
+    /// getNumArgs - How many argument values evaluating the expression reads.
+    uint32_t getNumArgs() const { return NumArgs; }
+
+    /// eval - Run the expression on Args, which must hold getNumArgs() values.
+    double eval(const double *Args) const { return Entry(Args); }
+
+    /// evalBatch - Run the expression on Count rows at once through its vectorized batch kernel. Args is column-major: argument J of row I is Args[J * Count + I], and Results[I] receives row I's value.
+    void evalBatch(const double *Args, double *Results, size_t Count) const { Batch(Args, Results, Count); }
+};
+
+/// PendingExpr - An expression whose native code is still being compiled in the background. It can be evaluated straight away: until the code is ready, eval interprets the expression instead.
+class PendingExpr {
+    friend class Engine;
+
+public:
+    struct State;
+
+    /// isValid - False if the expression did not parse; Engine::getError() says why.
+    bool isValid() const { return S != nullptr; }
+    explicit operator bool() const { return isValid(); }
+
+    uint32_t getNumArgs() const;
+
+    /// isReady - Whether the compiled code is in place, so that eval no longer interprets.
+    bool isReady() const;
+
+    /// getFuture - The compiled handle, for hosts that want to wait for it or be told about it.
+    std::shared_future<ExprHandle> getFuture() const { return Compiled; }
+
+    /// eval - Run the expression on Args, which must hold getNumArgs() values. Uses the compiled code once it is ready, and the interpreter until then.
+    double eval(const double *Args) const;
+
+private:
+    std::shared_ptr<State> S;
+    std::shared_future<ExprHandle> Compiled;
+};
+
+/// Engine - Compiles expressions into a JIT of its own. Engines are independent of each other and of the calculator tool; compile may be called from several threads at once. Errors never end the host: if the JIT cannot be set up, the engine is still created, but every compile fails and getError() says why.
+class Engine {
+public:
+    Engine();
+    /// Engine - An engine whose expressions are compiled by the compile server listening on the Unix socket CompileServer (see calculator --compile-server). Only finished machine code is loaded into this process, which keeps LLVM's code generation out of its memory. If the server cannot be reached, compiles fail and getError() says why. A null CompileServer compiles in-process, like Engine().
+    explicit Engine(const char *CompileServer);
+    ~Engine();
+    Engine(const Engine &) = delete;
+    Engine &operator=(const Engine &) = delete;
+
+    /// compile - Compile the expression in Src[0, Len). On failure returns an invalid handle, and getError() says why. Identical expressions compiled at the same time share one compile and get the same handle, as do later ones while the engine still remembers that compile (the 4096 most recent). Each engine coalesces only its own compiles, because a handle's code lives in its engine's JIT.
+    ExprHandle compile(const char *Src, size_t Len);
+    ExprHandle compile(const std::string &Src) { return compile(Src.data(), Src.size()); }
+
+    /// compileAsync - Parse the expression in Src[0, Len) now and compile it on the engine's background thread. Returns at once; parse errors give an invalid result, and getError() says why.
+    PendingExpr compileAsync(const char *Src, size_t Len);
+    PendingExpr compileAsync(const std::string &Src) { return compileAsync(Src.data(), Src.size()); }
+
+    /// explain - Describe what the expression in Src[0, Len) costs to run over many rows on the host CPU: the optimized IR and the assembly of its batch kernel, then llvm-mca's simulation of the kernel's loop, with cycles per row, pressure on each execution port, and the bottleneck. Nothing is added to the engine. On failure returns false, and getError() says why.
+    bool explain(const char *Src, size_t Len, std::string &Report);
+    bool explain(const std::string &Src, std::string &Report) { return explain(Src.data(), Src.size(), Report); }
+
+    /// eval - Run a compiled expression on Args, which must hold H.getNumArgs() values.
+    double eval(ExprHandle H, const double *Args) const { return H.eval(Args); }
+
+    /// define - Compile the expression in Src[0, Len) and bind it to Name, atomically replacing any previous definition. Calls already running the old code finish on it, and its code is freed once no call can reach it any more. On failure the old definition stays, and getError() says why.
+    bool define(const char *Name, const char *Src, size_t Len);
+    bool define(const char *Name, const std::string &Src) { return define(Name, Src.data(), Src.size()); }
+
+    /// undefine - Remove Name's definition, freeing its code the same way. Returns false if Name was not defined.
+    bool undefine(const char *Name);
+
+    /// call - Run the expression bound to Name on NumArgs argument values. The lookup never takes a lock, so any number of threads can call concurrently with each other and with define. Returns false if Name is undefined or takes a different number of arguments.
+    bool call(const char *Name, const double *Args, uint32_t NumArgs, double &Result) const;
+
+    /// getError - The message for the most recent failed compile.
+    std::string getError() const;
+
+    struct Impl;
+
+private:
+    std::unique_ptr<Impl> TheImpl;
+};
+
+/// EnableLatencyStats - Start recording latency histograms of evaluations through PendingExpr::eval, split by whether the interpreter or compiled code ran, and of Engine::call. Recording is off by default, which keeps clock reads out of those calls; ExprHandle::eval is never timed.
+void EnableLatencyStats();
+
+/// FormatLatencyStats - The latencies recorded so far as a table: count, p50, p99, p99.9 and maximum for each kind.
+std::string FormatLatencyStats();
+
+/// StartTrace - Record Chrome trace events, for Perfetto or chrome://tracing, into the file at Path: each phase of every compile and evaluation, and each background compile job, on a track per thread. Call before creating any Engine. Returns false if the file cannot be created.
+bool StartTrace(const char *Path);
+
+/// FinishTrace - Write out the events still buffered and complete the trace file. Call once no Engine is compiling.
+void FinishTrace();
+
+/// FormatMetrics - The process's calculator metrics in the Prometheus text format: expressions parsed and rejected, object cache hits and misses, compiles by tier, JIT code size, and per-phase latency histograms.
+std::string FormatMetrics();
+
+} // namespace calculator
+
+#endif // CALCULATOR_H
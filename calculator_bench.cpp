@@ -0,0 +1,273 @@
+#include "calculator_corpus.h"
+#include "engine_internal.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/ErrorHandling.h"
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <malloc.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std; // Added to use standard library components without std:: prefix
+using namespace calculator;
+
+// Memory Measurement
+// Google Benchmark runs each benchmark once more with a memory manager attached, and reports its allocations per iteration and peak bytes. Ours counts what goes through operator new, which is how the syntax tree and nearly all of LLVM allocate; LLVM's small vectors, which call malloc directly, go uncounted.
+
+static atomic<bool> CountingAllocs{false};
+static atomic<int64_t> NumAllocs{0}, AllocatedBytes{0}, LiveBytes{0}, PeakBytes{0};
+
+static void NoteAlloc(void *P) {
+    int64_t Size = malloc_usable_size(P);
+    NumAllocs.fetch_add(1, memory_order_relaxed);
+    AllocatedBytes.fetch_add(Size, memory_order_relaxed);
+    int64_t Live = LiveBytes.fetch_add(Size, memory_order_relaxed) + Size;
+    int64_t Peak = PeakBytes.load(memory_order_relaxed);
+    while (Live > Peak && !PeakBytes.compare_exchange_weak(Peak, Live, memory_order_relaxed))
+        ;
+}
+
+void *operator new(size_t Size) {
+    void *P = malloc(Size ? Size : 1);
+    if (!P)
+        report_bad_alloc_error("operator new failed");
+    if (CountingAllocs.load(memory_order_relaxed))
+        NoteAlloc(P);
+    return P;
+}
+
+void operator delete(void *P) noexcept {
+    // Frees of memory allocated before Start make LiveBytes negative, which leaves the peak measured from Start.
+    if (P && CountingAllocs.load(memory_order_relaxed))
+        LiveBytes.fetch_sub(malloc_usable_size(P), memory_order_relaxed);
+    free(P);
+}
+
+void operator delete(void *P, size_t) noexcept {
+    operator delete(P);
+}
+
+/// HeapMemoryManager - Reports what the operator new counters saw between Start and Stop.
+class HeapMemoryManager : public benchmark::MemoryManager {
+public:
+    void Start() override {
+        NumAllocs = AllocatedBytes = LiveBytes = PeakBytes = 0;
+        CountingAllocs = true;
+    }
+    void Stop(Result &R) override {
+        CountingAllocs = false;
+        R.num_allocs = NumAllocs;
+        R.max_bytes_used = PeakBytes;
+        R.total_allocated_bytes = AllocatedBytes;
+        R.net_heap_growth = LiveBytes;
+    }
+    void Stop(Result *R) override { Stop(*R); }
+};
+
+// Synthetic Inputs
+// Every benchmark takes its size N from its range argument, so that each reports a scaling curve and its fitted complexity. Inputs come from the corpus generator with its default seed, so every run measures the same expressions. Expressions use variables wherever they are compiled, because IRBuilder folds constant arithmetic away and would leave nothing to measure.
+
+/// ShapedExpr - One expression of the given shape and size N: N terms for a chain, N levels for nesting. Its terms are drawn from 64 variables.
+static string ShapedExpr(CorpusOptions::ShapeKind Shape, int64_t N) {
+    CorpusOptions Opts;
+    Opts.Shape = Shape;
+    Opts.Width = N;
+    Opts.Depth = N;
+    Opts.NumVars = 64;
+    Opts.VarShare = 1;
+    return CorpusGenerator(Opts).next();
+}
+
+/// ChainExpr - "x0 + x1 * x2 - x3 ..." with N terms: a long, flat expression for ParseBinOpRHS's loop.
+static string ChainExpr(int64_t N) {
+    return ShapedExpr(CorpusOptions::Chain, N);
+}
+
+/// LexInput - N tokens of mixed identifiers, numbers and operators, as a batch file would hold them.
+static string LexInput(int64_t N) {
+    CorpusOptions Opts;
+    Opts.Shape = CorpusOptions::Chain;
+    Opts.Width = 8; // 15 tokens and a ';'
+    Opts.Literals = CorpusOptions::Reals;
+    Opts.NumVars = 97;
+    CorpusGenerator Gen(Opts);
+    string Src;
+    for (int64_t I = 0; I < N; I += 16)
+        Src += Gen.next() + ";\n";
+    return Src;
+}
+
+/// BenchJIT - One JIT for the whole run, set up like the tool's, and the calling thread's code generation state pointed at it.
+static orc::LLJIT &BenchJIT() {
+    static unique_ptr<orc::LLJIT> JIT = [] {
+        InitializeCalculator();
+        return ExitOnErr(CreateJIT(nullptr));
+    }();
+    TheJIT = JIT.get();
+    CollectErrors = true;
+    return *JIT;
+}
+
+/// ParseBody - Parse Src, with its variables as parameters.
+static unique_ptr<ExprAST> ParseBody(StringRef Src, vector<string> &Params) {
+    Params.clear();
+    auto Body = ParseSource(Src, &Params);
+    if (!Body) {
+        fprintf(stderr, "Error: benchmark input does not parse: %s\n", PendingError.c_str());
+        exit(1);
+    }
+    return Body;
+}
+
+/// CodegenFunction - Generate "__bench" from Src into a fresh module, as the Engine does before compiling.
+static Function *CodegenFunction(StringRef Src) {
+    vector<string> Params;
+    auto Body = ParseBody(Src, Params);
+    InitializeModule();
+    FunctionAST FnAST(make_unique<PrototypeAST>("__bench", move(Params)), move(Body));
+    return FnAST.codegen();
+}
+
+// Lexing and Parsing
+
+static void BM_Lex(benchmark::State &State) {
+    BenchJIT();
+    string Src = LexInput(State.range(0));
+    for (auto _ : State) {
+        SetLexBuffer(Src);
+        int Tokens = 0;
+        while (gettok() != tok_eof)
+            ++Tokens;
+        benchmark::DoNotOptimize(Tokens);
+    }
+    State.SetItemsProcessed(State.iterations() * State.range(0));
+    State.SetComplexityN(State.range(0));
+}
+BENCHMARK(BM_Lex)->RangeMultiplier(4)->Range(16, 1 << 16)->Complexity();
+
+static void BM_ParseChain(benchmark::State &State) {
+    BenchJIT();
+    string Src = ChainExpr(State.range(0));
+    vector<string> Params;
+    for (auto _ : State)
+        benchmark::DoNotOptimize(ParseBody(Src, Params));
+    State.SetItemsProcessed(State.iterations() * State.range(0));
+    State.SetComplexityN(State.range(0));
+}
+// Chains parse left-deep, and every walker loops down the left spine, so chains of 10^6 terms need no more stack than short ones.
+BENCHMARK(BM_ParseChain)->RangeMultiplier(8)->Range(16, 1 << 20)->Complexity();
+
+/// BM_ParseNested - Parentheses nested N deep, on the right ("x0 + (x1 + (...))") or on the left ("((x0 + x1) + x2) ..."). Every level recurses through ParseParenExpr.
+static void BM_ParseNested(benchmark::State &State, CorpusOptions::ShapeKind Shape) {
+    BenchJIT();
+    string Src = ShapedExpr(Shape, State.range(0));
+    vector<string> Params;
+    for (auto _ : State)
+        benchmark::DoNotOptimize(ParseBody(Src, Params));
+    State.SetItemsProcessed(State.iterations() * State.range(0));
+    State.SetComplexityN(State.range(0));
+}
+BENCHMARK_CAPTURE(BM_ParseNested, right, CorpusOptions::RightNested)
+    ->RangeMultiplier(4)
+    ->Range(16, MaxParenDepth)
+    ->Complexity();
+BENCHMARK_CAPTURE(BM_ParseNested, left, CorpusOptions::LeftNested)
+    ->RangeMultiplier(4)
+    ->Range(16, MaxParenDepth)
+    ->Complexity();
+
+// Code Generation
+
+/// BM_Codegen - FunctionAST::codegen, which emits BinaryExprAST::codegen for every operator and then verifies the function; BM_Verify isolates the verifier's share.
+static void BM_Codegen(benchmark::State &State) {
+    BenchJIT();
+    string Src = ChainExpr(State.range(0));
+    vector<string> Params;
+    for (auto _ : State) {
+        State.PauseTiming();
+        auto Body = ParseBody(Src, Params);
+        InitializeModule();
+        FunctionAST FnAST(make_unique<PrototypeAST>("__bench", Params), move(Body));
+        State.ResumeTiming();
+        benchmark::DoNotOptimize(FnAST.codegen());
+    }
+    State.SetItemsProcessed(State.iterations() * State.range(0));
+    State.SetComplexityN(State.range(0));
+}
+BENCHMARK(BM_Codegen)->RangeMultiplier(8)->Range(16, 1 << 20)->Complexity();
+
+static void BM_Verify(benchmark::State &State) {
+    BenchJIT();
+    Function *F = CodegenFunction(ChainExpr(State.range(0)));
+    for (auto _ : State)
+        benchmark::DoNotOptimize(verifyFunction(*F));
+    State.SetItemsProcessed(State.iterations() * State.range(0));
+    State.SetComplexityN(State.range(0));
+}
+BENCHMARK(BM_Verify)->RangeMultiplier(8)->Range(16, 1 << 20)->Complexity();
+
+// JIT Compilation
+
+/// BM_JITCompile - Materialize a generated module to native code and free it again: the work RunAnonExpr does around the call.
+static void BM_JITCompile(benchmark::State &State) {
+    orc::LLJIT &JIT = BenchJIT();
+    string Src = ChainExpr(State.range(0));
+    for (auto _ : State) {
+        State.PauseTiming();
+        CodegenFunction(Src);
+        auto TSM = orc::ThreadSafeModule(move(TheModule), move(TheContext));
+        State.ResumeTiming();
+
+        auto RT = JIT.getMainJITDylib().createResourceTracker();
+        ExitOnErr(JIT.addIRModule(RT, move(TSM)));
+        benchmark::DoNotOptimize(ExitOnErr(JIT.lookup("__bench")).getAddress());
+        ExitOnErr(RT->remove());
+    }
+    State.SetItemsProcessed(State.iterations() * State.range(0));
+    State.SetComplexityN(State.range(0));
+}
+BENCHMARK(BM_JITCompile)->RangeMultiplier(4)->Range(16, 4096)->Unit(benchmark::kMicrosecond)->Complexity();
+
+// End to End
+
+/// BM_TopLevelExpression - Everything HandleTopLevelExpression does for one expression read from the input: lex, parse, generate, JIT-compile, run and free. Its operands are literals, as at the prompt, so IRBuilder folds the arithmetic and the JIT compiles a constant.
+static void BM_TopLevelExpression(benchmark::State &State) {
+    orc::LLJIT &JIT = BenchJIT();
+    CorpusOptions Opts;
+    Opts.Shape = CorpusOptions::Chain;
+    Opts.Width = State.range(0);
+    Opts.Ops = "+";
+    string Src = CorpusGenerator(Opts).next() + ";";
+    for (auto _ : State) {
+        SetLexBuffer(Src);
+        getNextToken();
+        auto FnAST = ParseTopLevelExpr();
+        InitializeModule();
+        FnAST->codegen();
+        auto RT = JIT.getMainJITDylib().createResourceTracker();
+        ExitOnErr(JIT.addIRModule(RT, orc::ThreadSafeModule(move(TheModule), move(TheContext))));
+        auto FP = (double (*)())(intptr_t)ExitOnErr(JIT.lookup("__anon_expr")).getAddress();
+        benchmark::DoNotOptimize(FP());
+        ExitOnErr(RT->remove());
+    }
+    State.SetItemsProcessed(State.iterations() * State.range(0));
+    State.SetComplexityN(State.range(0));
+}
+BENCHMARK(BM_TopLevelExpression)->RangeMultiplier(4)->Range(1, 4096)->Unit(benchmark::kMicrosecond)->Complexity();
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    HeapMemoryManager MemoryManager;
+    benchmark::RegisterMemoryManager(&MemoryManager);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::RegisterMemoryManager(nullptr);
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*===- calculator_c.h - C interface to the calculator library ------*- C -*-===*\
+|*                                                                            *|
+|* A stable C ABI over calculator.h, for callers in C or in other languages   *|
+|* through their foreign function interfaces. Only opaque pointers, sizes and *|
+|* doubles cross it.                                                          *|
+|*                                                                            *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef CALCULATOR_C_H
+#define CALCULATOR_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct CalcOpaqueEngine *CalcEngineRef;
+typedef struct CalcOpaqueExpr *CalcExprRef;
+
+/** Create an engine with a JIT of its own. If the JIT cannot be set up,
+    every compile on the engine fails and CalcGetError says why. */
+CalcEngineRef CalcCreateEngine(void);
+
+/** Create an engine whose expressions are compiled by the compile server
+    listening on the Unix socket CompileServer; only the finished machine code
+    is loaded into this process. */
+CalcEngineRef CalcCreateRemoteEngine(const char *CompileServer);
+
+/** Destroy an engine, together with the code of every expression it compiled. */
+void CalcDisposeEngine(CalcEngineRef Engine);
+
+/** Compile the expression in Src[0, Len). Its variables become arguments in
+    order of first appearance. Returns NULL on failure; CalcGetError then says
+    why. The expression lives as long as its engine. */
+CalcExprRef CalcCompile(CalcEngineRef Engine, const char *Src, size_t Len);
+
+/** The message for the engine's most recent failed compile. The string is
+    owned by the engine and valid until its next CalcCompile. */
+const char *CalcGetError(CalcEngineRef Engine);
+
+/** Compile the expression in Src[0, Len) and bind it to Name, replacing any
+    previous definition. Returns 0 on failure; CalcGetError then says why. */
+int CalcDefine(CalcEngineRef Engine, const char *Name, const char *Src, size_t Len);
+
+/** Remove Name's definition. Returns 0 if Name was not defined. */
+int CalcUndefine(CalcEngineRef Engine, const char *Name);
+
+/** Run the expression bound to Name on NumArgs argument values, storing its
+    value in *Result. Lock-free and safe to call from any thread, including
+    while Name is being redefined. Returns 0 if Name is undefined or takes a
+    different number of arguments. */
+int CalcCall(CalcEngineRef Engine, const char *Name, const double *Args, uint32_t NumArgs, double *Result);
+
+/** How many argument values CalcEval reads for Expr. */
+uint32_t CalcGetNumArgs(CalcExprRef Expr);
+
+/** Run Expr on Args, which must hold CalcGetNumArgs(Expr) values. Safe to call
+    from any thread. */
+double CalcEval(CalcExprRef Expr, const double *Args);
+
+/** Run Expr on Count rows at once through its vectorized batch kernel. Args
+    is column-major: argument J of row I is Args[J * Count + I]. Row I's value
+    is stored in Results[I]. */
+void CalcEvalBatch(CalcExprRef Expr, const double *Args, double *Results, size_t Count);
+
+/** Write the process's calculator metrics, in the Prometheus text format, to
+    Buf as a NUL-terminated string truncated to Size bytes. Returns the length
+    of the full text, so that a caller can retry with a larger buffer. */
+size_t CalcFormatMetrics(char *Buf, size_t Size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CALCULATOR_C_H */
@@ -0,0 +1,68 @@
+#include "calculator_corpus.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <string>
+
+using namespace llvm;
+using namespace std; // Added to use standard library components without std:: prefix
+using namespace calculator;
+
+static cl::opt<uint64_t> Count("count", cl::desc("Number of expressions to write"), cl::init(1000));
+static cl::opt<uint64_t> Seed("seed", cl::desc("Random seed; the same options and seed give the same corpus"),
+                              cl::init(1));
+static cl::opt<CorpusOptions::ShapeKind>
+    Shape("shape", cl::desc("Shape of each expression"), cl::init(CorpusOptions::Random),
+          cl::values(clEnumValN(CorpusOptions::Random, "random",
+                                "Chains of up to --width terms, nesting up to --depth levels of parentheses"),
+                     clEnumValN(CorpusOptions::Chain, "chain", "One flat chain of exactly --width terms"),
+                     clEnumValN(CorpusOptions::RightNested, "right", "a + (b + (c + ...)), --depth levels deep"),
+                     clEnumValN(CorpusOptions::LeftNested, "left", "((a + b) + c) + ..., --depth levels deep"),
+                     clEnumValN(CorpusOptions::Balanced, "balanced",
+                                "A complete binary tree, --depth levels deep")));
+static cl::opt<unsigned> Depth("depth", cl::desc("Nesting depth"), cl::init(3));
+static cl::opt<uint64_t> Width("width", cl::desc("Terms per chain"), cl::init(4));
+static cl::opt<string> Ops("ops", cl::desc("Operators to draw from; repeat one to make it more likely"),
+                           cl::init("+-*/"));
+static cl::opt<double> ParenShare("paren-share", cl::desc("Chance of wrapping a term in redundant parentheses"),
+                                  cl::init(0));
+static cl::opt<CorpusOptions::LiteralKind>
+    Literals("literals", cl::desc("Distribution of numeric literals"), cl::init(CorpusOptions::Digits),
+             cl::values(clEnumValN(CorpusOptions::Digits, "digits", "0 to 9"),
+                        clEnumValN(CorpusOptions::Integers, "integers", "0 to 999999"),
+                        clEnumValN(CorpusOptions::Reals, "reals", "0 to 1000 with three decimals"),
+                        clEnumValN(CorpusOptions::Wide, "wide", "10^-6 to 10^6, even across magnitudes")));
+static cl::opt<unsigned> NumVars("vars", cl::desc("Number of distinct variables; only engines accept them"),
+                                 cl::init(0));
+static cl::opt<double> VarShare("var-share", cl::desc("Chance that a term is a variable"), cl::init(0.5));
+static cl::opt<double> RepeatShare("repeat-share", cl::desc("Chance that a term repeats an earlier one"),
+                                   cl::init(0));
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv,
+                                "Synthetic expression corpus generator\n\n"
+                                "Writes one expression per line, terminated by ';', ready for calculator --batch.\n");
+
+    CorpusOptions Opts;
+    Opts.Shape = Shape;
+    Opts.Depth = Depth;
+    Opts.Width = Width;
+    Opts.Ops = Ops;
+    Opts.ParenShare = ParenShare;
+    Opts.Literals = Literals;
+    Opts.NumVars = NumVars;
+    Opts.VarShare = VarShare;
+    Opts.RepeatShare = RepeatShare;
+    Opts.Seed = Seed;
+    for (char Op : Opts.Ops) {
+        if (Op != '+' && Op != '-' && Op != '*' && Op != '/' && Op != '<' && Op != '>' && Op != '=') {
+            fprintf(stderr, "Error: '%c' is not a binary operator\n", Op);
+            return 1;
+        }
+    }
+
+    CorpusGenerator Gen(Opts);
+    outs().SetBufferSize(1 << 20);
+    for (uint64_t I = 0; I < Count; ++I)
+        outs() << Gen.next() << ";\n";
+    return 0;
+}
@@ -0,0 +1,215 @@
+//===- calculator_corpus.h - Synthetic expression corpora --------*- C++ -*-===//
+//
+// Generates expressions in the calculator's syntax for benchmarks and stress
+// runs. Every knob that shapes the expressions is an option: the shape of the
+// tree, its depth and width, the operators, redundant parentheses, the
+// literals, variables, and how often subexpressions repeat. The same options
+// and seed always produce the same corpus, on any platform: the generator
+// uses its own random number generator rather than <random>, whose
+// distributions vary between standard libraries.
+//
+// Every shape except balanced is generated iteratively. Very large shapes,
+// such as a 10^6-term chain or right-nesting 10^5 deep, can therefore be
+// produced even where the calculator's recursive parser and code generator
+// cannot handle them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CALCULATOR_CORPUS_H
+#define CALCULATOR_CORPUS_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace calculator {
+
+struct CorpusOptions {
+    enum ShapeKind {
+        Random,      // Chains of up to Width terms, whose terms nest up to Depth levels of parentheses.
+        Chain,       // One flat chain of exactly Width terms: "a + b * c - ...".
+        RightNested, // "a + (b + (c + ...))", Depth levels deep.
+        LeftNested,  // "((a + b) + c) + ...", Depth levels deep.
+        Balanced     // A complete binary tree Depth levels deep, fully parenthesized.
+    };
+    enum LiteralKind {
+        Digits,  // 0 to 9
+        Integers, // 0 to 999999
+        Reals,   // 0 to 1000, with three decimals
+        Wide     // 10^-6 to 10^6, spread evenly over the orders of magnitude
+    };
+
+    ShapeKind Shape = Random;
+    unsigned Depth = 3;
+    uint64_t Width = 4;
+    std::string Ops = "+-*/"; // Operators to draw from; repeating one makes it more likely.
+    double ParenShare = 0;    // Chance of wrapping a term in redundant parentheses.
+    LiteralKind Literals = Digits;
+    unsigned NumVars = 0;  // Variables x0 ... x<NumVars-1> may appear when nonzero.
+    double VarShare = 0.5; // Chance that a term is a variable, when there are any.
+    double RepeatShare = 0; // Chance that a term repeats an earlier one instead of being generated afresh.
+    uint64_t Seed = 1;
+};
+
+/// CorpusGenerator - Produces one expression after another, as configured by a CorpusOptions.
+class CorpusGenerator {
+    CorpusOptions Opts;
+    uint64_t RandState;
+    std::vector<std::string> Recent; // Earlier terms that RepeatShare may copy.
+    size_t NextRecent = 0;
+
+    static const size_t MaxRecent = 64;
+
+    /// next64 - splitmix64: small, fast, and fully specified.
+    uint64_t next64() {
+        uint64_t Z = (RandState += 0x9e3779b97f4a7c15);
+        Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9;
+        Z = (Z ^ (Z >> 27)) * 0x94d049bb133111eb;
+        return Z ^ (Z >> 31);
+    }
+    /// below - A number in [0, N).
+    uint64_t below(uint64_t N) { return N ? next64() % N : 0; }
+    /// unit - A number in [0, 1).
+    double unit() { return double(next64() >> 11) / double(uint64_t(1) << 53); }
+    /// chance - True with probability P.
+    bool chance(double P) { return P > 0 && unit() < P; }
+
+    char op() { return Opts.Ops.empty() ? '+' : Opts.Ops[below(Opts.Ops.size())]; }
+
+    void appendLiteral(std::string &Out) {
+        char Buf[32];
+        switch (Opts.Literals) {
+        case CorpusOptions::Digits:
+            Out += char('0' + below(10));
+            return;
+        case CorpusOptions::Integers:
+            Out += std::to_string(below(1000000));
+            return;
+        case CorpusOptions::Reals:
+            snprintf(Buf, sizeof(Buf), "%.3f", below(1000000) / 1000.0);
+            break;
+        case CorpusOptions::Wide:
+            snprintf(Buf, sizeof(Buf), "%.6f", std::pow(10.0, unit() * 12 - 6));
+            break;
+        }
+        Out += Buf;
+    }
+
+    /// appendLeaf - A literal or variable, possibly in redundant parentheses.
+    void appendLeaf(std::string &Out) {
+        bool Paren = chance(Opts.ParenShare);
+        if (Paren)
+            Out += '(';
+        if (Opts.NumVars && chance(Opts.VarShare))
+            Out += "x" + std::to_string(below(Opts.NumVars));
+        else
+            appendLiteral(Out);
+        if (Paren)
+            Out += ')';
+    }
+
+    /// appendTerm - A term of a Random-shaped chain: a leaf, or, while Depth allows, a parenthesized subchain. Terms may repeat earlier ones.
+    void appendTerm(std::string &Out, unsigned Depth) {
+        if (!Recent.empty() && chance(Opts.RepeatShare)) {
+            Out += Recent[below(Recent.size())];
+            return;
+        }
+        size_t Start = Out.size();
+        if (Depth && chance(0.5)) {
+            Out += '(';
+            appendChain(Out, 2 + below(Opts.Width > 1 ? Opts.Width - 1 : 1), Depth - 1);
+            Out += ')';
+        } else {
+            appendLeaf(Out);
+        }
+        remember(Out.substr(Start));
+    }
+
+    void appendChain(std::string &Out, uint64_t Terms, unsigned Depth) {
+        for (uint64_t I = 0; I < Terms; ++I) {
+            if (I) {
+                Out += ' ';
+                Out += op();
+                Out += ' ';
+            }
+            appendTerm(Out, Depth);
+        }
+    }
+
+    void appendBalanced(std::string &Out, unsigned Depth) {
+        if (!Depth)
+            return appendLeaf(Out);
+        if (!Recent.empty() && chance(Opts.RepeatShare)) {
+            Out += Recent[below(Recent.size())];
+            return;
+        }
+        size_t Start = Out.size();
+        Out += '(';
+        appendBalanced(Out, Depth - 1);
+        Out += ' ';
+        Out += op();
+        Out += ' ';
+        appendBalanced(Out, Depth - 1);
+        Out += ')';
+        remember(Out.substr(Start));
+    }
+
+    void remember(std::string Term) {
+        if (Opts.RepeatShare <= 0)
+            return;
+        if (Recent.size() < MaxRecent) {
+            Recent.push_back(std::move(Term));
+        } else {
+            Recent[NextRecent] = std::move(Term);
+            NextRecent = (NextRecent + 1) % MaxRecent;
+        }
+    }
+
+public:
+    explicit CorpusGenerator(const CorpusOptions &Opts) : Opts(Opts), RandState(Opts.Seed) {}
+
+    /// next - The next expression, without a trailing ';'.
+    std::string next() {
+        std::string Out;
+        switch (Opts.Shape) {
+        case CorpusOptions::Random:
+            appendChain(Out, 1 + below(Opts.Width ? Opts.Width : 1), Opts.Depth);
+            break;
+        case CorpusOptions::Chain:
+            Out.reserve(Opts.Width * 8);
+            appendChain(Out, Opts.Width ? Opts.Width : 1, 0);
+            break;
+        case CorpusOptions::RightNested:
+            for (unsigned I = 0; I < Opts.Depth; ++I) {
+                appendLeaf(Out);
+                Out += ' ';
+                Out += op();
+                Out += " (";
+            }
+            appendLeaf(Out);
+            Out.append(Opts.Depth, ')');
+            break;
+        case CorpusOptions::LeftNested:
+            Out.append(Opts.Depth, '(');
+            appendLeaf(Out);
+            for (unsigned I = 0; I < Opts.Depth; ++I) {
+                Out += ' ';
+                Out += op();
+                Out += ' ';
+                appendLeaf(Out);
+                Out += ')';
+            }
+            break;
+        case CorpusOptions::Balanced:
+            appendBalanced(Out, Opts.Depth);
+            break;
+        }
+        return Out;
+    }
+};
+
+} // namespace calculator
+
+#endif // CALCULATOR_CORPUS_H
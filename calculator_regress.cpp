@@ -0,0 +1,460 @@
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std; // Added to use standard library components without std:: prefix
+
+static cl::opt<string> BenchPath("bench", cl::desc("The benchmark binary to run"), cl::init("./calculator_bench"),
+                                 cl::value_desc("path"));
+static cl::opt<string> Filter("filter", cl::desc("Run only the benchmarks matching this regular expression"),
+                              cl::value_desc("regex"));
+static cl::opt<unsigned> Runs("runs", cl::desc("Number of times to run the benchmark binary"), cl::init(5));
+static cl::opt<unsigned> Repetitions("repetitions", cl::desc("Repetitions of each benchmark within each run"),
+                                     cl::init(3));
+static cl::opt<string> SavePath("save", cl::desc("Store the results in this file, as a baseline for later runs"),
+                                cl::value_desc("file"));
+static cl::opt<string> BaselinePath("baseline", cl::desc("Compare the results against the baseline in this file"),
+                                    cl::value_desc("file"));
+static cl::opt<string> ResultsPath("results",
+                                   cl::desc("Take the results from this file, stored by --save, instead of running"),
+                                   cl::value_desc("file"));
+static cl::opt<double> Alpha("alpha", cl::desc("Largest p-value at which a difference counts as real"),
+                             cl::init(0.01));
+static cl::opt<double> MinChange("min-change", cl::desc("Smallest change in the median worth flagging, as a fraction"),
+                                 cl::init(0.03));
+static cl::opt<bool> ShowAll("all", cl::desc("List every comparison, not only the changes"));
+
+// Measurements
+// Each benchmark yields four metrics. Time and throughput come from every repetition of every run. Allocations and peak bytes come from Google Benchmark's single memory-measuring pass per run, and do not vary from run to run unless the code changes.
+
+enum MetricKind { MetricTime, MetricThroughput, MetricAllocs, MetricPeakBytes, NumMetrics };
+
+struct MetricInfo {
+    const char *Key;    // The name of its samples in a results file
+    const char *Name;   // The name printed in reports
+    bool HigherIsBetter;
+    bool Deterministic; // Whether any change at all is real, so that a single sample suffices
+};
+
+static const MetricInfo Metrics[NumMetrics] = {
+    {"real_time_ns", "time", false, false},
+    {"items_per_second", "throughput", true, false},
+    {"allocs_per_iter", "allocs/iter", false, true},
+    {"max_bytes_used", "peak bytes", false, true},
+};
+
+/// BenchmarkSamples - Every sample of each metric of one benchmark.
+struct BenchmarkSamples {
+    vector<double> Samples[NumMetrics];
+};
+
+/// Results - The results of a set of runs: the machine they ran on, as Google Benchmark describes it, and each benchmark's samples in the order the benchmarks ran.
+struct Results {
+    json::Object Context;
+    vector<string> Order;
+    StringMap<BenchmarkSamples> Benchmarks;
+
+    BenchmarkSamples &get(StringRef Name) {
+        auto Inserted = Benchmarks.try_emplace(Name);
+        if (Inserted.second)
+            Order.push_back(Name.str());
+        return Inserted.first->second;
+    }
+};
+
+/// NanosPerUnit - Google Benchmark's time units, in nanoseconds.
+static double NanosPerUnit(StringRef Unit) {
+    return Unit == "us" ? 1e3 : Unit == "ms" ? 1e6 : Unit == "s" ? 1e9 : 1;
+}
+
+/// ReadBenchmarkOutput - Add the samples in one run's JSON output to R.
+static bool ReadBenchmarkOutput(StringRef Path, Results &R) {
+    auto BufferOrErr = MemoryBuffer::getFile(Path);
+    if (!BufferOrErr) {
+        fprintf(stderr, "Error: cannot read benchmark output: %s\n", BufferOrErr.getError().message().c_str());
+        return false;
+    }
+    Expected<json::Value> Output = json::parse((*BufferOrErr)->getBuffer());
+    if (!Output) {
+        fprintf(stderr, "Error: benchmark output is not JSON: %s\n", toString(Output.takeError()).c_str());
+        return false;
+    }
+    json::Object *Root = Output->getAsObject();
+    json::Array *Benchmarks = Root ? Root->getArray("benchmarks") : nullptr;
+    if (!Benchmarks) {
+        fprintf(stderr, "Error: benchmark output has no benchmarks\n");
+        return false;
+    }
+    if (R.Context.empty())
+        if (json::Object *Context = Root->getObject("context"))
+            R.Context = *Context;
+
+    for (json::Value &Entry : *Benchmarks) {
+        json::Object *B = Entry.getAsObject();
+        // Aggregates (mean, median, complexity fits) are derived from the repetitions, which we keep instead.
+        if (!B || B->getString("run_type") != StringRef("iteration"))
+            continue;
+        StringRef Name = B->getString("run_name").getValueOr("");
+        if (B->getBoolean("error_occurred").getValueOr(false)) {
+            fprintf(stderr, "Warning: %s failed: %s\n", Name.str().c_str(),
+                    B->getString("error_message").getValueOr("").str().c_str());
+            continue;
+        }
+        BenchmarkSamples &S = R.get(Name);
+        double Scale = NanosPerUnit(B->getString("time_unit").getValueOr("ns"));
+        if (auto Time = B->getNumber("real_time"))
+            S.Samples[MetricTime].push_back(*Time * Scale);
+        if (auto Items = B->getNumber("items_per_second"))
+            S.Samples[MetricThroughput].push_back(*Items);
+        // Google Benchmark measures memory once, and reports it only with the last repetition.
+        if (B->getInteger("repetition_index") == B->getInteger("repetitions").getValueOr(1) - 1) {
+            if (auto Allocs = B->getNumber("allocs_per_iter"))
+                S.Samples[MetricAllocs].push_back(*Allocs);
+            if (auto Peak = B->getNumber("max_bytes_used"))
+                S.Samples[MetricPeakBytes].push_back(*Peak);
+        }
+    }
+    return true;
+}
+
+/// RunSuite - Run the benchmark binary Runs times, each time in a fresh process, and collect the samples.
+static bool RunSuite(Results &R) {
+    if (!sys::fs::can_execute(BenchPath)) {
+        fprintf(stderr, "Error: cannot execute %s; build calculator_bench or pass --bench\n", BenchPath.c_str());
+        return false;
+    }
+    SmallString<128> OutPath, LogPath;
+    error_code EC = sys::fs::createTemporaryFile("calculator_regress", "json", OutPath);
+    if (!EC)
+        EC = sys::fs::createTemporaryFile("calculator_regress", "log", LogPath);
+    if (EC) {
+        fprintf(stderr, "Error: cannot create a temporary file: %s\n", EC.message().c_str());
+        return false;
+    }
+    FileRemover RemoveOut(OutPath), RemoveLog(LogPath);
+
+    string OutArg = ("--benchmark_out=" + OutPath).str();
+    string RepetitionsArg = "--benchmark_repetitions=" + to_string(max(1u, unsigned(Repetitions)));
+    string FilterArg = "--benchmark_filter=" + Filter;
+    vector<StringRef> Args = {BenchPath, OutArg, "--benchmark_out_format=json", RepetitionsArg};
+    if (!Filter.empty())
+        Args.push_back(FilterArg);
+    // The console report and the machine description would repeat themselves for every run. Only the JSON file is read, and the rest is shown if the run fails.
+    Optional<StringRef> Redirects[] = {None, StringRef(""), StringRef(LogPath)};
+
+    for (unsigned Run = 1; Run <= Runs; ++Run) {
+        fprintf(stderr, "run %u of %u...\n", Run, unsigned(Runs));
+        string ErrMsg;
+        int Status = sys::ExecuteAndWait(BenchPath, Args, None, Redirects, 0, 0, &ErrMsg);
+        if (Status != 0) {
+            if (auto Log = MemoryBuffer::getFile(LogPath))
+                fputs((*Log)->getBuffer().str().c_str(), stderr);
+            fprintf(stderr, "Error: %s failed%s%s\n", BenchPath.c_str(), ErrMsg.empty() ? "" : ": ", ErrMsg.c_str());
+            return false;
+        }
+        if (!ReadBenchmarkOutput(OutPath, R))
+            return false;
+    }
+    return true;
+}
+
+// Results Files
+// A results file holds the context of the first run and every sample of every benchmark:
+//   {"version": 1, "context": {...}, "benchmarks": [{"name": "BM_Lex/16", "real_time_ns": [...], ...}, ...]}
+
+static constexpr int64_t ResultsVersion = 1;
+
+static bool SaveResults(StringRef Path, Results &R) {
+    error_code EC;
+    raw_fd_ostream OS(Path, EC);
+    if (EC) {
+        fprintf(stderr, "Error: cannot write %s: %s\n", Path.str().c_str(), EC.message().c_str());
+        return false;
+    }
+    json::OStream J(OS, 2);
+    J.object([&] {
+        J.attribute("version", ResultsVersion);
+        J.attribute("context", json::Object(R.Context));
+        J.attributeArray("benchmarks", [&] {
+            for (const string &Name : R.Order) {
+                const BenchmarkSamples &S = R.Benchmarks[Name];
+                J.object([&] {
+                    J.attribute("name", Name);
+                    for (unsigned M = 0; M < NumMetrics; ++M)
+                        if (!S.Samples[M].empty())
+                            J.attribute(Metrics[M].Key, json::Array(S.Samples[M]));
+                });
+            }
+        });
+    });
+    OS << '\n';
+    return true;
+}
+
+static bool LoadResults(StringRef Path, Results &R) {
+    auto BufferOrErr = MemoryBuffer::getFile(Path);
+    if (!BufferOrErr) {
+        fprintf(stderr, "Error: cannot read %s: %s\n", Path.str().c_str(), BufferOrErr.getError().message().c_str());
+        return false;
+    }
+    Expected<json::Value> File = json::parse((*BufferOrErr)->getBuffer());
+    if (!File) {
+        fprintf(stderr, "Error: %s is not JSON: %s\n", Path.str().c_str(), toString(File.takeError()).c_str());
+        return false;
+    }
+    json::Object *Root = File->getAsObject();
+    if (!Root || Root->getInteger("version") != ResultsVersion || !Root->getArray("benchmarks")) {
+        fprintf(stderr, "Error: %s is not a results file of version %d\n", Path.str().c_str(), int(ResultsVersion));
+        return false;
+    }
+    if (json::Object *Context = Root->getObject("context"))
+        R.Context = *Context;
+    for (json::Value &Entry : *Root->getArray("benchmarks")) {
+        json::Object *B = Entry.getAsObject();
+        if (!B || !B->getString("name"))
+            continue;
+        BenchmarkSamples &S = R.get(*B->getString("name"));
+        for (unsigned M = 0; M < NumMetrics; ++M)
+            if (json::Array *Samples = B->getArray(Metrics[M].Key))
+                for (json::Value &V : *Samples)
+                    if (auto N = V.getAsNumber())
+                        S.Samples[M].push_back(*N);
+    }
+    return true;
+}
+
+// Statistics
+
+static double Median(vector<double> V) {
+    llvm::sort(V);
+    size_t N = V.size();
+    return N % 2 ? V[N / 2] : (V[N / 2 - 1] + V[N / 2]) / 2;
+}
+
+static bool AllEqual(const vector<double> &V) {
+    return all_of(V.begin(), V.end(), [&](double X) { return X == V[0]; });
+}
+
+/// ExactUCounts - How many of the orderings of N1 samples of A among N2 of B give each value of U, the number of (A, B) pairs in which B comes first.
+static vector<double> ExactUCounts(size_t N1, size_t N2) {
+    // After pass J, F[I][U] counts the orderings of I As and J Bs. The last of them is either a B, which adds
+    // nothing to U, or an A, which all J Bs precede: F(I, J, U) = F(I, J - 1, U) + F(I - 1, J, U - J).
+    vector<vector<double>> F(N1 + 1, vector<double>(N1 * N2 + 1, 0));
+    for (size_t I = 0; I <= N1; ++I)
+        F[I][0] = 1;
+    for (size_t J = 1; J <= N2; ++J)
+        for (size_t I = 1; I <= N1; ++I)
+            for (size_t U = J; U <= I * J; ++U)
+                F[I][U] += F[I - 1][U - J];
+    return F[N1];
+}
+
+/// MannWhitneyP - The two-sided p-value of the Mann-Whitney U test: the chance of samples this far apart if A and B came from the same distribution. It assumes nothing about the shape of the distribution, which for timings is skewed and often bimodal. Exact for small samples without ties; otherwise the normal approximation, corrected for ties and continuity.
+static double MannWhitneyP(const vector<double> &A, const vector<double> &B) {
+    size_t N1 = A.size(), N2 = B.size(), N = N1 + N2;
+    if (!N1 || !N2)
+        return 1;
+
+    // Rank the pooled samples, giving tied samples the average of their ranks.
+    vector<pair<double, bool>> Pooled; // A sample, and whether it is from A
+    for (double X : A)
+        Pooled.emplace_back(X, true);
+    for (double X : B)
+        Pooled.emplace_back(X, false);
+    llvm::sort(Pooled);
+    double RankSumA = 0, TieTerm = 0;
+    for (size_t I = 0; I < N;) {
+        size_t J = I;
+        while (J < N && Pooled[J].first == Pooled[I].first)
+            ++J;
+        double Rank = (I + 1 + J) / 2.0, Ties = J - I;
+        TieTerm += Ties * Ties * Ties - Ties;
+        for (; I < J; ++I)
+            if (Pooled[I].second)
+                RankSumA += Rank;
+    }
+    double U = RankSumA - N1 * (N1 + 1) / 2.0;
+
+    if (TieTerm == 0 && N <= 50) {
+        vector<double> Counts = ExactUCounts(N1, N2);
+        double Total = 0, Below = 0, Above = 0;
+        for (size_t K = 0; K < Counts.size(); ++K) {
+            Total += Counts[K];
+            if (K <= U)
+                Below += Counts[K];
+            if (K >= U)
+                Above += Counts[K];
+        }
+        return min(1.0, 2 * min(Below, Above) / Total);
+    }
+
+    double Variance = N1 * N2 / 12.0 * ((N + 1) - TieTerm / (N * (N - 1.0)));
+    if (Variance <= 0)
+        return 1;
+    double Z = max(0.0, fabs(U - N1 * N2 / 2.0) - 0.5) / sqrt(Variance);
+    return erfc(Z / sqrt(2.0));
+}
+
+/// SmallestP - The smallest p-value samples of these sizes can reach: when every sample of one lies below every sample of the other.
+static double SmallestP(size_t N1, size_t N2) {
+    if (!N1 || !N2)
+        return 1;
+    vector<double> A(N1), B(N2);
+    for (size_t I = 0; I < N1; ++I)
+        A[I] = I;
+    for (size_t I = 0; I < N2; ++I)
+        B[I] = N1 + I;
+    return MannWhitneyP(A, B);
+}
+
+// Comparison
+
+/// FormatValue - A metric's value with a unit suited to its size.
+static string FormatValue(MetricKind M, double V) {
+    string S;
+    raw_string_ostream OS(S);
+    switch (M) {
+    case MetricTime:
+        if (V >= 1e9)
+            OS << format("%.3g s", V / 1e9);
+        else if (V >= 1e6)
+            OS << format("%.3g ms", V / 1e6);
+        else if (V >= 1e3)
+            OS << format("%.3g us", V / 1e3);
+        else
+            OS << format("%.3g ns", V);
+        break;
+    case MetricThroughput:
+        if (V >= 1e9)
+            OS << format("%.3gG/s", V / 1e9);
+        else if (V >= 1e6)
+            OS << format("%.3gM/s", V / 1e6);
+        else if (V >= 1e3)
+            OS << format("%.3gk/s", V / 1e3);
+        else
+            OS << format("%.3g/s", V);
+        break;
+    case MetricAllocs:
+        OS << format("%.1f", V);
+        break;
+    case MetricPeakBytes:
+        if (V >= 1 << 20)
+            OS << format("%.3g MiB", V / (1 << 20));
+        else if (V >= 1 << 10)
+            OS << format("%.3g KiB", V / (1 << 10));
+        else
+            OS << format("%.0f B", V);
+        break;
+    default:
+        break;
+    }
+    return OS.str();
+}
+
+static string FormatP(double P) {
+    string S;
+    raw_string_ostream(S) << format(P < 1e-4 ? "%.1e" : "%.4f", P);
+    return S;
+}
+
+/// WarnOnContextChange - Warn if the baseline was measured under different conditions, which would make any comparison suspect.
+static void WarnOnContextChange(const json::Object &Base, const json::Object &Cur) {
+    for (const char *Key : {"host_name", "num_cpus", "mhz_per_cpu", "library_build_type"}) {
+        const json::Value *B = Base.get(Key), *C = Cur.get(Key);
+        if (B && C && *B != *C) {
+            string Before, After;
+            raw_string_ostream(Before) << *B;
+            raw_string_ostream(After) << *C;
+            fprintf(stderr, "Warning: %s was %s for the baseline and is %s now\n", Key, Before.c_str(), After.c_str());
+        }
+    }
+    if (Cur.getBoolean("cpu_scaling_enabled").getValueOr(false))
+        fprintf(stderr, "Warning: CPU frequency scaling is enabled; timings will be noisy\n");
+}
+
+/// Compare - Print how each benchmark's metrics moved from Base to Cur, and return the number of regressions.
+static unsigned Compare(Results &Base, Results &Cur) {
+    WarnOnContextChange(Base.Context, Cur.Context);
+
+    unsigned Compared = 0, Regressed = 0, Improved = 0, Underpowered = 0;
+    outs() << format("%-36s %-12s %12s %12s %8s %9s\n", (const char *)"Benchmark", (const char *)"Metric",
+                     (const char *)"Baseline", (const char *)"Current", (const char *)"Change", (const char *)"p-value");
+    for (const string &Name : Cur.Order) {
+        auto It = Base.Benchmarks.find(Name);
+        if (It == Base.Benchmarks.end()) {
+            outs().flush();
+            fprintf(stderr, "Warning: %s is not in the baseline\n", Name.c_str());
+            continue;
+        }
+        for (unsigned M = 0; M < NumMetrics; ++M) {
+            const vector<double> &Before = It->second.Samples[M], &After = Cur.Benchmarks[Name].Samples[M];
+            if (Before.empty() || After.empty())
+                continue;
+            ++Compared;
+            double BaseMedian = Median(Before), CurMedian = Median(After);
+            double Change = BaseMedian ? CurMedian / BaseMedian - 1 : CurMedian ? INFINITY : 0;
+            // A deterministic metric changes only when the code does, whatever the sample size.
+            bool Exact = Metrics[M].Deterministic && AllEqual(Before) && AllEqual(After);
+            double P = Exact ? (Change ? 0 : 1) : MannWhitneyP(Before, After);
+            if (!Exact && SmallestP(Before.size(), After.size()) > Alpha)
+                ++Underpowered;
+
+            const char *Verdict = "";
+            if (P <= Alpha && fabs(Change) >= MinChange)
+                Verdict = (Change > 0) == Metrics[M].HigherIsBetter ? "improved" : "regressed";
+            if (*Verdict == 'r')
+                ++Regressed;
+            else if (*Verdict == 'i')
+                ++Improved;
+            if (*Verdict || ShowAll)
+                outs() << format("%-36s %-12s %12s %12s %+7.1f%% %9s  %s\n", Name.c_str(), Metrics[M].Name,
+                                 FormatValue(MetricKind(M), BaseMedian).c_str(),
+                                 FormatValue(MetricKind(M), CurMedian).c_str(), 100 * Change,
+                                 Exact ? "exact" : FormatP(P).c_str(), Verdict);
+        }
+    }
+    outs().flush();
+    unsigned NotRun = count_if(Base.Order.begin(), Base.Order.end(),
+                               [&](const string &Name) { return !Cur.Benchmarks.count(Name); });
+    if (NotRun)
+        fprintf(stderr, "Note: %u benchmarks in the baseline did not run\n", NotRun);
+    if (Underpowered)
+        fprintf(stderr, "Warning: %u of the comparisons have too few samples to reach p <= %g; raise --runs\n",
+                Underpowered, double(Alpha));
+    outs() << Compared << " comparisons: " << Regressed << " regressed, " << Improved << " improved\n";
+    return Regressed;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv,
+                                "Benchmark regression harness\n\n"
+                                "Runs calculator_bench repeatedly, stores the results as a baseline, and compares later "
+                                "results against it with the Mann-Whitney U test.\n");
+    if (SavePath.empty() && BaselinePath.empty()) {
+        fprintf(stderr, "Error: nothing to do; pass --save, --baseline or both\n");
+        return 1;
+    }
+
+    Results Base, Cur;
+    if (!BaselinePath.empty() && !LoadResults(BaselinePath, Base))
+        return 1;
+    if (!ResultsPath.empty() ? !LoadResults(ResultsPath, Cur) : !RunSuite(Cur))
+        return 1;
+    if (!SavePath.empty() && !SaveResults(SavePath, Cur))
+        return 1;
+    if (!BaselinePath.empty() && Compare(Base, Cur))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,270 @@
+//===- calculator_shm.h - Shared-memory submission ring for the calculator -===//
+//
+// Layout of the shared-memory region served by "calculator --shm-server", and
+// a header-only client for processes on the same host.
+//
+// The region holds a fixed array of request slots and a submission ring of
+// slot indices. A client claims a slot once and keeps it; for each request it
+// writes the operation and its operands directly into the slot, pushes the
+// slot index onto the ring and waits. The engine writes the result back into
+// the same slot. Both sides spin briefly before parking on a futex, so a
+// request for an already compiled expression never enters the kernel while
+// the engine is busy.
+//
+// The region records the engine's pid and, in each claimed slot, the client's.
+// A second engine refuses a region whose engine is alive, clients refuse one
+// whose engine has died, and the engine frees the slots of clients that died
+// without releasing them. The engine and its clients must therefore share a
+// pid namespace.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CALCULATOR_SHM_H
+#define CALCULATOR_SHM_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const uint64_t CalcShmMagic = 0x474e4952434c4143; // "CALCRING"
+static const uint32_t CalcShmVersion = 2;
+static const uint32_t CalcShmNumSlots = 64;
+static const uint32_t CalcShmMaxArgs = 64;
+static const uint32_t CalcShmTextSize = 4096;
+
+/// CalcShmSpins - Polls before either side parks on its futex. Every CalcShmYieldEvery polls the poller yields, so that the other side can run even when both share a CPU.
+static const unsigned CalcShmSpins = 20000;
+static const unsigned CalcShmYieldEvery = 64;
+
+/// CalcShmOp - What a slot asks the engine to do.
+enum CalcShmOp : uint32_t {
+    CalcShmCompile = 1, // Text -> Handle and NumArgs.
+    CalcShmEval = 2,    // Handle and Args -> Result.
+};
+
+/// CalcShmState - Lifecycle of a slot. A client moves it from Free to Claimed and from Claimed to Submitted; the engine moves it to Done, and back to Free if the client has died.
+enum CalcShmState : uint32_t {
+    CalcShmFree = 0,
+    CalcShmClaimed = 1,
+    CalcShmSubmitted = 2,
+    CalcShmDone = 3,
+};
+
+struct alignas(64) CalcShmSlot {
+    std::atomic<uint32_t> State;         // Futex word the client parks on.
+    std::atomic<uint32_t> ClientWaiting; // Set while the client is parked.
+    std::atomic<int32_t> OwnerPid;       // The client that claimed the slot; 0 while it is free or being claimed.
+    uint32_t Op;
+    uint32_t Handle;  // Eval: in. Compile: out.
+    uint32_t NumArgs; // Eval: in. Compile: out.
+    int32_t Status;   // 0 on success; otherwise Text holds the error message.
+    double Result;
+    union {
+        double Args[CalcShmMaxArgs];
+        char Text[CalcShmTextSize]; // NUL-terminated.
+    };
+};
+
+/// CalcShmCell - One submission ring entry, sequenced as in a bounded MPMC queue: Seq equals the position once the cell is free for that position, and the position plus one once a slot index has been published in it.
+struct alignas(64) CalcShmCell {
+    std::atomic<uint64_t> Seq;
+    uint32_t Slot;
+};
+
+struct CalcShmRegion {
+    uint64_t Magic;
+    uint32_t Version;
+    uint32_t NumSlots;
+    std::atomic<int32_t> EnginePid; // The engine serving the region.
+    alignas(64) std::atomic<uint64_t> SubmitTail; // Claimed by clients with fetch_add; the engine keeps its own head.
+    alignas(64) std::atomic<uint32_t> EngineWake; // Futex word the engine parks on.
+    std::atomic<uint32_t> EngineWaiting;
+    CalcShmCell Ring[CalcShmNumSlots];
+    CalcShmSlot Slots[CalcShmNumSlots];
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shared-memory atomics must be lock-free");
+
+/// CalcShmPoll - Called on each unsuccessful poll while spinning.
+inline void CalcShmPoll(unsigned Spins) {
+    if (Spins % CalcShmYieldEvery == CalcShmYieldEvery - 1)
+        sched_yield();
+}
+
+inline void CalcShmFutexWait(std::atomic<uint32_t> &Word, uint32_t Expected, const timespec *Timeout = nullptr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&Word), FUTEX_WAIT, Expected, Timeout, nullptr, 0);
+}
+
+inline void CalcShmFutexWake(std::atomic<uint32_t> &Word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&Word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+/// CalcShmAlive - Whether the process Pid exists.
+inline bool CalcShmAlive(int32_t Pid) {
+    return Pid > 0 && (kill(Pid, 0) == 0 || errno == EPERM);
+}
+
+/// CalcShmMap - Map the region at Path. With Create, the caller becomes the region's engine: the file is created if need be and the region initialized, unless a live engine already serves it (EADDRINUSE). Otherwise the region must be served by a live engine (ECONNREFUSED).
+inline CalcShmRegion *CalcShmMap(const char *Path, bool Create) {
+    int FD = open(Path, Create ? O_RDWR | O_CREAT : O_RDWR, 0666);
+    if (FD < 0)
+        return nullptr;
+    // Engines starting at once take turns on the file lock, so only one of them can find the region unserved. The file is never truncated, since a live engine's clients may have it mapped.
+    struct stat St;
+    if (Create && (flock(FD, LOCK_EX) != 0 || fstat(FD, &St) != 0 ||
+                   (size_t(St.st_size) < sizeof(CalcShmRegion) && ftruncate(FD, sizeof(CalcShmRegion)) != 0))) {
+        close(FD);
+        return nullptr;
+    }
+    void *Base = mmap(nullptr, sizeof(CalcShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+    if (Base == MAP_FAILED) {
+        close(FD);
+        return nullptr;
+    }
+
+    auto *R = static_cast<CalcShmRegion *>(Base);
+    bool Served = R->Magic == CalcShmMagic && R->Version == CalcShmVersion && R->NumSlots == CalcShmNumSlots &&
+                  CalcShmAlive(R->EnginePid.load(std::memory_order_relaxed));
+    if (Create && !Served) {
+        // Whatever an earlier engine left is cleared, so slots and ring positions start over.
+        R->Magic = 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        memset(static_cast<void *>(R), 0, sizeof(CalcShmRegion));
+        for (uint32_t I = 0; I < CalcShmNumSlots; ++I)
+            R->Ring[I].Seq.store(I, std::memory_order_relaxed);
+        R->Version = CalcShmVersion;
+        R->NumSlots = CalcShmNumSlots;
+        R->EnginePid.store(getpid(), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        R->Magic = CalcShmMagic;
+    } else if (Create || !Served) {
+        munmap(Base, sizeof(CalcShmRegion));
+        close(FD);
+        errno = Create ? EADDRINUSE : ECONNREFUSED;
+        return nullptr;
+    }
+    // The mapping keeps the open file, and with it the lock, so the lock is released explicitly.
+    if (Create)
+        flock(FD, LOCK_UN);
+    close(FD);
+    return R;
+}
+
+/// CalcShmClient - A client's view of the region: one claimed slot, reused for every request. Not thread-safe; give each thread its own client.
+class CalcShmClient {
+    CalcShmRegion *Region = nullptr;
+    CalcShmSlot *Slot = nullptr;
+    uint32_t SlotIndex = 0;
+
+    /// submit - Publish the request in our slot and wait for the engine to complete it.
+    bool submit() {
+        Slot->State.store(CalcShmSubmitted, std::memory_order_release);
+
+        // Ring capacity equals the number of slots, so the cell for our position is always free.
+        uint64_t Pos = Region->SubmitTail.fetch_add(1, std::memory_order_relaxed);
+        CalcShmCell &Cell = Region->Ring[Pos % CalcShmNumSlots];
+        while (Cell.Seq.load(std::memory_order_acquire) != Pos)
+            ;
+        Cell.Slot = SlotIndex;
+        Cell.Seq.store(Pos + 1, std::memory_order_seq_cst);
+        if (Region->EngineWaiting.load(std::memory_order_seq_cst)) {
+            Region->EngineWake.fetch_add(1, std::memory_order_seq_cst);
+            CalcShmFutexWake(Region->EngineWake);
+        }
+
+        for (unsigned I = 0; I < CalcShmSpins; ++I) {
+            if (Slot->State.load(std::memory_order_acquire) == CalcShmDone)
+                return finish();
+            CalcShmPoll(I);
+        }
+        Slot->ClientWaiting.store(1, std::memory_order_seq_cst);
+        while (Slot->State.load(std::memory_order_seq_cst) != CalcShmDone)
+            CalcShmFutexWait(Slot->State, CalcShmSubmitted);
+        Slot->ClientWaiting.store(0, std::memory_order_relaxed);
+        return finish();
+    }
+
+    bool finish() {
+        Slot->State.store(CalcShmClaimed, std::memory_order_relaxed);
+        return Slot->Status == 0;
+    }
+
+public:
+    CalcShmClient() = default;
+    CalcShmClient(const CalcShmClient &) = delete;
+    CalcShmClient &operator=(const CalcShmClient &) = delete;
+    ~CalcShmClient() {
+        if (Slot) {
+            Slot->OwnerPid.store(0, std::memory_order_relaxed);
+            Slot->State.store(CalcShmFree, std::memory_order_release);
+        }
+        if (Region)
+            munmap(Region, sizeof(CalcShmRegion));
+    }
+
+    /// connect - Map the engine's region at Path and claim a free slot. A client that exits without destroying its CalcShmClient keeps the slot until the engine notices it has died.
+    bool connect(const char *Path) {
+        Region = CalcShmMap(Path, /*Create=*/false);
+        if (!Region)
+            return false;
+        for (uint32_t I = 0; I < CalcShmNumSlots; ++I) {
+            uint32_t Expected = CalcShmFree;
+            if (Region->Slots[I].State.compare_exchange_strong(Expected, CalcShmClaimed)) {
+                Region->Slots[I].OwnerPid.store(getpid(), std::memory_order_relaxed);
+                Slot = &Region->Slots[I];
+                SlotIndex = I;
+                return true;
+            }
+        }
+        munmap(Region, sizeof(CalcShmRegion));
+        Region = nullptr;
+        errno = EBUSY;
+        return false;
+    }
+
+    /// compile - Compile Expr, whose variables become arguments in order of first appearance. On failure, errorMessage() says why.
+    bool compile(const char *Expr, uint32_t &Handle, uint32_t &NumArgs) {
+        size_t Len = strlen(Expr);
+        if (Len >= CalcShmTextSize) {
+            strcpy(Slot->Text, "expression too long");
+            return false;
+        }
+        Slot->Op = CalcShmCompile;
+        memcpy(Slot->Text, Expr, Len + 1);
+        if (!submit())
+            return false;
+        Handle = Slot->Handle;
+        NumArgs = Slot->NumArgs;
+        return true;
+    }
+
+    /// eval - Evaluate a compiled expression on NumArgs argument values.
+    bool eval(uint32_t Handle, const double *Args, uint32_t NumArgs, double &Result) {
+        if (NumArgs > CalcShmMaxArgs) {
+            strcpy(Slot->Text, "too many arguments");
+            return false;
+        }
+        Slot->Op = CalcShmEval;
+        Slot->Handle = Handle;
+        Slot->NumArgs = NumArgs;
+        memcpy(Slot->Args, Args, NumArgs * sizeof(double));
+        if (!submit())
+            return false;
+        Result = Slot->Result;
+        return true;
+    }
+
+    const char *errorMessage() const { return Slot->Text; }
+};
+
+#endif // CALCULATOR_SHM_H
@@ -0,0 +1,1434 @@
+#include "calculator.h"
+#include "calculator_c.h"
+#include "calculator_corpus.h"
+#include "calculator_shm.h"
+#include "engine_internal.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <functional>
+#include <gtest/gtest.h>
+#include <map>
+#include <set>
+#include <signal.h>
+#include <stdio.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace llvm;
+using namespace std; // Added to use standard library components without std:: prefix
+using namespace calculator;
+
+// Helpers
+
+/// TempPath - A scratch file path of its own for this test process, with anything left there by an earlier run removed.
+static string TempPath(StringRef Name) {
+    string Path = ("/tmp/calculator_test." + Twine(getpid()) + "." + Name).str();
+    unlink(Path.c_str());
+    return Path;
+}
+
+/// SeriesValue - The value of the series Name, labels included, in Metrics, the text format FormatMetrics writes.
+static double SeriesValue(StringRef Metrics, StringRef Name) {
+    StringRef Rest = Metrics;
+    while (!Rest.empty()) {
+        StringRef Line;
+        tie(Line, Rest) = Rest.split('\n');
+        if (Line.consume_front(Name) && Line.consume_front(" "))
+            return strtod(Line.str().c_str(), nullptr);
+    }
+    ADD_FAILURE() << "no metric " << Name.str();
+    return 0;
+}
+
+/// MetricValue - The value of the series Name in this process's metrics. Metrics are process-wide, so tests compare values before and after.
+static double MetricValue(StringRef Name) { return SeriesValue(FormatMetrics(), Name); }
+
+/// FileMetricValue - The value of the series Name in a metrics file the calculator wrote.
+static double FileMetricValue(StringRef Path, StringRef Name) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+        ADD_FAILURE() << "no metrics file " << Path.str();
+        return 0;
+    }
+    return SeriesValue((*Buf)->getBuffer(), Name);
+}
+
+/// ConnectUnix - Connect to the Unix socket at Path. Returns the descriptor, or -1.
+static int ConnectUnix(StringRef Path) {
+    int FD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    strncpy(Addr.sun_path, Path.str().c_str(), sizeof(Addr.sun_path) - 1);
+    if (connect(FD, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)) < 0) {
+        close(FD);
+        return -1;
+    }
+    return FD;
+}
+
+/// SocketMetricValue - The value of the series Name in the metrics a calculator serves on the Unix socket at Path.
+static double SocketMetricValue(StringRef Path, StringRef Name) {
+    int FD = ConnectUnix(Path);
+    if (FD < 0) {
+        ADD_FAILURE() << "cannot connect to " << Path.str();
+        return 0;
+    }
+    string Metrics;
+    char Buf[4096];
+    ssize_t N;
+    while ((N = read(FD, Buf, sizeof(Buf))) > 0)
+        Metrics.append(Buf, N);
+    close(FD);
+    return SeriesValue(Metrics, Name);
+}
+
+/// CalculatorPath - The calculator binary the tests drive: CALCULATOR, or ./calculator.
+static const char *CalculatorPath() {
+    const char *Tool = getenv("CALCULATOR");
+    return Tool ? Tool : "./calculator";
+}
+
+/// RegressPath - The regression harness binary the tests drive: CALCULATOR_REGRESS, or ./calculator_regress.
+static const char *RegressPath() {
+    const char *Tool = getenv("CALCULATOR_REGRESS");
+    return Tool ? Tool : "./calculator_regress";
+}
+
+/// BenchPath - The benchmark binary the tests drive: CALCULATOR_BENCH, or ./calculator_bench.
+static const char *BenchPath() {
+    const char *Tool = getenv("CALCULATOR_BENCH");
+    return Tool ? Tool : "./calculator_bench";
+}
+
+/// ToolRun - What a run of the calculator binary printed, and its exit status.
+struct ToolRun {
+    int Status = -1;
+    string Output;
+};
+
+/// RunTool - Run the binary at Tool with Args on Input, capturing stdout and stderr.
+static ToolRun RunTool(StringRef Tool, StringRef Args, StringRef Input) {
+    // Runs may overlap, so each gets an input file of its own.
+    static atomic<unsigned> NextInput{0};
+    string InputPath = TempPath(("input." + Twine(NextInput++)).str());
+    FILE *In = fopen(InputPath.c_str(), "w");
+    fwrite(Input.data(), 1, Input.size(), In);
+    fclose(In);
+
+    string Command = (Tool + " " + Args + " < " + InputPath + " 2>&1").str();
+    ToolRun Run;
+    FILE *Out = popen(Command.c_str(), "r");
+    char Buf[4096];
+    size_t N;
+    while ((N = fread(Buf, 1, sizeof(Buf), Out)) > 0)
+        Run.Output.append(Buf, N);
+    int Status = pclose(Out);
+    Run.Status = WIFEXITED(Status) ? WEXITSTATUS(Status) : -1;
+    unlink(InputPath.c_str());
+    return Run;
+}
+
+/// RunCalculator - Run the calculator binary with Args on Input, capturing stdout and stderr.
+static ToolRun RunCalculator(StringRef Args, StringRef Input) { return RunTool(CalculatorPath(), Args, Input); }
+
+/// ToolProcess - A calculator binary running in the background, such as one of its servers. It is stopped when this goes away, unless it has been waited for.
+class ToolProcess {
+    pid_t Pid = -1;
+
+public:
+    /// ToolProcess - Start the calculator with Args, reading Input and writing both its output streams to Output. If IsReady is given, wait up to ten seconds for it to hold.
+    ToolProcess(const vector<string> &Args, function<bool()> IsReady, const string &Input = "/dev/null",
+                const string &Output = "/dev/null") {
+        vector<const char *> Argv = {CalculatorPath()};
+        for (const string &Arg : Args)
+            Argv.push_back(Arg.c_str());
+        Argv.push_back(nullptr);
+        Pid = fork();
+        if (Pid == 0) {
+            int In = open(Input.c_str(), O_RDONLY);
+            int Out = open(Output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            dup2(In, STDIN_FILENO);
+            dup2(Out, STDOUT_FILENO);
+            dup2(Out, STDERR_FILENO);
+            execv(Argv[0], const_cast<char *const *>(Argv.data()));
+            _exit(127);
+        }
+        for (int I = 0; IsReady && I != 1000 && !IsReady(); ++I)
+            usleep(10000);
+    }
+    ToolProcess(const ToolProcess &) = delete;
+    ToolProcess &operator=(const ToolProcess &) = delete;
+    ~ToolProcess() {
+        if (Pid <= 0)
+            return;
+        kill(Pid, SIGTERM);
+        waitpid(Pid, nullptr, 0);
+    }
+
+    pid_t getPid() const { return Pid; }
+
+    /// isRunning - Whether the process is still up, rather than having failed at startup.
+    bool isRunning() const { return Pid > 0 && waitpid(Pid, nullptr, WNOHANG) == 0; }
+
+    /// wait - Wait for the process to exit by itself. Returns its exit status, or -1 if it was killed.
+    int wait() {
+        int Status;
+        if (Pid <= 0 || waitpid(Pid, &Status, 0) < 0)
+            return -1;
+        Pid = -1;
+        return WIFEXITED(Status) ? WEXITSTATUS(Status) : -1;
+    }
+};
+
+/// SocketReady - A ToolProcess readiness check: the server accepts connections on the Unix socket at Path. Binding creates the file a moment before the server listens.
+static function<bool()> SocketReady(const string &Path) {
+    return [Path] {
+        int FD = ConnectUnix(Path);
+        if (FD < 0)
+            return false;
+        close(FD);
+        return true;
+    };
+}
+
+/// RegionReady - A ToolProcess readiness check: the shared-memory server has sized and initialized its region at Path.
+static function<bool()> RegionReady(const string &Path) {
+    return [Path] {
+        struct stat St;
+        if (stat(Path.c_str(), &St) < 0 || size_t(St.st_size) < sizeof(CalcShmRegion))
+            return false;
+        CalcShmRegion *R = CalcShmMap(Path.c_str(), /*Create=*/false);
+        if (R)
+            munmap(R, sizeof(CalcShmRegion));
+        return R != nullptr;
+    };
+}
+
+/// ReadFile - The contents of the file at Path, or an empty string if it cannot be read.
+static string ReadFile(StringRef Path) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    return Buf ? (*Buf)->getBuffer().str() : string();
+}
+
+/// ReplaceDouble - Overwrite the first copy of the double Old in the file at Path with New, the way a stale or foreign object would differ. Returns false if there is none.
+static bool ReplaceDouble(const string &Path, double Old, double New) {
+    string Bytes = ReadFile(Path);
+    size_t At = Bytes.find(string(reinterpret_cast<const char *>(&Old), sizeof(Old)));
+    FILE *F = At == string::npos ? nullptr : fopen(Path.c_str(), "r+");
+    if (!F)
+        return false;
+    fseek(F, At, SEEK_SET);
+    bool Written = fwrite(&New, sizeof(New), 1, F) == 1;
+    return fclose(F) == 0 && Written;
+}
+
+// Shared Compiled-Code Cache
+
+TEST(ObjectCache, LaterRunsLinkTheCachedObject) {
+    string Cache = TempPath("cache");
+    ToolRun First = RunCalculator("--object-cache=" + Cache, "1234.5 * 2;\n");
+    ASSERT_EQ(First.Status, 0) << First.Output;
+    EXPECT_NE(First.Output.find("Evaluated to 2469.000000"), string::npos) << First.Output;
+
+    // Rewrite the constant in the cached object. A run that links the object, rather than compiling the expression again, returns the new value.
+    ASSERT_TRUE(ReplaceDouble(Cache, 2469, 4321));
+    ToolRun Second = RunCalculator("--object-cache=" + Cache, "1234.5 * 2;\n");
+    ASSERT_EQ(Second.Status, 0) << Second.Output;
+    EXPECT_NE(Second.Output.find("Evaluated to 4321.000000"), string::npos) << Second.Output;
+    unlink(Cache.c_str());
+}
+
+TEST(ObjectCache, SecondEngineLinksTheFirstOnesObject) {
+    InitializeCalculator();
+    string Path = TempPath("cache");
+    // Two caches that map the same file stand for two processes sharing it.
+    JITObjectCache First(SharedObjectStore::open(Path), /*KeepLocal=*/false);
+    JITObjectCache Second(SharedObjectStore::open(Path), /*KeepLocal=*/false);
+    EngineObjectCache = &First;
+    Engine E1;
+    EngineObjectCache = &Second;
+    Engine E2;
+    EngineObjectCache = nullptr;
+
+    double Hits = MetricValue("calc_object_cache_hits_total");
+    double Misses = MetricValue("calc_object_cache_misses_total");
+    ExprHandle H1 = E1.compile("x*y+2");
+    ExprHandle H2 = E2.compile("x*y+2");
+    ASSERT_TRUE(H1 && H2);
+    EXPECT_EQ(MetricValue("calc_object_cache_misses_total") - Misses, 1);
+    EXPECT_EQ(MetricValue("calc_object_cache_hits_total") - Hits, 1);
+
+    double Args[2] = {3, 4};
+    EXPECT_EQ(H2.eval(Args), 14);
+    unlink(Path.c_str());
+}
+
+TEST(ObjectCache, StoreKeepsTheFirstObjectAndSpendsNothingOnRepeats) {
+    string Path = TempPath("store");
+    auto Store = SharedObjectStore::open(Path);
+    ASSERT_TRUE(Store);
+    ObjectKey Key;
+    Key.Hash = 42;
+    Key.Check = 7;
+    Store->insert(Key, "first");
+    uint64_t Used = Store->getArenaUsed();
+    Store->insert(Key, "second");
+    EXPECT_EQ(Store->getArenaUsed(), Used);
+    EXPECT_EQ(Store->lookup(Key), "first");
+    unlink(Path.c_str());
+}
+
+TEST(ObjectCache, StoreTellsCollidingKeysApart) {
+    string Path = TempPath("store");
+    auto Store = SharedObjectStore::open(Path);
+    ASSERT_TRUE(Store);
+    ObjectKey A, B;
+    A.Hash = B.Hash = 42;
+    A.Check = 1;
+    B.Check = 2;
+    Store->insert(A, "object a");
+    EXPECT_EQ(Store->lookup(B), "");
+    Store->insert(B, "object b");
+    EXPECT_EQ(Store->lookup(A), "object a");
+    EXPECT_EQ(Store->lookup(B), "object b");
+
+    // A second mapping, as in another process, sees both.
+    auto Other = SharedObjectStore::open(Path);
+    ASSERT_TRUE(Other);
+    EXPECT_EQ(Other->lookup(B), "object b");
+    unlink(Path.c_str());
+}
+
+// Session Snapshots
+
+TEST(Snapshot, RestoreRunsTheSavedObjectRatherThanRecompiling) {
+    string Snapshot = TempPath("snap");
+    ToolRun Save = RunCalculator("--snapshot=" + Snapshot, "1234.5 * 2;\n");
+    ASSERT_EQ(Save.Status, 0) << Save.Output;
+    EXPECT_NE(Save.Output.find("Evaluated to 2469.000000"), string::npos) << Save.Output;
+
+    // The snapshot keeps the expression's tree as well as its object; only running the saved object returns the new value.
+    ASSERT_TRUE(ReplaceDouble(Snapshot, 2469, 4321));
+    ToolRun Restore = RunCalculator("--snapshot=" + Snapshot, "1234.5 * 2;\n");
+    ASSERT_EQ(Restore.Status, 0) << Restore.Output;
+    EXPECT_NE(Restore.Output.find("Evaluated to 4321.000000"), string::npos) << Restore.Output;
+    unlink(Snapshot.c_str());
+}
+
+TEST(Snapshot, RestoredSessionLinksItsSavedObjects) {
+    string Snapshot = TempPath("snap");
+    string Metrics = TempPath("metrics");
+    ToolRun Save = RunCalculator("--batch --snapshot=" + Snapshot, "1+2;\n3*4;\n");
+    ASSERT_EQ(Save.Status, 0) << Save.Output;
+    EXPECT_EQ(Save.Output, "1\tok\t3\n2\tok\t12\n");
+
+    ToolRun Restore = RunCalculator("--batch --snapshot=" + Snapshot + " --metrics-file=" + Metrics, "3*4;\n1+2;\n");
+    ASSERT_EQ(Restore.Status, 0) << Restore.Output;
+    EXPECT_EQ(Restore.Output, "1\tok\t12\n2\tok\t3\n");
+    // Both expressions came back as object code, so nothing was compiled.
+    EXPECT_EQ(FileMetricValue(Metrics, "calc_object_cache_misses_total"), 0);
+    EXPECT_EQ(FileMetricValue(Metrics, "calc_object_cache_hits_total"), 2);
+    unlink(Snapshot.c_str());
+    unlink(Metrics.c_str());
+}
+
+// Metrics Export
+
+TEST(Metrics, ExitWriteNeverRacesTheExporter) {
+    // The exporter writes the file as soon as it starts, so a short run's exit write lands on top of it. The race is narrow; repeat it.
+    string Metrics = TempPath("metrics");
+    for (int I = 0; I != 50; ++I) {
+        ToolRun Run = RunCalculator("--batch --metrics-file=" + Metrics, "1;\n");
+        ASSERT_EQ(Run.Status, 0) << Run.Output;
+        EXPECT_EQ(FileMetricValue(Metrics, "calc_expressions_parsed_total"), 1);
+    }
+    unlink(Metrics.c_str());
+}
+
+// Batch Mode
+
+TEST(Batch, MalformedExpressionYieldsOneErrorRecord) {
+    StringRef Input = "+1;\nx+1;\n)3;\n1 2;\n4;\n";
+    StringRef Expected = "1\terror\tunexpected token when expecting an expression\n"
+                         "2\terror\tOnly numeric literals and operators are permitted.\n"
+                         "3\terror\tunexpected token when expecting an expression\n"
+                         "4\terror\texpected ';' after expression\n"
+                         "5\tok\t4\n";
+    for (const char *Mode : {"--batch", "--pipeline", "--shards=2"}) {
+        ToolRun Run = RunCalculator(Mode, Input);
+        EXPECT_EQ(Run.Status, 0) << Mode;
+        EXPECT_EQ(Run.Output, Expected) << Mode;
+    }
+}
+
+// Background Compiles
+
+TEST(CompileAsync, ParsesOnceAndInterpretsUntilTheCodeIsReady) {
+    InitializeCalculator();
+    Engine E;
+    double Parsed = MetricValue("calc_expressions_parsed_total");
+    PendingExpr P = E.compileAsync("x*x-y");
+    ASSERT_TRUE(P);
+    double Args[2] = {5, 3};
+    EXPECT_EQ(P.eval(Args), 22);
+    ExprHandle H = P.getFuture().get();
+    ASSERT_TRUE(H);
+    EXPECT_TRUE(P.isReady());
+    EXPECT_EQ(P.eval(Args), 22);
+    EXPECT_EQ(H.eval(Args), 22);
+    EXPECT_EQ(MetricValue("calc_expressions_parsed_total") - Parsed, 1);
+}
+
+// Profiler Support
+
+TEST(PerfMap, NamesCompiledFunctionsAfterTheirExpressions) {
+    InitializeCalculator();
+    string Map = ("/tmp/perf-" + Twine(getpid()) + ".map").str();
+    unlink(Map.c_str());
+    // Only JITs created from here on report to perf, and the listener stays for the rest of the process.
+    EnablePerfSupport(/*PerfMap=*/true, /*JITDump=*/false);
+    Engine E;
+    ASSERT_TRUE(E.compile("a*b+7"));
+
+    auto Buf = MemoryBuffer::getFile(Map);
+    ASSERT_TRUE(bool(Buf)) << "no perf map " << Map;
+    StringRef Rest = (*Buf)->getBuffer();
+    unsigned Entries = 0;
+    while (!Rest.empty()) {
+        StringRef Line;
+        tie(Line, Rest) = Rest.split('\n');
+        // <start> <size> <symbol> [<hash>] <expression>
+        SmallVector<StringRef, 5> Fields;
+        Line.split(Fields, ' ', 4);
+        ASSERT_EQ(Fields.size(), 5u) << Line.str();
+        uint64_t Start, Size;
+        EXPECT_FALSE(Fields[0].getAsInteger(16, Start)) << Line.str();
+        EXPECT_FALSE(Fields[1].getAsInteger(16, Size)) << Line.str();
+        EXPECT_GT(Size, 0u) << Line.str();
+        EXPECT_TRUE(Fields[3].startswith("[") && Fields[3].endswith("]")) << Line.str();
+        EXPECT_EQ(Fields[4].str(), "(a * b) + 7") << Line.str();
+        ++Entries;
+    }
+    EXPECT_GT(Entries, 0u);
+    unlink(Map.c_str());
+}
+
+// Compile Coalescing
+
+TEST(CompileCoalescing, ConcurrentIdenticalCompilesShareOne) {
+    InitializeCalculator();
+    Engine Alone;
+    double Native = MetricValue("calc_compiles_total{tier=\"native\"}");
+    ASSERT_TRUE(Alone.compile("x*y+z"));
+    double PerCompile = MetricValue("calc_compiles_total{tier=\"native\"}") - Native;
+    ASSERT_GT(PerCompile, 0);
+
+    // Spacing, parentheses and the trailing ';' differ, but the expressions are the same.
+    const char *Sources[] = {"x*y+z", "x * y + z", "(x*y)+z;", "((x * y)) + z"};
+    Engine E;
+    Native = MetricValue("calc_compiles_total{tier=\"native\"}");
+    atomic<bool> Go{false};
+    vector<ExprHandle> Handles(16);
+    vector<std::thread> Threads;
+    for (size_t I = 0; I != Handles.size(); ++I)
+        Threads.emplace_back([&, I] {
+            while (!Go.load())
+                ;
+            Handles[I] = E.compile(Sources[I % 4]);
+        });
+    Go = true;
+    for (auto &T : Threads)
+        T.join();
+
+    EXPECT_EQ(MetricValue("calc_compiles_total{tier=\"native\"}") - Native, PerCompile);
+    double Args[3] = {2, 3, 4};
+    for (ExprHandle &H : Handles) {
+        ASSERT_TRUE(H);
+        EXPECT_EQ(H.eval(Args), 10);
+    }
+
+    // A later request reuses the finished compile.
+    ASSERT_TRUE(E.compile("x*y + z"));
+    EXPECT_EQ(MetricValue("calc_compiles_total{tier=\"native\"}") - Native, PerCompile);
+}
+
+// Named Definitions
+
+TEST(Registry, CallsSeeWholeDefinitionsWhileTheyAreReplaced) {
+    InitializeCalculator();
+    Engine E;
+    ASSERT_TRUE(E.define("f", "x+1"));
+
+    // Readers call f while the writer flips it between two definitions; each call must run one of them, never a freed or half-published one.
+    atomic<bool> Stop{false};
+    atomic<uint64_t> Calls{0}, Wrong{0};
+    vector<std::thread> Readers;
+    for (int I = 0; I != 4; ++I)
+        Readers.emplace_back([&] {
+            double Args[1] = {10}, Result;
+            while (!Stop.load()) {
+                if (!E.call("f", Args, 1, Result) || (Result != 11 && Result != 20))
+                    ++Wrong;
+                ++Calls;
+            }
+        });
+    for (int I = 0; I != 200; ++I)
+        ASSERT_TRUE(E.define("f", I % 2 ? "x+1" : "x*2"));
+    Stop = true;
+    for (auto &T : Readers)
+        T.join();
+    EXPECT_GT(Calls.load(), 0u);
+    EXPECT_EQ(Wrong.load(), 0u);
+
+    double Args[2] = {10, 1}, Result;
+    EXPECT_TRUE(E.call("f", Args, 1, Result));
+    EXPECT_EQ(Result, 11);
+    EXPECT_FALSE(E.call("f", Args, 2, Result));
+    EXPECT_TRUE(E.undefine("f"));
+    EXPECT_FALSE(E.call("f", Args, 1, Result));
+    EXPECT_FALSE(E.undefine("f"));
+    // A failed definition leaves no entry behind.
+    EXPECT_FALSE(E.define("g", "x+"));
+    EXPECT_FALSE(E.call("g", Args, 1, Result));
+}
+
+// Shared-Memory Ring
+
+TEST(ShmRing, ClientsOnSeveralThreadsGetTheirOwnResults) {
+    string Region = TempPath("shm");
+    ToolProcess Server({"--shm-server=" + Region, "--shm-max-batch=1"}, RegionReady(Region));
+    ASSERT_TRUE(Server.isRunning());
+
+    CalcShmClient Setup;
+    ASSERT_TRUE(Setup.connect(Region.c_str()));
+    uint32_t Handle, NumArgs;
+    EXPECT_FALSE(Setup.compile("x+", Handle, NumArgs));
+    EXPECT_STRNE(Setup.errorMessage(), "");
+    ASSERT_TRUE(Setup.compile("x*2+y", Handle, NumArgs)) << Setup.errorMessage();
+    EXPECT_EQ(NumArgs, 2u);
+    double Args[2] = {1, 2}, Result;
+    EXPECT_FALSE(Setup.eval(Handle, Args, 1, Result));
+    EXPECT_FALSE(Setup.eval(Handle + 1, Args, 2, Result));
+
+    // Each thread's requests carry its own operands; every answer must match them.
+    atomic<uint64_t> Wrong{0};
+    vector<std::thread> Threads;
+    for (int T = 0; T != 8; ++T)
+        Threads.emplace_back([&, T] {
+            CalcShmClient Client;
+            if (!Client.connect(Region.c_str())) {
+                ++Wrong;
+                return;
+            }
+            for (int I = 0; I != 2000; ++I) {
+                double Args[2] = {double(I), double(T)}, Result;
+                if (!Client.eval(Handle, Args, 2, Result) || Result != 2 * I + T)
+                    ++Wrong;
+            }
+        });
+    for (auto &T : Threads)
+        T.join();
+    EXPECT_EQ(Wrong.load(), 0u);
+    unlink(Region.c_str());
+}
+
+TEST(ShmRing, LiveRegionIsNotTakenOverAndDeadClientsLoseTheirSlots) {
+    string Region = TempPath("shm");
+    ToolProcess Server({"--shm-server=" + Region}, RegionReady(Region));
+    ASSERT_TRUE(Server.isRunning());
+
+    CalcShmClient Setup;
+    ASSERT_TRUE(Setup.connect(Region.c_str()));
+    uint32_t Handle, NumArgs;
+    ASSERT_TRUE(Setup.compile("x+1", Handle, NumArgs)) << Setup.errorMessage();
+
+    // A second engine must leave the region, and the first engine's clients, alone.
+    ToolRun Second = RunCalculator("--shm-server=" + Region, "");
+    EXPECT_EQ(Second.Status, 1);
+    EXPECT_NE(Second.Output.find("already served by a running engine"), string::npos) << Second.Output;
+    double Args[1] = {41}, Result;
+    ASSERT_TRUE(Setup.eval(Handle, Args, 1, Result));
+    EXPECT_EQ(Result, 42);
+
+    // Clients that exit without releasing their slots take every slot but the one Setup holds.
+    for (uint32_t I = 1; I != CalcShmNumSlots; ++I) {
+        pid_t Child = fork();
+        if (Child == 0) {
+            auto *Client = new CalcShmClient;
+            _exit(Client->connect(Region.c_str()) ? 0 : 1);
+        }
+        int Status;
+        waitpid(Child, &Status, 0);
+        ASSERT_TRUE(WIFEXITED(Status) && WEXITSTATUS(Status) == 0) << "client " << I;
+    }
+    // The engine frees them once it notices, within about a second of going idle.
+    CalcShmClient Late;
+    bool Connected = false;
+    for (int Attempt = 0; Attempt != 50 && !(Connected = Late.connect(Region.c_str())); ++Attempt)
+        usleep(100000);
+    ASSERT_TRUE(Connected);
+    ASSERT_TRUE(Late.eval(Handle, Args, 1, Result));
+    EXPECT_EQ(Result, 42);
+    unlink(Region.c_str());
+}
+
+// Dynamic Batching
+
+TEST(ShmBatching, ConcurrentEvaluationsShareKernelCalls) {
+    string Region = TempPath("shm");
+    string Metrics = TempPath("metrics.sock");
+    // A long window makes sure concurrent requests meet in a batch.
+    ToolProcess Server({"--shm-server=" + Region, "--shm-batch-window=2000", "--latency-stats", "--metrics-socket=" + Metrics},
+                       RegionReady(Region));
+    ASSERT_TRUE(Server.isRunning());
+
+    CalcShmClient Setup;
+    ASSERT_TRUE(Setup.connect(Region.c_str()));
+    uint32_t Square, Sum, NumArgs;
+    ASSERT_TRUE(Setup.compile("x*x", Square, NumArgs));
+    ASSERT_TRUE(Setup.compile("x+y", Sum, NumArgs));
+
+    // Threads alternate between two expressions, so batches must also keep them apart.
+    const int Threads = 8, Requests = 200;
+    atomic<uint64_t> Wrong{0};
+    vector<std::thread> Clients;
+    for (int T = 0; T != Threads; ++T)
+        Clients.emplace_back([&, T] {
+            CalcShmClient Client;
+            if (!Client.connect(Region.c_str())) {
+                ++Wrong;
+                return;
+            }
+            for (int I = 0; I != Requests; ++I) {
+                double Args[2] = {double(I), double(T)}, Result;
+                bool Ok = T % 2 ? Client.eval(Square, Args, 1, Result) && Result == double(I) * I
+                                : Client.eval(Sum, Args, 2, Result) && Result == I + T;
+                if (!Ok)
+                    ++Wrong;
+            }
+        });
+    for (auto &T : Clients)
+        T.join();
+    EXPECT_EQ(Wrong.load(), 0u);
+
+    double Rows = SocketMetricValue(Metrics, "calc_executed_rows_total");
+    double BatchCalls = SocketMetricValue(Metrics, "calc_latency_seconds_count{kind=\"batch\"}");
+    EXPECT_EQ(Rows, Threads * Requests);
+    EXPECT_GT(BatchCalls, 0);
+    EXPECT_LT(BatchCalls, Rows / 2);
+    unlink(Region.c_str());
+    unlink(Metrics.c_str());
+}
+
+TEST(ShmBatching, KernelsThatOnlyCopyAColumnLink) {
+    // The optimizer makes these kernels calls to memcpy, which the JIT must find.
+    InitializeCalculator();
+    Engine E;
+    for (const char *Src : {"x", "(y)", "x + 0 * y"}) {
+        ExprHandle H = E.compile(Src);
+        ASSERT_TRUE(H) << Src << ": " << E.getError();
+        vector<double> Args(H.getNumArgs() * 100), Results(100);
+        for (size_t I = 0; I != Args.size(); ++I)
+            Args[I] = I;
+        H.evalBatch(Args.data(), Results.data(), 100);
+        for (size_t I = 0; I != 100; ++I)
+            EXPECT_EQ(Results[I], Args[I]) << Src;
+    }
+}
+
+// Sharded Batch Evaluation
+
+/// WorkerPids - The processes Coordinator has started and not yet reaped.
+static vector<pid_t> WorkerPids(pid_t Coordinator) {
+    // procfs files report no size, so this reads with stdio rather than through a MemoryBuffer.
+    string Path = ("/proc/" + Twine(Coordinator) + "/task/" + Twine(Coordinator) + "/children").str();
+    vector<pid_t> Pids;
+    if (FILE *Children = fopen(Path.c_str(), "r")) {
+        int Pid;
+        while (fscanf(Children, "%d", &Pid) == 1)
+            Pids.push_back(Pid);
+        fclose(Children);
+    }
+    return Pids;
+}
+
+/// KillShardWorker - Run a sharded batch over Count expressions and kill worker Victim mid-shard: 0 is the one whose records stream out, 1 the one whose records are spilled. Returns the coordinator's exit status; its output goes to Output.
+static int KillShardWorker(unsigned Count, StringRef Retries, const string &Output, size_t Victim = 0) {
+    string Input = TempPath("shard-input");
+    {
+        FILE *In = fopen(Input.c_str(), "w");
+        for (unsigned I = 0; I != Count; ++I)
+            fprintf(In, "%u*2+1;\n", I);
+        fclose(In);
+    }
+    ToolProcess Coordinator({"--shards=2", "--shard-retries=" + Retries.str()}, nullptr, Input, Output);
+    vector<pid_t> Workers;
+    for (int I = 0; I != 1000 && (Workers = WorkerPids(Coordinator.getPid())).size() < 2; ++I)
+        usleep(1000);
+    EXPECT_EQ(Workers.size(), 2u);
+    if (Workers.size() > Victim)
+        kill(Workers[Victim], SIGKILL);
+    int Status = Coordinator.wait();
+    unlink(Input.c_str());
+    return Status;
+}
+
+TEST(Shards, KilledWorkerIsReRunFromTheStartOfItsShard) {
+    // The streaming worker's re-run must not repeat the records already written; the spilling worker's must replace its spilled ones.
+    for (size_t Victim : {0, 1}) {
+        string Output = TempPath("shard-output");
+        const unsigned Count = 1000;
+        ASSERT_EQ(KillShardWorker(Count, "2", Output, Victim), 0) << ReadFile(Output);
+
+        // Every expression yields its one record, in input order, with the retry reported on stderr.
+        string Text = ReadFile(Output);
+        StringRef Rest = Text;
+        unsigned Records = 0, Retries = 0;
+        while (!Rest.empty()) {
+            StringRef Line;
+            tie(Line, Rest) = Rest.split('\n');
+            if (Line.startswith("Error: worker for shard")) {
+                ++Retries;
+                continue;
+            }
+            ++Records;
+            EXPECT_EQ(Line.str(), (Twine(Records) + "\tok\t" + Twine(2 * (Records - 1) + 1)).str());
+        }
+        EXPECT_EQ(Records, Count) << "worker " << Victim;
+        EXPECT_EQ(Retries, 1u) << "worker " << Victim;
+        unlink(Output.c_str());
+    }
+}
+
+TEST(Shards, GivesUpOnceRetriesRunOut) {
+    string Output = TempPath("shard-output");
+    EXPECT_EQ(KillShardWorker(1000, "0", Output), 1);
+    EXPECT_NE(ReadFile(Output).find("failed after 1 attempts; giving up"), string::npos) << ReadFile(Output);
+    unlink(Output.c_str());
+}
+
+// Regression Harness
+
+/// WriteResultsFile - Store a results file, in the format calculator_regress --save writes, holding one benchmark with these time samples.
+static string WriteResultsFile(StringRef Name, const vector<double> &Times) {
+    string Path = TempPath(Name);
+    FILE *F = fopen(Path.c_str(), "w");
+    fprintf(F, "{\"version\": 1, \"context\": {}, \"benchmarks\": [{\"name\": \"BM_Test\", \"real_time_ns\": [");
+    for (size_t I = 0; I != Times.size(); ++I)
+        fprintf(F, "%s%g", I ? ", " : "", Times[I]);
+    fprintf(F, "]}]}\n");
+    fclose(F);
+    return Path;
+}
+
+/// CompareTimes - Run the harness's comparison of two sets of time samples. Returns its exit status, and in Row the fields of the one row of its report after the benchmark and metric names.
+static int CompareTimes(const vector<double> &Before, const vector<double> &After, vector<string> &Row) {
+    string Base = WriteResultsFile("base.json", Before), Cur = WriteResultsFile("cur.json", After);
+    ToolRun Run = RunTool(RegressPath(), "--all --baseline=" + Base + " --results=" + Cur, "");
+    unlink(Base.c_str());
+    unlink(Cur.c_str());
+    Row.clear();
+    StringRef Rest = Run.Output;
+    while (!Rest.empty()) {
+        StringRef Line;
+        tie(Line, Rest) = Rest.split('\n');
+        if (!Line.consume_front("BM_Test"))
+            continue;
+        SmallVector<StringRef, 8> Fields;
+        Line.split(Fields, ' ', -1, /*KeepEmpty=*/false);
+        for (StringRef Field : makeArrayRef(Fields).drop_front())
+            Row.push_back(Field.str());
+    }
+    EXPECT_FALSE(Row.empty()) << Run.Output;
+    return Run.Status;
+}
+
+TEST(Regress, MannWhitneyExactForSmallSamples) {
+    vector<string> Row;
+    // Every later sample is slower: the most extreme of the C(10, 5) = 252 orderings at either end, p = 2/252.
+    EXPECT_EQ(CompareTimes({1, 2, 3, 4, 5}, {6, 7, 8, 9, 10}, Row), 1);
+    EXPECT_EQ(Row, vector<string>({"3", "ns", "8", "ns", "+166.7%", "0.0079", "regressed"}));
+
+    // One pair out of order: U = 24, the mirror of U = 1, so p = 2 * 2/252.
+    EXPECT_EQ(CompareTimes({6, 7, 8, 9, 10}, {1, 2, 3, 4, 6.5}, Row), 0);
+    EXPECT_EQ(Row, vector<string>({"8", "ns", "3", "ns", "-62.5%", "0.0159"}));
+
+    // Interleaved samples: U = 10, p = 2 * 87/252.
+    EXPECT_EQ(CompareTimes({1, 3, 5, 7, 9}, {2, 4, 6, 8, 10}, Row), 0);
+    EXPECT_EQ(Row, vector<string>({"5", "ns", "6", "ns", "+20.0%", "0.6905"}));
+}
+
+TEST(Regress, MannWhitneyNormalApproximationWithTies) {
+    vector<string> Row;
+    // Ties rule out the exact table. U = 0, and the tie-corrected variance is 64/12 * (17 - 48/240) = 89.6, so with
+    // the continuity correction z = 31.5 / sqrt(89.6) and p = erfc(z / sqrt(2)) = 0.000875.
+    EXPECT_EQ(CompareTimes({1, 1, 2, 2, 3, 3, 4, 4}, {5, 5, 6, 6, 7, 7, 8, 8}, Row), 1);
+    EXPECT_EQ(Row, vector<string>({"2.5", "ns", "6.5", "ns", "+160.0%", "0.0009", "regressed"}));
+}
+
+// Memory Accounting
+
+TEST(MemoryAccounting, ProcessesSharingACacheExitCleanlyAndCountItsBytes) {
+    string Cache = TempPath("cache");
+    string First = TempPath("metrics.1"), Second = TempPath("metrics.2");
+    StringRef Input = "1+2;\n3*4;\n", Expected = "1\tok\t3\n2\tok\t12\n";
+    StringRef Shared = "calc_memory_bytes{subsystem=\"shared_object_cache\"}";
+
+    // The first process fills the cache; the second finds everything in it. Both must exit cleanly with the store open.
+    ToolRun Fill = RunCalculator("--batch --memory-report --object-cache=" + Cache + " --metrics-file=" + First, Input);
+    ASSERT_EQ(Fill.Status, 0) << Fill.Output;
+    EXPECT_EQ(FileMetricValue(First, "calc_object_cache_misses_total"), 2);
+    EXPECT_GT(FileMetricValue(First, Shared), 0);
+
+    ToolRun Reuse = RunCalculator("--batch --object-cache=" + Cache + " --metrics-file=" + Second, Input);
+    ASSERT_EQ(Reuse.Status, 0) << Reuse.Output;
+    EXPECT_EQ(Reuse.Output, Expected);
+    EXPECT_EQ(FileMetricValue(Second, "calc_object_cache_hits_total"), 2);
+    EXPECT_EQ(FileMetricValue(Second, "calc_object_cache_misses_total"), 0);
+    EXPECT_EQ(FileMetricValue(Second, Shared), FileMetricValue(First, Shared));
+
+    // Shard workers open the store too, and a worker that fails at exit would be re-run.
+    ToolRun Sharded = RunCalculator("--shards=2 --object-cache=" + Cache, Input);
+    EXPECT_EQ(Sharded.Status, 0);
+    EXPECT_EQ(Sharded.Output, Expected);
+    unlink(Cache.c_str());
+    unlink(First.c_str());
+    unlink(Second.c_str());
+}
+
+// Fork Server
+
+TEST(ForkServer, EachConnectionRunsASessionOfItsOwn) {
+    string Socket = TempPath("fork.sock");
+    ToolProcess Server({"--fork-server=" + Socket, "--batch"}, SocketReady(Socket));
+    ASSERT_TRUE(Server.isRunning());
+
+    // Concurrent sessions are separate children, so each numbers its own records from 1.
+    vector<ToolRun> Runs(4);
+    vector<std::thread> Clients;
+    for (size_t I = 0; I != Runs.size(); ++I)
+        Clients.emplace_back([&, I] {
+            string Input = (Twine(I) + "*10;\n+1;\n" + Twine(I) + "+1;\n").str();
+            Runs[I] = RunCalculator("--connect=" + Socket, Input);
+        });
+    for (auto &T : Clients)
+        T.join();
+    for (size_t I = 0; I != Runs.size(); ++I) {
+        EXPECT_EQ(Runs[I].Status, 0);
+        EXPECT_EQ(Runs[I].Output, (Twine("1\tok\t") + Twine(I * 10) +
+                                   "\n2\terror\tunexpected token when expecting an expression\n3\tok\t" +
+                                   Twine(I + 1) + "\n")
+                                      .str());
+    }
+    EXPECT_TRUE(Server.isRunning());
+    unlink(Socket.c_str());
+}
+
+// Expression Server
+
+/// WriteFrame - Send Payload on FD with the server's framing: a 32-bit little-endian length, then the bytes.
+static bool WriteFrame(int FD, StringRef Payload) {
+    string Frame(4, '\0');
+    support::endian::write32le(&Frame[0], Payload.size());
+    Frame += Payload;
+    return write(FD, Frame.data(), Frame.size()) == ssize_t(Frame.size());
+}
+
+/// ReadFrame - Receive one framed payload from FD. Returns false at the end of the stream.
+static bool ReadFrame(int FD, string &Payload) {
+    auto ReadAll = [FD](char *Buf, size_t Size) {
+        for (size_t Done = 0; Done < Size;) {
+            ssize_t N = read(FD, Buf + Done, Size - Done);
+            if (N <= 0)
+                return false;
+            Done += N;
+        }
+        return true;
+    };
+    char Length[4];
+    if (!ReadAll(Length, 4))
+        return false;
+    Payload.resize(support::endian::read32le(Length));
+    return ReadAll(&Payload[0], Payload.size());
+}
+
+TEST(Server, PipelinedRequestsAnswerInOrderOnEveryConnection) {
+    string Socket = TempPath("server.sock");
+    ToolProcess Server({"--server=" + Socket, "--workers=3"}, SocketReady(Socket));
+    ASSERT_TRUE(Server.isRunning());
+
+    // Each connection sends all its requests before reading, so the workers answer them out of order among themselves.
+    atomic<uint64_t> Wrong{0};
+    vector<std::thread> Clients;
+    for (int C = 0; C != 4; ++C)
+        Clients.emplace_back([&, C] {
+            int FD = ConnectUnix(Socket);
+            if (FD < 0) {
+                ++Wrong;
+                return;
+            }
+            const int Requests = 50;
+            for (int I = 0; I != Requests; ++I)
+                WriteFrame(FD, I % 10 == 9 ? string("1 +") : (Twine(C) + " * 1000 + " + Twine(I) + ";").str());
+            for (int I = 0; I != Requests; ++I) {
+                string Response;
+                bool Ok = ReadFrame(FD, Response) &&
+                          (I % 10 == 9 ? StringRef(Response).startswith("error\t")
+                                       : Response == (Twine("ok\t") + Twine(C * 1000 + I)).str());
+                if (!Ok)
+                    ++Wrong;
+            }
+            close(FD);
+        });
+    for (auto &T : Clients)
+        T.join();
+    EXPECT_EQ(Wrong.load(), 0u);
+    unlink(Socket.c_str());
+}
+
+TEST(Server, IdenticalRequestsAcrossConnectionsAllGetAnswers) {
+    string Socket = TempPath("server.sock");
+    ToolProcess Server({"--server=" + Socket, "--workers=4"}, SocketReady(Socket));
+    ASSERT_TRUE(Server.isRunning());
+
+    // Every connection sends the same requests at once, spelled differently, so workers keep finding them in flight on each other.
+    const char *Spellings[] = {"2 * 21 + 0.5", "(2*21)+0.5;", "((2 * 21)) + 0.5"};
+    atomic<uint64_t> Wrong{0};
+    vector<std::thread> Clients;
+    for (int C = 0; C != 6; ++C)
+        Clients.emplace_back([&, C] {
+            int FD = ConnectUnix(Socket);
+            if (FD < 0) {
+                ++Wrong;
+                return;
+            }
+            const int Requests = 30;
+            for (int I = 0; I != Requests; ++I)
+                WriteFrame(FD, I % 5 == 4 ? "2 * (21" : Spellings[(C + I) % 3]);
+            for (int I = 0; I != Requests; ++I) {
+                string Response;
+                bool Ok = ReadFrame(FD, Response) &&
+                          (I % 5 == 4 ? StringRef(Response).startswith("error\t") : Response == "ok\t42.5");
+                if (!Ok)
+                    ++Wrong;
+            }
+            close(FD);
+        });
+    for (auto &T : Clients)
+        T.join();
+    EXPECT_EQ(Wrong.load(), 0u);
+    unlink(Socket.c_str());
+}
+
+// Pipelined Batch Mode
+
+TEST(Pipeline, RecordsMatchThePlainBatchDriver) {
+    // Enough expressions to fill the queues between stages, with errors, infinities and NaNs among them.
+    string Input;
+    for (int I = 0; I != 3000; ++I) {
+        switch (I % 7) {
+        case 3:
+            Input += "(1 + ;\n";
+            break;
+        case 5:
+            Input += (Twine(I) + " / 0;\n").str();
+            break;
+        case 6:
+            Input += "0 / 0;\n";
+            break;
+        default:
+            Input += (Twine(I) + " * 3 - (" + Twine(I % 11) + " < 5);\n").str();
+        }
+    }
+    ToolRun Plain = RunCalculator("--batch", Input);
+    ToolRun Pipelined = RunCalculator("--pipeline", Input);
+    ASSERT_EQ(Plain.Status, 0);
+    EXPECT_EQ(Pipelined.Status, 0);
+    EXPECT_EQ(count(Plain.Output.begin(), Plain.Output.end(), '\n'), 3000);
+    EXPECT_TRUE(Pipelined.Output == Plain.Output);
+}
+
+// Library Interface
+
+TEST(Library, CompiledExpressionsEvaluateRowsAndBatchesAlike) {
+    InitializeCalculator();
+    Engine E;
+    // Variables become arguments in order of first appearance.
+    ExprHandle H = E.compile("y*2 + x - (y < x)");
+    ASSERT_TRUE(H);
+    ASSERT_EQ(H.getNumArgs(), 2u);
+    double Row[2] = {5, 3}; // y, x
+    EXPECT_EQ(H.eval(Row), 5 * 2 + 3 - 0);
+
+    const size_t Count = 37; // Not a multiple of any vector width.
+    vector<double> Args(2 * Count), Results(Count);
+    for (size_t I = 0; I != Count; ++I) {
+        Args[I] = I;                // y
+        Args[Count + I] = 40.0 - I; // x
+    }
+    H.evalBatch(Args.data(), Results.data(), Count);
+    for (size_t I = 0; I != Count; ++I) {
+        double Row[2] = {Args[I], Args[Count + I]};
+        EXPECT_EQ(Results[I], H.eval(Row)) << "row " << I;
+    }
+
+    EXPECT_FALSE(E.compile("x +"));
+    EXPECT_NE(E.getError(), "");
+}
+
+TEST(Library, CInterfaceMatchesTheCppOne) {
+    InitializeCalculator();
+    CalcEngineRef Engine = CalcCreateEngine();
+    CalcExprRef Expr = CalcCompile(Engine, "a*b+1", 5);
+    ASSERT_TRUE(Expr);
+    EXPECT_EQ(CalcGetNumArgs(Expr), 2u);
+    double Args[2] = {3, 4};
+    EXPECT_EQ(CalcEval(Expr, Args), 13);
+    EXPECT_FALSE(CalcCompile(Engine, "a*", 2));
+    EXPECT_STRNE(CalcGetError(Engine), "");
+
+    double Result;
+    EXPECT_TRUE(CalcDefine(Engine, "f", "a-b", 3));
+    EXPECT_TRUE(CalcCall(Engine, "f", Args, 2, &Result));
+    EXPECT_EQ(Result, -1);
+    EXPECT_TRUE(CalcUndefine(Engine, "f"));
+    EXPECT_FALSE(CalcCall(Engine, "f", Args, 2, &Result));
+
+    // A short buffer gets a truncated, terminated copy and the length to retry with.
+    char Small[16];
+    size_t Length = CalcFormatMetrics(Small, sizeof(Small));
+    EXPECT_GT(Length, sizeof(Small));
+    EXPECT_EQ(strlen(Small), sizeof(Small) - 1);
+    vector<char> Full(Length + 1);
+    EXPECT_EQ(CalcFormatMetrics(Full.data(), Full.size()), Length);
+    EXPECT_EQ(strlen(Full.data()), Length);
+    CalcDisposeEngine(Engine);
+}
+
+// Out-of-Process Compilation
+
+TEST(CompileServer, RemoteEngineRunsCodeCompiledElsewhere) {
+    InitializeCalculator();
+    string Socket = TempPath("compile.sock");
+    ToolProcess Server({"--compile-server=" + Socket}, SocketReady(Socket));
+    ASSERT_TRUE(Server.isRunning());
+
+    Engine E(Socket.c_str());
+    double Remote = MetricValue("calc_compiles_total{tier=\"remote\"}");
+    double Native = MetricValue("calc_compiles_total{tier=\"native\"}");
+    ExprHandle H = E.compile("x*x + y");
+    ASSERT_TRUE(H) << E.getError();
+    double Args[2] = {3, 1};
+    EXPECT_EQ(H.eval(Args), 10);
+    double Columns[4] = {1, 2, 10, 20}, Results[2];
+    H.evalBatch(Columns, Results, 2);
+    EXPECT_EQ(Results[0], 11);
+    EXPECT_EQ(Results[1], 24);
+    // The code generator ran in the server, not here.
+    EXPECT_EQ(MetricValue("calc_compiles_total{tier=\"remote\"}") - Remote, 1);
+    EXPECT_EQ(MetricValue("calc_compiles_total{tier=\"native\"}") - Native, 0);
+
+    EXPECT_FALSE(E.compile("x*"));
+    EXPECT_NE(E.getError(), "");
+    unlink(Socket.c_str());
+}
+
+TEST(CompileServer, UnreachableServerFailsCompilesWithAReason) {
+    InitializeCalculator();
+    Engine E(TempPath("missing.sock").c_str());
+    EXPECT_FALSE(E.compile("1+2"));
+    EXPECT_NE(E.getError(), "");
+}
+
+TEST(CompileServer, GarbageObjectCodeFailsTheCompileNotTheHost) {
+    InitializeCalculator();
+    string Socket = TempPath("garbage.sock");
+    int Listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    strncpy(Addr.sun_path, Socket.c_str(), sizeof(Addr.sun_path) - 1);
+    ASSERT_EQ(bind(Listener, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr)), 0);
+    ASSERT_EQ(listen(Listener, 1), 0);
+    // A stand-in server that reports success for every request, with bytes that are no object file.
+    std::thread Server([Listener] {
+        string Response("ok", 3);
+        Response += "\x7f" "ELF, but nothing like an object file";
+        int FD;
+        while ((FD = accept(Listener, nullptr, nullptr)) >= 0) {
+            string Request;
+            while (ReadFrame(FD, Request))
+                WriteFrame(FD, Response);
+            close(FD);
+        }
+    });
+
+    {
+        Engine E(Socket.c_str());
+        for (int I = 0; I != 2; ++I) {
+            EXPECT_FALSE(E.compile("x*2"));
+            EXPECT_NE(E.getError().find("unusable object code"), string::npos) << E.getError();
+        }
+    }
+    shutdown(Listener, SHUT_RDWR);
+    close(Listener);
+    Server.join();
+    unlink(Socket.c_str());
+}
+
+// Phase Time Report
+
+TEST(TimeReport, PhasesAddUpToTheTotal) {
+    for (const char *Mode : {"--batch", "--pipeline"}) {
+        ToolRun Run = RunCalculator(string(Mode) + " --time-report", "1+2;\n3*4;\n5-1;\n");
+        ASSERT_EQ(Run.Status, 0) << Mode;
+        StringRef Rest = Run.Output;
+        unsigned PerExpression = 0, Records = 0;
+        double Sum = 0, Total = -1, Shares = 0;
+        while (!Rest.empty()) {
+            StringRef Line;
+            tie(Line, Rest) = Rest.split('\n');
+            if (Line.startswith("time #"))
+                ++PerExpression;
+            else if (Line.contains("\tok\t"))
+                ++Records;
+            // Summary rows: phase, total in ms, per expression in us, share.
+            SmallVector<StringRef, 4> Fields;
+            Line.split(Fields, ' ', -1, /*KeepEmpty=*/false);
+            if (Fields.size() != 4 || !Fields[3].endswith("%"))
+                continue;
+            double Ms = strtod(Fields[1].str().c_str(), nullptr);
+            if (Fields[0] == "total") {
+                Total = Ms;
+                continue;
+            }
+            Sum += Ms;
+            Shares += strtod(Fields[3].str().c_str(), nullptr);
+        }
+        EXPECT_EQ(Records, 3u) << Mode;
+        // The pipelined stages overlap, so only the plain driver reports each expression as it finishes.
+        if (StringRef(Mode) == "--batch") {
+            EXPECT_EQ(PerExpression, 3u) << Run.Output;
+        }
+        EXPECT_GT(Total, 0) << Mode << "\n" << Run.Output;
+        EXPECT_NEAR(Sum, Total, 0.01) << Mode;
+        EXPECT_NEAR(Shares, 100, 0.5) << Mode;
+    }
+}
+
+// Benchmark Suite
+
+TEST(Benchmarks, EveryBenchmarkReportsAllFourMetrics) {
+    string Saved = TempPath("bench.json");
+    ToolRun Run = RunTool(RegressPath(),
+                          "--bench=" + string(BenchPath()) +
+                              " --filter='^BM_(Lex|Codegen|JITCompile)/16$' --runs=1 --repetitions=2 --save=" + Saved,
+                          "");
+    ASSERT_EQ(Run.Status, 0) << Run.Output;
+
+    auto Buf = MemoryBuffer::getFile(Saved);
+    ASSERT_TRUE(bool(Buf));
+    Expected<json::Value> Root = json::parse((*Buf)->getBuffer());
+    ASSERT_TRUE(bool(Root)) << toString(Root.takeError());
+    const json::Array *Benchmarks = Root->getAsObject()->getArray("benchmarks");
+    ASSERT_TRUE(Benchmarks);
+    vector<string> Names;
+    for (const json::Value &B : *Benchmarks) {
+        const json::Object &Entry = *B.getAsObject();
+        Names.push_back(Entry.getString("name")->str());
+        // Time and throughput come from every repetition; the memory figures from the run's single measuring pass.
+        EXPECT_EQ(Entry.getArray("real_time_ns")->size(), 2u) << Names.back();
+        EXPECT_EQ(Entry.getArray("items_per_second")->size(), 2u) << Names.back();
+        EXPECT_GT(*(*Entry.getArray("items_per_second"))[0].getAsNumber(), 0) << Names.back();
+        EXPECT_EQ(Entry.getArray("allocs_per_iter")->size(), 1u) << Names.back();
+        EXPECT_EQ(Entry.getArray("max_bytes_used")->size(), 1u) << Names.back();
+    }
+    EXPECT_EQ(Names, vector<string>({"BM_Lex/16", "BM_Codegen/16", "BM_JITCompile/16"}));
+
+    // Results compared with themselves show no change, and the memory figures compare exactly.
+    ToolRun Same = RunTool(RegressPath(), "--all --baseline=" + Saved + " --results=" + Saved, "");
+    EXPECT_EQ(Same.Status, 0) << Same.Output;
+    EXPECT_NE(Same.Output.find("12 comparisons: 0 regressed, 0 improved"), string::npos) << Same.Output;
+    EXPECT_NE(Same.Output.find("exact"), string::npos) << Same.Output;
+    unlink(Saved.c_str());
+}
+
+// Expression Corpora
+
+TEST(Corpus, SameSeedSameCorpusAndEveryShapeParses) {
+    InitializeCalculator();
+    Engine E;
+    for (auto Shape : {CorpusOptions::Random, CorpusOptions::Chain, CorpusOptions::RightNested, CorpusOptions::LeftNested,
+                       CorpusOptions::Balanced}) {
+        CorpusOptions Opts;
+        Opts.Shape = Shape;
+        Opts.Depth = 4;
+        Opts.Width = 6;
+        Opts.ParenShare = 0.2;
+        Opts.Literals = CorpusOptions::Reals;
+        Opts.NumVars = 3;
+        Opts.RepeatShare = 0.3;
+        Opts.Seed = 42;
+        CorpusGenerator A(Opts), B(Opts);
+        Opts.Seed = 43;
+        CorpusGenerator Other(Opts);
+        bool Differs = false;
+        for (int I = 0; I != 50; ++I) {
+            string Expr = A.next();
+            EXPECT_EQ(Expr, B.next());
+            Differs |= Expr != Other.next();
+            EXPECT_TRUE(E.compile(Expr)) << Expr << ": " << E.getError();
+        }
+        EXPECT_TRUE(Differs) << "shape " << Shape;
+    }
+}
+
+TEST(Corpus, ShapesHaveTheirConfiguredSize) {
+    CorpusOptions Opts;
+    Opts.Shape = CorpusOptions::Chain;
+    Opts.Width = 1000;
+    string Chain = CorpusGenerator(Opts).next();
+    EXPECT_EQ(count(Chain.begin(), Chain.end(), ' '), 2 * 999);
+
+    Opts.Shape = CorpusOptions::RightNested;
+    Opts.Depth = 100000;
+    string Nested = CorpusGenerator(Opts).next();
+    EXPECT_EQ(count(Nested.begin(), Nested.end(), '('), 100000);
+    EXPECT_EQ(Nested.substr(Nested.size() - 100000), string(100000, ')'));
+
+    // The generator is its own, so a seed's corpus is the same everywhere.
+    Opts = CorpusOptions();
+    EXPECT_EQ(CorpusGenerator(Opts).next(), "0 / (3 + 7 * ((5 - 4 + 6 + 5) + (9 / 1 * 6) * (5 + 3 - 8 + 2)) / (2 * (8 + 7 + 8 / 9) / (6 + 9 + 3) * (3 - 7)))");
+}
+
+// Latency Statistics
+
+TEST(Latency, HistogramIsExactBelow128AndWithinA64thAbove) {
+    HdrHistogram Small;
+    for (uint64_t V = 0; V != 128; ++V)
+        Small.record(V);
+    EXPECT_EQ(Small.getPercentile(50), 63u);
+    EXPECT_EQ(Small.getPercentile(99), 126u);
+    EXPECT_EQ(Small.getPercentile(100), 127u);
+
+    for (uint64_t V : {128ull, 129ull, 1000ull, 12345ull, 1000007ull, 1000000003ull, 3000000000017ull}) {
+        // Recording a larger value too keeps the maximum from clamping V's bucket.
+        HdrHistogram H;
+        H.record(V);
+        H.record(V * 4);
+        uint64_t P50 = H.getPercentile(50);
+        EXPECT_GE(P50, V);
+        EXPECT_LE(P50 - V, V / 64) << V;
+    }
+
+    HdrHistogram A, B;
+    A.record(10);
+    B.record(20);
+    B.record(5000);
+    A.merge(B);
+    EXPECT_EQ(A.getCount(), 3u);
+    EXPECT_EQ(A.getSum(), 5030u);
+    EXPECT_EQ(A.getMax(), 5000u);
+    EXPECT_EQ(A.getPercentile(60), 20u);
+}
+
+TEST(Latency, CallsOnThreadsThatHaveExitedStillCount) {
+    InitializeCalculator();
+    Engine E;
+    ASSERT_TRUE(E.define("twice", "x * 2"));
+    EnableLatencyStats();
+    uint64_t Before = MergeLatencies(LatencyNative)->getCount();
+    vector<std::thread> Callers;
+    for (int T = 0; T != 4; ++T)
+        Callers.emplace_back([&E] {
+            for (int I = 0; I != 100; ++I) {
+                double X = I, Result;
+                EXPECT_TRUE(E.call("twice", &X, 1, Result));
+            }
+        });
+    for (std::thread &T : Callers)
+        T.join();
+    EXPECT_EQ(MergeLatencies(LatencyNative)->getCount() - Before, 400u);
+    EXPECT_NE(FormatLatencyStats().find("native"), string::npos);
+    RecordLatencies = false;
+}
+
+TEST(Latency, StatsCommandReportsEveryKind) {
+    ToolRun Run = RunCalculator("--batch --latency-stats", "1+2;\nstats;\n3*4;\n");
+    EXPECT_EQ(Run.Status, 0);
+    EXPECT_NE(Run.Output.find("1\tok\t3\n"), string::npos) << Run.Output;
+    // Only the first request has finished when stats runs; the report at exit counts both.
+    for (StringRef Row : {"  request                  1 ", "  request                  2 "})
+        EXPECT_NE(Run.Output.find(Row.str()), string::npos) << Run.Output;
+    for (const char *Kind : LatencyNames)
+        EXPECT_NE(Run.Output.find(("  " + Twine(Kind) + " ").str()), string::npos) << Kind;
+
+    Run = RunCalculator("--batch", "stats;\n");
+    EXPECT_NE(Run.Output.find("latencies are not being recorded"), string::npos) << Run.Output;
+}
+
+// Hardware Counters
+
+TEST(HardwareCounters, ReportedPerExpressionAndPhaseOrRefusedUpFront) {
+    ToolRun Run = RunCalculator("--batch --hw-counters", "1+2;\n3*4;\n");
+    if (Run.Status != 0) {
+        // Machines without usable counters, such as most containers, fail before evaluating anything.
+        EXPECT_NE(Run.Output.find("Error: cannot open hardware performance counters"), string::npos) << Run.Output;
+        EXPECT_EQ(Run.Output.find("\tok\t"), string::npos) << Run.Output;
+        return;
+    }
+    for (StringRef Line : {"1\tok\t3\n", "2\tok\t12\n", "counters #1: cycles ", "counters #2: cycles ",
+                           "Hardware events per expression (2 expressions)"})
+        EXPECT_NE(Run.Output.find(Line.str()), string::npos) << Line.str() << "\n" << Run.Output;
+    for (const char *Phase : PhaseNames)
+        EXPECT_NE(Run.Output.find(("\n  " + Twine(Phase) + " ").str()), string::npos) << Phase;
+}
+
+TEST(HardwareCounters, RefusedWithAForkServer) {
+    string Socket = TempPath("fork.sock");
+    ToolRun Run = RunCalculator("--hw-counters --fork-server=" + Socket, "");
+    EXPECT_EQ(Run.Status, 1);
+    EXPECT_NE(Run.Output.find("hardware counters cannot be used with a fork server"), string::npos) << Run.Output;
+    EXPECT_NE(access(Socket.c_str(), F_OK), 0);
+}
+
+// Tracing
+
+/// ReadTrace - The events of the Chrome trace at Path, which may have been cut off after any event.
+static json::Array ReadTrace(StringRef Path) {
+    string Text = ReadFile(Path);
+    StringRef Body = StringRef(Text).rtrim();
+    if (!Body.endswith("]"))
+        Text = (Body.rtrim(',') + "]").str();
+    Expected<json::Value> Root = json::parse(Text);
+    if (!Root) {
+        ADD_FAILURE() << toString(Root.takeError());
+        return json::Array();
+    }
+    json::Array *Events = Root->getAsArray();
+    if (!Events) {
+        ADD_FAILURE() << "the trace is not an array of events";
+        return json::Array();
+    }
+    return move(*Events);
+}
+
+TEST(Trace, PhasesNestOnEachThreadsTrack) {
+    string Trace = TempPath("trace.json");
+    ToolRun Run = RunCalculator("--pipeline --trace=" + Trace, "1+2;\n3*4;\n");
+    ASSERT_EQ(Run.Status, 0) << Run.Output;
+    ASSERT_EQ(Run.Output, "1\tok\t3\n2\tok\t12\n");
+
+    // Spans on one thread must nest: each one ends before the span it starts inside of.
+    struct Span {
+        double Start, End;
+    };
+    map<int64_t, vector<Span>> Tracks;
+    set<string> ThreadNames, PhasesOfExpr[3];
+    for (const json::Value &V : ReadTrace(Trace)) {
+        const json::Object &Event = *V.getAsObject();
+        StringRef Ph = *Event.getString("ph");
+        const json::Object &Args = *Event.getObject("args");
+        if (Ph == "M" && *Event.getString("name") == "thread_name")
+            ThreadNames.insert(Args.getString("name")->str());
+        if (Ph != "X")
+            continue;
+        double Start = *Event.getNumber("ts");
+        Tracks[*Event.getInteger("tid")].push_back({Start, Start + *Event.getNumber("dur")});
+        if (Optional<int64_t> Expr = Args.getInteger("expr"))
+            if (*Event.getString("cat") == "phase" && *Expr >= 1 && *Expr <= 2)
+                PhasesOfExpr[*Expr].insert(Event.getString("name")->str());
+    }
+    for (auto &Track : Tracks) {
+        vector<Span> &Spans = Track.second;
+        llvm::sort(Spans, [](const Span &A, const Span &B) { return A.Start < B.Start; });
+        vector<double> Open;
+        for (const Span &S : Spans) {
+            while (!Open.empty() && Open.back() <= S.Start)
+                Open.pop_back();
+            // Times are whole nanoseconds, printed in microseconds.
+            EXPECT_TRUE(Open.empty() || S.End <= Open.back() + 0.002) << "thread " << Track.first << " at " << S.Start;
+            Open.push_back(S.End);
+        }
+    }
+
+    for (const char *Stage : {"main", "compile stage", "codegen stage", "execute stage"})
+        EXPECT_TRUE(ThreadNames.count(Stage)) << Stage;
+    for (int Expr = 1; Expr <= 2; ++Expr)
+        for (const char *Phase : {"lex", "parse", "codegen", "jit-emit", "execute"})
+            EXPECT_TRUE(PhasesOfExpr[Expr].count(Phase)) << "expression " << Expr << " " << Phase;
+}
+
+TEST(Trace, ServerStoppedBySignalLeavesALoadableTrace) {
+    string Socket = TempPath("server.sock"), Trace = TempPath("trace.json");
+    {
+        ToolProcess Server({"--server=" + Socket, "--trace=" + Trace}, SocketReady(Socket));
+        ASSERT_TRUE(Server.isRunning());
+        int FD = ConnectUnix(Socket);
+        ASSERT_GE(FD, 0);
+        string Response;
+        ASSERT_TRUE(WriteFrame(FD, "6 * 7") && ReadFrame(FD, Response));
+        EXPECT_EQ(Response, "ok\t42");
+        close(FD);
+        // Buffers are appended every 100ms.
+        usleep(300000);
+    }
+    unsigned Requests = 0;
+    for (const json::Value &V : ReadTrace(Trace))
+        Requests += *V.getAsObject()->getString("name") == "request";
+    EXPECT_GE(Requests, 1u);
+    unlink(Socket.c_str());
+}
+
+TEST(Trace, RefusedWithShardsOrAForkServer) {
+    string Trace = TempPath("trace.json");
+    ToolRun Run = RunCalculator("--trace=" + Trace + " --fork-server=" + TempPath("fork.sock"), "");
+    EXPECT_EQ(Run.Status, 1);
+    EXPECT_NE(Run.Output.find("a fork server cannot be traced"), string::npos) << Run.Output;
+    Run = RunCalculator("--batch --shards=2 --trace=" + Trace, "1+2;\n");
+    EXPECT_EQ(Run.Status, 1);
+    EXPECT_NE(Run.Output.find("--trace cannot be combined with --shards"), string::npos) << Run.Output;
+}
+
+// Explaining Expressions
+
+TEST(Explain, ReportsIRAssemblyAndCyclesPerRow) {
+    InitializeCalculator();
+    Engine E;
+    string Report;
+    ASSERT_TRUE(E.explain("x * y + 3", Report)) << E.getError();
+    for (StringRef Part : {"Optimized IR:\n", "define void @__explain_batch(", "\nAssembly (", "Loop analysis (llvm-mca, ",
+                           "\n  bottleneck ", "\n  Resource pressure "})
+        EXPECT_NE(Report.find(Part.str()), string::npos) << Part.str() << "\n" << Report;
+    size_t Row = Report.find("\n  cycles per row ");
+    ASSERT_NE(Row, string::npos) << Report;
+    double Cycles = strtod(Report.c_str() + Row + strlen("\n  cycles per row "), nullptr);
+    EXPECT_GT(Cycles, 0);
+    EXPECT_LT(Cycles, 100);
+
+    EXPECT_FALSE(E.explain("1 +", Report));
+    EXPECT_FALSE(E.getError().empty());
+    // Explaining leaves the engine as it was.
+    ExprHandle H = E.compile("x * y + 3");
+    ASSERT_TRUE(H) << E.getError();
+    double Args[] = {4, 5};
+    EXPECT_EQ(E.eval(H, Args), 23);
+}
+
+TEST(Explain, BatchCommandReportsWithoutARecord) {
+    ToolRun Run = RunCalculator("--batch", "explain x * y + 3;\n1+2;\nexplain 1 +;\n4*5;\n");
+    EXPECT_EQ(Run.Status, 0);
+    // A malformed expression gets an error record like any other; a report does not take one.
+    for (StringRef Part : {"Loop analysis (llvm-mca, ", "1\tok\t3\n", "2\terror\t", "3\tok\t20\n"})
+        EXPECT_NE(Run.Output.find(Part.str()), string::npos) << Part.str() << "\n" << Run.Output;
+}
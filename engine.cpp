@@ -0,0 +1,2914 @@
+#include "calculator.h"
+#include "calculator_c.h"
+#include "engine_internal.h"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCInstrAnalysis.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCObjectFileInfo.h"
+#include "llvm/MC/MCParser/MCAsmParser.h"
+#include "llvm/MC/MCParser/MCTargetAsmParser.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCStreamer.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/MCA/Context.h"
+#include "llvm/MCA/CustomBehaviour.h"
+#include "llvm/MCA/HWEventListener.h"
+#include "llvm/MCA/InstrBuilder.h"
+#include "llvm/MCA/Pipeline.h"
+#include "llvm/MCA/SourceMgr.h"
+#include "llvm/MCA/Support.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Target/TargetMachine.h"
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace std; // Added to use standard library components without std:: prefix
+
+namespace calculator {
+
+// Metrics
+// Process-wide instrumentation, exported in the Prometheus text format. Updates are relaxed atomic operations, cheap enough to leave on everywhere; only the phase latency histograms depend on phase timing being enabled.
+
+/// Metric - One time series. Metrics register themselves on construction, and are exported in that order: the series of one family must be defined next to each other.
+class Metric {
+    const char *Family;
+    const char *Labels; // Prometheus label pairs, without braces; empty for none.
+    const char *Help;
+    Metric *Next = nullptr;
+
+    static Metric *First, *Last;
+
+protected:
+    /// writeSample - Write one sample of this series, with Extra appended to its labels.
+    void writeSample(raw_ostream &OS, StringRef Suffix, StringRef Extra, double Value) const {
+        OS << Family << Suffix;
+        if (*Labels || !Extra.empty())
+            OS << '{' << Labels << (*Labels && !Extra.empty() ? "," : "") << Extra << '}';
+        OS << ' ' << format("%.15g", Value) << '\n';
+    }
+
+public:
+    Metric(const char *Family, const char *Labels, const char *Help) : Family(Family), Labels(Labels), Help(Help) {
+        (Last ? Last->Next : First) = this;
+        Last = this;
+    }
+    virtual ~Metric() = default;
+    virtual const char *getType() const = 0;
+    virtual void writeSamples(raw_ostream &OS) const = 0;
+
+    /// writeAll - Export every metric, with each family's HELP and TYPE lines ahead of its first series.
+    static void writeAll(raw_ostream &OS) {
+        const char *Family = nullptr;
+        for (const Metric *M = First; M; M = M->Next) {
+            if (!Family || strcmp(Family, M->Family) != 0) {
+                Family = M->Family;
+                OS << "# HELP " << Family << ' ' << M->Help << '\n';
+                OS << "# TYPE " << Family << ' ' << M->getType() << '\n';
+            }
+            M->writeSamples(OS);
+        }
+    }
+};
+Metric *Metric::First = nullptr;
+Metric *Metric::Last = nullptr;
+
+/// Counter - A count that only goes up.
+class Counter : public Metric {
+    atomic<uint64_t> Value{0};
+
+public:
+    using Metric::Metric;
+    void add(uint64_t N = 1) { Value.fetch_add(N, memory_order_relaxed); }
+    uint64_t get() const { return Value.load(memory_order_relaxed); }
+    const char *getType() const override { return "counter"; }
+    void writeSamples(raw_ostream &OS) const override { writeSample(OS, "", "", Value.load(memory_order_relaxed)); }
+};
+
+/// Gauge - A level that goes up and down.
+class Gauge : public Metric {
+    atomic<int64_t> Value{0};
+
+public:
+    using Metric::Metric;
+    void add(int64_t N) { Value.fetch_add(N, memory_order_relaxed); }
+    int64_t get() const { return Value.load(memory_order_relaxed); }
+    const char *getType() const override { return "gauge"; }
+    void writeSamples(raw_ostream &OS) const override { writeSample(OS, "", "", Value.load(memory_order_relaxed)); }
+};
+
+/// SampledGauge - A level read when the metrics are exported, for figures kept outside the library.
+class SampledGauge : public Metric {
+    uint64_t (*Sample)();
+
+public:
+    SampledGauge(const char *Family, const char *Labels, const char *Help, uint64_t (*Sample)())
+        : Metric(Family, Labels, Help), Sample(Sample) {}
+    const char *getType() const override { return "gauge"; }
+    void writeSamples(raw_ostream &OS) const override { writeSample(OS, "", "", Sample()); }
+};
+
+/// LatencyHistogram - Durations, bucketed on a 1-2.5-5 scale from 1us to 1s and exported in seconds.
+class LatencyHistogram : public Metric {
+    static constexpr unsigned NumBounds = 19;
+    static const uint64_t BoundNanos[NumBounds];
+    atomic<uint64_t> Buckets[NumBounds + 1] = {}; // Not cumulative; the last one is +Inf.
+    atomic<uint64_t> SumNanos{0};
+
+public:
+    using Metric::Metric;
+
+    void observe(uint64_t Nanos) {
+        unsigned B = upper_bound(BoundNanos, BoundNanos + NumBounds, Nanos - 1) - BoundNanos;
+        Buckets[B].fetch_add(1, memory_order_relaxed);
+        SumNanos.fetch_add(Nanos, memory_order_relaxed);
+    }
+
+    const char *getType() const override { return "histogram"; }
+    void writeSamples(raw_ostream &OS) const override {
+        uint64_t Cumulative = 0;
+        for (unsigned B = 0; B <= NumBounds; ++B) {
+            Cumulative += Buckets[B].load(memory_order_relaxed);
+            string Le;
+            if (B < NumBounds)
+                raw_string_ostream(Le) << "le=\"" << format("%g", BoundNanos[B] / 1e9) << '"';
+            else
+                Le = "le=\"+Inf\"";
+            writeSample(OS, "_bucket", Le, Cumulative);
+        }
+        writeSample(OS, "_sum", "", SumNanos.load(memory_order_relaxed) / 1e9);
+        writeSample(OS, "_count", "", Cumulative);
+    }
+};
+/// LatencySummary - Percentiles of one kind of recorded latency, in seconds. Quantile 1 is the maximum.
+class LatencySummary : public Metric {
+    LatencyKind Kind;
+
+public:
+    LatencySummary(const char *Family, const char *Labels, const char *Help, LatencyKind Kind)
+        : Metric(Family, Labels, Help), Kind(Kind) {}
+    const char *getType() const override { return "summary"; }
+    void writeSamples(raw_ostream &OS) const override {
+        auto H = MergeLatencies(Kind);
+        writeSample(OS, "", "quantile=\"0.5\"", H->getPercentile(50) / 1e9);
+        writeSample(OS, "", "quantile=\"0.99\"", H->getPercentile(99) / 1e9);
+        writeSample(OS, "", "quantile=\"0.999\"", H->getPercentile(99.9) / 1e9);
+        writeSample(OS, "", "quantile=\"1\"", H->getMax() / 1e9);
+        writeSample(OS, "_sum", "", H->getSum() / 1e9);
+        writeSample(OS, "_count", "", H->getCount());
+    }
+};
+
+/// PhaseEventCounter - Hardware events counted in each phase: one series per phase and event the machine counts.
+class PhaseEventCounter : public Metric {
+    atomic<uint64_t> Counts[NumTimedPhases][NumHardwareEvents] = {};
+
+public:
+    using Metric::Metric;
+    void add(unsigned Phase, unsigned Event, uint64_t N) { Counts[Phase][Event].fetch_add(N, memory_order_relaxed); }
+    const char *getType() const override { return "counter"; }
+    void writeSamples(raw_ostream &OS) const override {
+        for (unsigned P = 0; P < NumTimedPhases; ++P)
+            for (unsigned E = 0; E < NumHardwareEvents; ++E)
+                if (HardwareEventAvailable[E])
+                    writeSample(OS, "", (Twine("phase=\"") + PhaseNames[P] + "\",event=\"" + HardwareEventNames[E] + "\"").str(),
+                                Counts[P][E].load(memory_order_relaxed));
+    }
+};
+
+const uint64_t LatencyHistogram::BoundNanos[NumBounds] = {
+    1000,     2500,     5000,      10000,     25000,     50000,     100000,
+    250000,   500000,   1000000,   2500000,   5000000,   10000000,  25000000,
+    50000000, 100000000, 250000000, 500000000, 1000000000};
+
+static Counter ExprsParsed("calc_expressions_parsed_total", "", "Expressions parsed successfully.");
+static Counter ParseErrors("calc_parse_errors_total", "", "Expressions the parser rejected.");
+static Counter CacheHits("calc_object_cache_hits_total", "", "Modules whose object code came from the object cache.");
+static Counter CacheMisses("calc_object_cache_misses_total", "", "Modules the object cache had no object code for.");
+#define CALC_COMPILES_HELP                                                                                             \
+    "Expressions compiled, by tier: handed out to the interpreter while their code is pending, JIT-compiled to "       \
+    "native code (including from the object cache), optimized, or compiled by a compile server."
+static Counter InterpretedCompiles("calc_compiles_total", "tier=\"interpreter\"", CALC_COMPILES_HELP);
+static Counter NativeCompiles("calc_compiles_total", "tier=\"native\"", CALC_COMPILES_HELP);
+static Counter OptimizedCompiles("calc_compiles_total", "tier=\"optimized\"", CALC_COMPILES_HELP);
+static Counter RemoteCompiles("calc_compiles_total", "tier=\"remote\"", CALC_COMPILES_HELP);
+#undef CALC_COMPILES_HELP
+static Counter IRInstructions("calc_ir_instructions_total", "",
+                              "IR instructions generated, a measure of how much each LLVMContext holds.");
+static Counter ObjectBytes("calc_jit_object_bytes_total", "", "Bytes of object code the JIT has compiled or loaded.");
+static Gauge CodeBytes("calc_jit_code_bytes", "", "Bytes of memory now allocated to JIT-compiled code and data.");
+static Gauge ASTNodes("calc_ast_nodes", "", "Syntax tree nodes now allocated.");
+static Counter ASTNodesParsed("calc_ast_nodes_parsed_total", "", "Syntax tree nodes the parser has built.");
+static Counter ASTBytesParsed("calc_ast_bytes_parsed_total", "", "Bytes of syntax tree nodes the parser has built.");
+static uint64_t SharedStoreBytes();
+static uint64_t HeapBytes();
+static uint64_t ResidentBytes();
+#define CALC_MEMORY_HELP                                                                                               \
+    "Bytes of memory in use, by subsystem: syntax trees, JIT code, read-only and writable JIT data, the in-process "   \
+    "and shared object caches, the malloc heap as a whole, and the resident set."
+static Gauge ASTBytes("calc_memory_bytes", "subsystem=\"ast\"", CALC_MEMORY_HELP);
+static Gauge JITCodeBytes("calc_memory_bytes", "subsystem=\"jit_code\"", CALC_MEMORY_HELP);
+static Gauge JITRODataBytes("calc_memory_bytes", "subsystem=\"jit_rodata\"", CALC_MEMORY_HELP);
+static Gauge JITRWDataBytes("calc_memory_bytes", "subsystem=\"jit_rwdata\"", CALC_MEMORY_HELP);
+static Gauge ObjectCacheBytes("calc_memory_bytes", "subsystem=\"object_cache\"", CALC_MEMORY_HELP);
+static SampledGauge SharedObjectCacheBytes("calc_memory_bytes", "subsystem=\"shared_object_cache\"", CALC_MEMORY_HELP,
+                                           SharedStoreBytes);
+static SampledGauge HeapInUse("calc_memory_bytes", "subsystem=\"heap\"", CALC_MEMORY_HELP, HeapBytes);
+static SampledGauge Resident("calc_memory_bytes", "subsystem=\"rss\"", CALC_MEMORY_HELP, ResidentBytes);
+#undef CALC_MEMORY_HELP
+#define CALC_PHASE_HELP "Duration of each timed phase, including any phases nested in it. Recorded with phase timing on."
+static LatencyHistogram PhaseLatency[] = {
+    {"calc_phase_duration_seconds", "phase=\"input\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"lex\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"parse\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"codegen\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"verify\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"optimize\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"jit-emit\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"jit-link\"", CALC_PHASE_HELP},
+    {"calc_phase_duration_seconds", "phase=\"execute\"", CALC_PHASE_HELP},
+};
+#undef CALC_PHASE_HELP
+static_assert(sizeof(PhaseLatency) / sizeof(PhaseLatency[0]) == NumTimedPhases, "one histogram per phase");
+static PhaseEventCounter PhaseEvents("calc_hardware_events_total", "",
+                                     "Hardware events counted in each phase, in user space. Recorded with hardware "
+                                     "counters on.");
+static Counter ExecutedRows("calc_executed_rows_total", "",
+                            "Rows evaluated in the execute phase: one per expression or call, or one per row of a "
+                            "batch kernel call.");
+#define CALC_LATENCY_HELP                                                                                              \
+    "Latency of requests end to end, and of each evaluation by tier: the interpreter, compiled code, and batch "       \
+    "kernels. Recorded with latency statistics on."
+static LatencySummary Latencies[] = {
+    {"calc_latency_seconds", "kind=\"request\"", CALC_LATENCY_HELP, LatencyRequest},
+    {"calc_latency_seconds", "kind=\"interpreter\"", CALC_LATENCY_HELP, LatencyInterpreter},
+    {"calc_latency_seconds", "kind=\"native\"", CALC_LATENCY_HELP, LatencyNative},
+    {"calc_latency_seconds", "kind=\"batch\"", CALC_LATENCY_HELP, LatencyBatch},
+};
+#undef CALC_LATENCY_HELP
+static_assert(sizeof(Latencies) / sizeof(Latencies[0]) == NumLatencyKinds, "one summary per kind");
+
+void WriteMetrics(raw_ostream &OS) {
+    Metric::writeAll(OS);
+}
+
+// Memory Accounting
+
+thread_local ExprMemory LastExprMemory;
+bool MeasureModuleHeap = false;
+
+/// ModuleHeapBase - Heap in use when the calling thread's current context was created.
+static thread_local uint64_t ModuleHeapBase = 0;
+static atomic<uint64_t> ModulesMeasured{0};
+static atomic<int64_t> ModuleHeapTotal{0}, ModuleHeapPeak{0};
+
+/// OpenStoreList - The shared object stores this process has mapped.
+struct OpenStoreList {
+    mutex Lock;
+    vector<const SharedObjectStore *> Stores;
+};
+
+/// OpenStores - The process's list, which is never destroyed: stores owned by other files' statics unregister themselves during exit, in no particular order relative to this file's statics.
+static OpenStoreList &OpenStores() {
+    static auto &List = *new OpenStoreList;
+    return List;
+}
+
+static uint64_t SharedStoreBytes() {
+    OpenStoreList &Open = OpenStores();
+    lock_guard<mutex> Lock(Open.Lock);
+    uint64_t Bytes = 0;
+    for (const SharedObjectStore *Store : Open.Stores)
+        Bytes += Store->getArenaUsed();
+    return Bytes;
+}
+
+static uint64_t HeapBytes() {
+    struct mallinfo2 MI = mallinfo2();
+    return MI.uordblks + MI.hblkhd;
+}
+
+static uint64_t ResidentBytes() {
+    unsigned long long Size = 0, Pages = 0;
+    if (FILE *F = fopen("/proc/self/statm", "r")) {
+        if (fscanf(F, "%llu %llu", &Size, &Pages) != 2)
+            Pages = 0;
+        fclose(F);
+    }
+    return Pages * sysconf(_SC_PAGESIZE);
+}
+
+MemoryUsage GetMemoryUsage() {
+    MemoryUsage U;
+    U.ASTNodes = ASTNodes.get();
+    U.ASTBytes = ASTBytes.get();
+    U.JITCode = JITCodeBytes.get();
+    U.JITROData = JITRODataBytes.get();
+    U.JITRWData = JITRWDataBytes.get();
+    U.ObjectCache = ObjectCacheBytes.get();
+    U.SharedObjectCache = SharedStoreBytes();
+    U.Heap = HeapBytes();
+    U.Resident = ResidentBytes();
+    U.ASTNodesParsed = ASTNodesParsed.get();
+    U.ASTBytesParsed = ASTBytesParsed.get();
+    U.IRInstructions = IRInstructions.get();
+    U.ModulesMeasured = ModulesMeasured.load(memory_order_relaxed);
+    U.ModuleHeapTotal = ModuleHeapTotal.load(memory_order_relaxed);
+    U.ModuleHeapPeak = ModuleHeapPeak.load(memory_order_relaxed);
+    return U;
+}
+
+// Latency Recording
+
+const char *const LatencyNames[NumLatencyKinds] = {"request", "interpreter", "native", "batch"};
+atomic<bool> RecordLatencies{false};
+
+unsigned HdrHistogram::bucketOf(uint64_t Value) {
+    const unsigned Linear = 1u << SubBucketBits, Half = Linear / 2;
+    if (Value < Linear)
+        return Value;
+    unsigned Msb = 63 - countLeadingZeros(Value);
+    if (Msb >= MaxValueBits)
+        return NumBuckets - 1;
+    // The top SubBucketBits - 1 bits below the leading one pick the sub-bucket within the value's power of two.
+    unsigned Shift = Msb - (SubBucketBits - 1);
+    return Linear + (Msb - SubBucketBits) * Half + unsigned(Value >> Shift) - Half;
+}
+
+uint64_t HdrHistogram::highestIn(unsigned Bucket) {
+    const unsigned Linear = 1u << SubBucketBits, Half = Linear / 2;
+    if (Bucket < Linear)
+        return Bucket;
+    unsigned Msb = (Bucket - Linear) / Half + SubBucketBits;
+    uint64_t Sub = Half + (Bucket - Linear) % Half;
+    unsigned Shift = Msb - (SubBucketBits - 1);
+    return ((Sub + 1) << Shift) - 1;
+}
+
+void HdrHistogram::record(uint64_t Value) {
+    // The owner is the only writer, so plain loads and stores suffice; they are atomic only so that readers may look at any time.
+    atomic<uint64_t> &Count = Counts[bucketOf(Value)];
+    Count.store(Count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    Total.store(Total.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    Sum.store(Sum.load(memory_order_relaxed) + Value, memory_order_relaxed);
+    if (Value > Max.load(memory_order_relaxed))
+        Max.store(Value, memory_order_relaxed);
+}
+
+void HdrHistogram::merge(const HdrHistogram &Other) {
+    uint64_t Merged = 0;
+    for (unsigned B = 0; B < NumBuckets; ++B) {
+        uint64_t N = Other.Counts[B].load(memory_order_relaxed);
+        Merged += N;
+        Counts[B].store(Counts[B].load(memory_order_relaxed) + N, memory_order_relaxed);
+    }
+    // Summing the buckets keeps the total consistent with them while Other is being recorded into.
+    Total.store(Total.load(memory_order_relaxed) + Merged, memory_order_relaxed);
+    Sum.store(Sum.load(memory_order_relaxed) + Other.Sum.load(memory_order_relaxed), memory_order_relaxed);
+    Max.store(max(Max.load(memory_order_relaxed), Other.Max.load(memory_order_relaxed)), memory_order_relaxed);
+}
+
+uint64_t HdrHistogram::getPercentile(double P) const {
+    uint64_t Count = getCount();
+    if (!Count)
+        return 0;
+    uint64_t Rank = max<uint64_t>(1, uint64_t(ceil(P / 100 * Count)));
+    uint64_t Seen = 0;
+    for (unsigned B = 0; B < NumBuckets; ++B) {
+        Seen += Counts[B].load(memory_order_relaxed);
+        if (Seen >= Rank)
+            return min(highestIn(B), getMax());
+    }
+    return getMax();
+}
+
+/// ThreadLatencies - One thread's histograms. A thread registers its own on first use, and on exit folds them into RetiredLatencies.
+struct ThreadLatencies {
+    HdrHistogram Hist[NumLatencyKinds];
+};
+static mutex LatenciesLock;
+static vector<ThreadLatencies *> LiveLatencies;
+static ThreadLatencies *RetiredLatencies = nullptr;
+
+struct LatencyRegistration {
+    ThreadLatencies *Mine = nullptr;
+
+    ~LatencyRegistration() {
+        if (!Mine)
+            return;
+        lock_guard<mutex> Lock(LatenciesLock);
+        if (!RetiredLatencies)
+            RetiredLatencies = new ThreadLatencies;
+        for (unsigned K = 0; K < NumLatencyKinds; ++K)
+            RetiredLatencies->Hist[K].merge(Mine->Hist[K]);
+        LiveLatencies.erase(find(LiveLatencies.begin(), LiveLatencies.end(), Mine));
+        delete Mine;
+    }
+};
+static thread_local LatencyRegistration ThreadLatency;
+
+void RecordLatency(LatencyKind Kind, uint64_t Nanos) {
+    ThreadLatencies *Mine = ThreadLatency.Mine;
+    if (!Mine) {
+        Mine = ThreadLatency.Mine = new ThreadLatencies;
+        lock_guard<mutex> Lock(LatenciesLock);
+        LiveLatencies.push_back(Mine);
+    }
+    Mine->Hist[Kind].record(Nanos);
+}
+
+unique_ptr<HdrHistogram> MergeLatencies(LatencyKind Kind) {
+    auto Merged = make_unique<HdrHistogram>();
+    lock_guard<mutex> Lock(LatenciesLock);
+    if (RetiredLatencies)
+        Merged->merge(RetiredLatencies->Hist[Kind]);
+    for (const ThreadLatencies *L : LiveLatencies)
+        Merged->merge(L->Hist[Kind]);
+    return Merged;
+}
+
+void WriteLatencyStats(raw_ostream &OS) {
+    OS << "  Latency (us)         Count        p50        p99      p99.9        Max\n";
+    for (unsigned K = 0; K < NumLatencyKinds; ++K) {
+        auto H = MergeLatencies(LatencyKind(K));
+        OS << format("  %-12s %13" PRIu64 " %10.2f %10.2f %10.2f %10.2f\n", LatencyNames[K], H->getCount(),
+                     H->getPercentile(50) / 1e3, H->getPercentile(99) / 1e3, H->getPercentile(99.9) / 1e3,
+                     H->getMax() / 1e3);
+    }
+}
+
+// Trace Events
+// Each thread formats its events into a buffer of its own, and appends the buffer to the file once it holds 64KiB and when the thread exits. A flusher thread appends every buffer every 100ms, so that idle threads' events get out too. Lock order: LiveTracesLock, then a thread's lock, then TraceFileLock.
+
+atomic<bool> TraceEvents{false};
+thread_local uint64_t TraceExpr = 0;
+static int TraceFD = -1;
+static int TracePid;
+static uint64_t TraceBase; // LatencyClock() when tracing started; events are timed from it.
+static mutex TraceFileLock;
+static atomic<unsigned> NextTraceTid{1};
+static const size_t TraceFlushBytes = 64 << 10;
+
+/// WriteTraceFile - Append all of Buf to the trace file, retrying short writes. The caller holds TraceFileLock.
+static bool WriteTraceFile(const char *Buf, size_t Size) {
+    while (Size) {
+        ssize_t N = write(TraceFD, Buf, Size);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Buf += N;
+        Size -= N;
+    }
+    return true;
+}
+
+/// ThreadTrace - One thread's buffered events, each followed by ",\n". Its thread appends under Lock, which FinishTracing takes too.
+struct ThreadTrace {
+    mutex Lock;
+    string Buffer;
+    unsigned Tid = NextTraceTid++;
+
+    /// flush - Append the buffered events to the file. The caller holds Lock.
+    void flush() {
+        lock_guard<mutex> Guard(TraceFileLock);
+        if (TraceFD >= 0 && !Buffer.empty() && !WriteTraceFile(Buffer.data(), Buffer.size()))
+            fprintf(stderr, "Error: cannot write trace events: %s\n", strerror(errno));
+        Buffer.clear();
+    }
+};
+static mutex LiveTracesLock;
+static vector<ThreadTrace *> LiveTraces;
+
+struct TraceRegistration {
+    ThreadTrace *Mine = nullptr;
+
+    ~TraceRegistration() {
+        if (!Mine)
+            return;
+        lock_guard<mutex> Lock(LiveTracesLock);
+        {
+            lock_guard<mutex> Guard(Mine->Lock);
+            Mine->flush();
+        }
+        LiveTraces.erase(find(LiveTraces.begin(), LiveTraces.end(), Mine));
+        delete Mine;
+    }
+};
+static thread_local TraceRegistration ThreadTraceRegistration;
+
+static ThreadTrace &GetThreadTrace() {
+    ThreadTrace *Mine = ThreadTraceRegistration.Mine;
+    if (!Mine) {
+        Mine = ThreadTraceRegistration.Mine = new ThreadTrace;
+        lock_guard<mutex> Lock(LiveTracesLock);
+        LiveTraces.push_back(Mine);
+    }
+    return *Mine;
+}
+
+/// AppendTraceEvent - Add one formatted event to the calling thread's buffer.
+static void AppendTraceEvent(ThreadTrace &T, const char *Event) {
+    lock_guard<mutex> Guard(T.Lock);
+    T.Buffer += Event;
+    if (T.Buffer.size() >= TraceFlushBytes)
+        T.flush();
+}
+
+/// FlushTraces - Append every thread's buffered events to the file. Stops once tracing finishes.
+static void FlushTraces() {
+    while (true) {
+        std::this_thread::sleep_for(chrono::milliseconds(100));
+        lock_guard<mutex> Lock(LiveTracesLock);
+        if (TraceFD < 0)
+            return;
+        for (ThreadTrace *T : LiveTraces) {
+            lock_guard<mutex> Guard(T->Lock);
+            T->flush();
+        }
+    }
+}
+
+/// TraceMicros - A LatencyClock() time as a trace timestamp: microseconds since tracing started.
+static double TraceMicros(uint64_t Nanos) {
+    return Nanos > TraceBase ? (Nanos - TraceBase) / 1e3 : 0;
+}
+
+bool StartTracing(const string &Path) {
+    TraceFD = ::open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (TraceFD < 0 || !WriteTraceFile("[\n", 2)) {
+        fprintf(stderr, "Error: cannot create trace file '%s': %s\n", Path.c_str(), strerror(errno));
+        return false;
+    }
+    TracePid = getpid();
+    TraceBase = LatencyClock();
+    TraceEvents.store(true, memory_order_relaxed);
+    TimePhases.store(true, memory_order_relaxed);
+    std::thread(FlushTraces).detach();
+    return true;
+}
+
+void FinishTracing() {
+    if (TraceFD < 0)
+        return;
+    TraceEvents.store(false, memory_order_relaxed);
+    lock_guard<mutex> Lock(LiveTracesLock);
+    for (ThreadTrace *T : LiveTraces) {
+        lock_guard<mutex> Guard(T->Lock);
+        T->flush();
+    }
+    // The last event carries no trailing comma, and closes the array.
+    char Last[128];
+    int N = snprintf(Last, sizeof(Last), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"calculator\"}}]\n",
+                     TracePid);
+    lock_guard<mutex> Guard(TraceFileLock);
+    WriteTraceFile(Last, N);
+    close(TraceFD);
+    TraceFD = -1;
+}
+
+void SetTraceThreadName(const char *Name) {
+    if (!TraceEvents.load(memory_order_relaxed))
+        return;
+    ThreadTrace &T = GetThreadTrace();
+    char Event[192];
+    snprintf(Event, sizeof(Event), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}},\n",
+             TracePid, T.Tid, Name);
+    AppendTraceEvent(T, Event);
+}
+
+void RecordTraceSpan(const char *Name, const char *Category, uint64_t Start, uint64_t Nanos, const char *ArgName,
+                     uint64_t Arg) {
+    ThreadTrace &T = GetThreadTrace();
+    char Args[96] = "";
+    int N = 0;
+    if (TraceExpr)
+        N = snprintf(Args, sizeof(Args), "\"expr\":%" PRIu64, TraceExpr);
+    if (ArgName)
+        snprintf(Args + N, sizeof(Args) - N, "%s\"%s\":%" PRIu64, N ? "," : "", ArgName, Arg);
+    char Event[320];
+    snprintf(Event, sizeof(Event),
+             "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{%s}},\n", Name,
+             Category, TraceMicros(Start), Nanos / 1e3, TracePid, T.Tid, Args);
+    AppendTraceEvent(T, Event);
+}
+
+void RecordTraceCounter(const char *Name, int64_t Value) {
+    ThreadTrace &T = GetThreadTrace();
+    uint64_t Now = LatencyClock();
+    char Event[192];
+    snprintf(Event, sizeof(Event), "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,\"args\":{\"value\":%" PRId64 "}},\n",
+             Name, TraceMicros(Now), TracePid, Value);
+    AppendTraceEvent(T, Event);
+}
+
+// Phase Timing
+
+const char *const PhaseNames[NumTimedPhases] = {"input", "lex",  "parse", "codegen", "verify",
+                                                "optimize", "jit-emit", "jit-link", "execute"};
+atomic<bool> TimePhases{false};
+thread_local PhaseTimes ThreadPhaseTimes;
+static thread_local int CurrentPhase = -1; // The innermost running timer's phase, or -1.
+static thread_local uint64_t PhaseStart;   // When CurrentPhase last started or resumed.
+
+static uint64_t PhaseClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Hardware counters are read at every phase change, as times are: one read() of the thread's counter group, a system call costing around a microsecond.
+
+const char *const HardwareEventNames[NumHardwareEvents] = {"cycles", "instructions", "cache-misses", "branch-misses",
+                                                           "itlb-misses"};
+bool CountHardwareEvents = false;
+bool HardwareEventAvailable[NumHardwareEvents];
+static thread_local uint64_t PhaseEventsStart[NumHardwareEvents]; // The counters when CurrentPhase last started or resumed.
+
+/// HardwareCounters - One thread's counters, opened as a single group led by the cycle counter so that they count over exactly the same intervals.
+class HardwareCounters {
+    int Fds[NumHardwareEvents];
+    unsigned Slot[NumHardwareEvents]; // Each open counter's position in the group's read format.
+    unsigned NumOpen = 0;
+    int Error = 0; // errno from opening the cycle counter, if it failed.
+
+    static int open(uint32_t Type, uint64_t Config, int Group) {
+        perf_event_attr Attr;
+        memset(&Attr, 0, sizeof(Attr));
+        Attr.size = sizeof(Attr);
+        Attr.type = Type;
+        Attr.config = Config;
+        Attr.exclude_kernel = 1;
+        Attr.exclude_hv = 1;
+        Attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return syscall(SYS_perf_event_open, &Attr, 0, -1, Group, PERF_FLAG_FD_CLOEXEC);
+    }
+
+public:
+    HardwareCounters() {
+        static const uint32_t Types[NumHardwareEvents] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                          PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+        static const uint64_t Configs[NumHardwareEvents] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_HW_CACHE_ITLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16};
+        for (unsigned E = 0; E < NumHardwareEvents; ++E) {
+            if (E == EventCycles)
+                Fds[E] = open(Types[E], Configs[E], -1);
+            else
+                Fds[E] = Fds[EventCycles] >= 0 ? open(Types[E], Configs[E], Fds[EventCycles]) : -1;
+            if (Fds[E] >= 0)
+                Slot[E] = NumOpen++;
+            else if (E == EventCycles)
+                Error = errno;
+        }
+    }
+    ~HardwareCounters() {
+        for (int FD : Fds)
+            if (FD >= 0)
+                close(FD);
+    }
+    HardwareCounters(const HardwareCounters &) = delete;
+    HardwareCounters &operator=(const HardwareCounters &) = delete;
+
+    bool isOpen(HardwareEvent E) const { return Fds[E] >= 0; }
+    int getError() const { return Error; }
+
+    /// read - The counts so far, zero for events not counted. Counts are scaled up for any time the kernel had the group switched out to share the counters with other users.
+    void read(uint64_t Counts[NumHardwareEvents]) const {
+        uint64_t Buf[3 + NumHardwareEvents]; // nr, time_enabled, time_running, then one value per open counter
+        if (!NumOpen || ::read(Fds[EventCycles], Buf, sizeof(Buf)) < ssize_t(3 + NumOpen) * 8) {
+            fill_n(Counts, NumHardwareEvents, 0);
+            return;
+        }
+        double Scale = Buf[2] && Buf[2] < Buf[1] ? double(Buf[1]) / Buf[2] : 1;
+        for (unsigned E = 0; E < NumHardwareEvents; ++E)
+            Counts[E] = Fds[E] >= 0 ? uint64_t(Buf[3 + Slot[E]] * Scale) : 0;
+    }
+};
+
+/// ThreadHardwareCounters - The calling thread's counters, opened on first use.
+static const HardwareCounters &ThreadHardwareCounters() {
+    static thread_local HardwareCounters Counters;
+    return Counters;
+}
+
+bool EnableHardwareCounters() {
+    // Probe on a group of our own: the thread's group is opened on its first phase change, like every other thread's.
+    HardwareCounters Probe;
+    if (!Probe.isOpen(EventCycles)) {
+        int Err = Probe.getError();
+        fprintf(stderr, "Error: cannot open hardware performance counters: %s%s\n", strerror(Err),
+                Err == EACCES || Err == EPERM ? " (lower /proc/sys/kernel/perf_event_paranoid to 2 or below)" : "");
+        return false;
+    }
+    for (unsigned E = 0; E < NumHardwareEvents; ++E)
+        HardwareEventAvailable[E] = Probe.isOpen(HardwareEvent(E));
+    CountHardwareEvents = true;
+    TimePhases.store(true, memory_order_relaxed);
+    return true;
+}
+
+void NoteExecutedRows(uint64_t N) {
+    ExecutedRows.add(N);
+}
+
+/// ChargeHardwareEvents - Charge the events since the last phase change to CurrentPhase, if any.
+static void ChargeHardwareEvents() {
+    uint64_t Now[NumHardwareEvents];
+    ThreadHardwareCounters().read(Now);
+    if (CurrentPhase >= 0) {
+        for (unsigned E = 0; E < NumHardwareEvents; ++E) {
+            // Scaling can make a count dip while the group is switched out; charge nothing rather than wrap.
+            uint64_t N = Now[E] > PhaseEventsStart[E] ? Now[E] - PhaseEventsStart[E] : 0;
+            ThreadPhaseTimes.Events[CurrentPhase][E] += N;
+            PhaseEvents.add(CurrentPhase, E, N);
+        }
+    }
+    copy(Now, Now + NumHardwareEvents, PhaseEventsStart);
+}
+
+void PhaseTimer::enter(TimedPhase Phase) {
+    uint64_t Now = PhaseClock();
+    if (CurrentPhase >= 0)
+        ThreadPhaseTimes.Nanos[CurrentPhase] += Now - PhaseStart;
+    if (CountHardwareEvents)
+        ChargeHardwareEvents();
+    Active = true;
+    Outer = CurrentPhase;
+    Start = Now;
+    CurrentPhase = Phase;
+    PhaseStart = Now;
+}
+
+void PhaseTimer::leave() {
+    uint64_t Now = PhaseClock();
+    ThreadPhaseTimes.Nanos[CurrentPhase] += Now - PhaseStart;
+    if (CountHardwareEvents)
+        ChargeHardwareEvents();
+    PhaseLatency[CurrentPhase].observe(Now - Start);
+    if (TraceEvents.load(memory_order_relaxed))
+        RecordTraceSpan(PhaseNames[CurrentPhase], "phase", Start, Now - Start);
+    CurrentPhase = Outer;
+    PhaseStart = Now;
+}
+
+// Lexer
+
+thread_local string IdentifierStr;
+thread_local double NumVal;
+thread_local bool CollectErrors = false;
+thread_local string PendingError;
+
+void ReportError(const char *Str) {
+    if (!CollectErrors)
+        fprintf(stderr, "Error: %s\n", Str);
+    else if (PendingError.empty())
+        PendingError = Str;
+}
+
+/// LexFromBuffer/LexBuffer/LexBufferEnd - When LexFromBuffer is set, the lexer reads from an in-memory buffer instead of standard input.
+static thread_local bool LexFromBuffer = false;
+static thread_local const char *LexBuffer;
+static thread_local const char *LexBufferEnd;
+static thread_local int LastChar = ' ';
+
+/// readChar - Fetch the next character of lexer input.
+static int readChar() {
+    if (!LexFromBuffer) {
+        // Kept out of the lexer's time, which would otherwise include waiting at the prompt.
+        PhaseTimer Timer(PhaseInput);
+        return getchar();
+    }
+    return LexBuffer == LexBufferEnd ? EOF : (unsigned char)*LexBuffer++;
+}
+
+void SetLexBuffer(StringRef Src) {
+    LexFromBuffer = true;
+    LexBuffer = Src.begin();
+    LexBufferEnd = Src.end();
+    LastChar = ' ';
+}
+
+/// lexToken - gettok, untimed.
+static int lexToken() {
+    // Ignore whitespace characters.
+    while (isspace(LastChar))
+        LastChar = readChar();
+
+    if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+        IdentifierStr = LastChar;
+        while (isalnum((LastChar = readChar())))
+            IdentifierStr += LastChar;
+        return tok_identifier;
+    }
+
+    if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
+        string NumStr;
+        do {
+            NumStr += LastChar;
+            LastChar = readChar();
+        } while (isdigit(LastChar) || LastChar == '.');
+        NumVal = strtod(NumStr.c_str(), nullptr);
+        return tok_number;
+    }
+
+    // Check if the end of the file has been reached. Do not consume the EOF character.
+    if (LastChar == EOF)
+        return tok_eof;
+
+    // Otherwise, return the character's ASCII value.
+    int ThisChar = LastChar;
+    LastChar = readChar();
+    return ThisChar;
+}
+
+int gettok() {
+    PhaseTimer Timer(PhaseLex);
+    return lexToken();
+}
+
+// Syntax Tree
+
+/// ThreadASTNodes/ThreadASTBytes - Nodes the calling thread has built, for measuring one expression's tree.
+static thread_local uint64_t ThreadASTNodes = 0, ThreadASTBytes = 0;
+
+/// ASTNodeSize - The size of a node of the given kind, which its base class cannot take with sizeof.
+static size_t ASTNodeSize(ExprAST::ExprKind Kind) {
+    switch (Kind) {
+    case ExprAST::EK_Number:
+        return sizeof(NumberExprAST);
+    case ExprAST::EK_Variable:
+        return sizeof(VariableExprAST);
+    case ExprAST::EK_Binary:
+        return sizeof(BinaryExprAST);
+    }
+    return 0;
+}
+
+ExprAST::ExprAST(ExprKind Kind) : Kind(Kind) {
+    size_t Size = ASTNodeSize(Kind);
+    ++ThreadASTNodes;
+    ThreadASTBytes += Size;
+    ASTNodes.add(1);
+    ASTBytes.add(Size);
+}
+
+ExprAST::~ExprAST() {
+    ASTNodes.add(-1);
+    ASTBytes.add(-int64_t(ASTNodeSize(Kind)));
+}
+
+/// NoteParsedExpr - Record the tree the calling thread has built since it had built Nodes nodes of Bytes bytes as the last expression's.
+static void NoteParsedExpr(uint64_t Nodes, uint64_t Bytes) {
+    LastExprMemory = ExprMemory();
+    LastExprMemory.ASTNodes = ThreadASTNodes - Nodes;
+    LastExprMemory.ASTBytes = ThreadASTBytes - Bytes;
+    ASTNodesParsed.add(LastExprMemory.ASTNodes);
+    ASTBytesParsed.add(LastExprMemory.ASTBytes);
+}
+
+// Parser
+
+thread_local int CurTok;
+int getNextToken() {
+    return CurTok = gettok();
+}
+
+map<int, int> BinopPrecedence;
+
+/// GetTokPrecedence - Retrieves the precedence of the current binary operator token.
+static int GetTokPrecedence() {
+    if (!isascii(CurTok))
+        return -1;
+
+    // Ensure it's a declared binary operator. Lookups must not insert, as parsers on other threads share the table.
+    auto It = BinopPrecedence.find(CurTok);
+    if (It == BinopPrecedence.end() || It->second <= 0)
+        return -1;
+    return It->second;
+}
+
+/// LogError* - Helper functions for handling errors.
+unique_ptr<ExprAST> LogError(const char *Str) {
+    ReportError(Str);
+    return nullptr;
+}
+unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+/// ExprParams - While parsing a parameterized expression, collects its variables in order of first appearance. Null while parsing ordinary top-level expressions, which may only contain literals.
+static thread_local vector<string> *ExprParams = nullptr;
+
+/// identifierexpr ::= identifier
+static unique_ptr<ExprAST> ParseIdentifierExpr() {
+    string IdName = IdentifierStr;
+    getNextToken(); // consume the identifier
+    if (!ExprParams)
+        return LogError("Only numeric literals and operators are permitted.");
+
+    auto It = find(ExprParams->begin(), ExprParams->end(), IdName);
+    unsigned Index = It - ExprParams->begin();
+    if (It == ExprParams->end())
+        ExprParams->push_back(IdName);
+    return make_unique<VariableExprAST>(IdName, Index);
+}
+
+/// numberexpr ::= number
+static unique_ptr<ExprAST> ParseNumberExpr() {
+    auto Result = make_unique<NumberExprAST>(NumVal);
+    getNextToken(); // move past the number
+    return Result;
+}
+
+/// ParenDepth - How many parentheses enclose the token being parsed.
+static thread_local unsigned ParenDepth = 0;
+
+/// parenexpr ::= '(' expression ')'
+static unique_ptr<ExprAST> ParseParenExpr() {
+    if (ParenDepth >= MaxParenDepth) {
+        // Recovering a token at a time would report an error for every parenthesis still open; drop the rest of the expression instead.
+        while (CurTok != ';' && CurTok != tok_eof)
+            getNextToken();
+        return LogError("parentheses nested too deeply");
+    }
+    getNextToken(); // consume '('
+    ++ParenDepth;
+    auto V = ParseExpression();
+    --ParenDepth;
+    if (!V)
+        return nullptr;
+
+    if (CurTok != ')')
+        return LogError("expected ')'");
+    getNextToken(); // consume ')'
+    return V;
+}
+
+/// primary
+/// ::= identifierexpr
+/// ::= numberexpr
+/// ::= parenexpr
+static unique_ptr<ExprAST> ParsePrimary() {
+    switch (CurTok) {
+    default:
+        return LogError("unexpected token when expecting an expression");
+    case tok_identifier:
+        return ParseIdentifierExpr();
+    case tok_number:
+        return ParseNumberExpr();
+    case '(':
+        return ParseParenExpr();
+    }
+}
+
+/// binoprhs
+/// ::= ('+' primary)*
+static unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, unique_ptr<ExprAST> LHS) {
+    // If this is a binary operator, find its precedence.
+    while (true) {
+        int TokPrec = GetTokPrecedence();
+
+        // If this operator binds less tightly than the current one, we're done.
+        if (TokPrec < ExprPrec)
+            return LHS;
+
+        int BinOp = CurTok;
+        getNextToken(); // consume the operator
+
+        // Parse the primary expression following the binary operator.
+        auto RHS = ParsePrimary();
+        if (!RHS)
+            return nullptr;
+
+        // If the current operator binds less tightly with RHS than the operator after RHS, let the pending operator take RHS as its LHS.
+        int NextPrec = GetTokPrecedence();
+        if (TokPrec < NextPrec) {
+            RHS = ParseBinOpRHS(TokPrec + 1, move(RHS));
+            if (!RHS)
+                return nullptr;
+        }
+
+        // Combine LHS and RHS.
+        LHS = make_unique<BinaryExprAST>(BinOp, move(LHS), move(RHS));
+    }
+}
+
+/// expression
+/// ::= primary binoprhs
+unique_ptr<ExprAST> ParseExpression() {
+    auto LHS = ParsePrimary();
+    if (!LHS)
+        return nullptr;
+
+    return ParseBinOpRHS(0, move(LHS));
+}
+
+unique_ptr<FunctionAST> ParseTopLevelExpr() {
+    PhaseTimer Timer(PhaseParse);
+    uint64_t Nodes = ThreadASTNodes, Bytes = ThreadASTBytes;
+    auto E = ParseExpression();
+    NoteParsedExpr(Nodes, Bytes);
+    if (E) {
+        // Create an anonymous prototype to hold our binary expressions.
+        auto Proto = make_unique<PrototypeAST>("__anon_expr", vector<string>());
+        ExprsParsed.add();
+        return make_unique<FunctionAST>(move(Proto), move(E));
+    }
+    ParseErrors.add();
+    return nullptr;
+}
+
+unique_ptr<ExprAST> ParseSource(StringRef Src, vector<string> *Params) {
+    PhaseTimer Timer(PhaseParse);
+    SetLexBuffer(Src);
+    getNextToken();
+    uint64_t Nodes = ThreadASTNodes, Bytes = ThreadASTBytes;
+    ExprParams = Params;
+    auto E = ParseExpression();
+    ExprParams = nullptr;
+    NoteParsedExpr(Nodes, Bytes);
+    if (E && CurTok == ';')
+        getNextToken();
+    if (E && CurTok != tok_eof)
+        E = LogError("unexpected input after expression");
+    (E ? ExprsParsed : ParseErrors).add();
+    return E;
+}
+
+unique_ptr<ExprAST> ParseParameterizedExpr(vector<string> &Params) {
+    PhaseTimer Timer(PhaseParse);
+    uint64_t Nodes = ThreadASTNodes, Bytes = ThreadASTBytes;
+    ExprParams = &Params;
+    auto E = ParseExpression();
+    ExprParams = nullptr;
+    NoteParsedExpr(Nodes, Bytes);
+    (E ? ExprsParsed : ParseErrors).add();
+    return E;
+}
+
+/// DeserializeRightOperand - DeserializeExpr for an operand nested Depth right operands deep, which malformed input must not be able to make deeper than any parsed expression.
+static unique_ptr<ExprAST> DeserializeRightOperand(StringRef &In, unsigned Depth) {
+    if (Depth > 4 * MaxParenDepth)
+        return nullptr;
+
+    // Binary nodes are written prefix, outermost first, so a left-deep chain begins with a run of 'b' headers. Read the run, then the leftmost operand, then the right operands from the innermost node out.
+    SmallVector<char, 8> Ops;
+    while (In.size() >= 2 && In.front() == 'b') {
+        Ops.push_back(In[1]);
+        In = In.drop_front(2);
+    }
+
+    unique_ptr<ExprAST> E;
+    if (In.empty())
+        return nullptr;
+    char Kind = In.front();
+    In = In.drop_front();
+    switch (Kind) {
+    case 'n': {
+        double Val;
+        if (In.size() < sizeof(Val))
+            return nullptr;
+        memcpy(&Val, In.data(), sizeof(Val));
+        In = In.drop_front(sizeof(Val));
+        E = make_unique<NumberExprAST>(Val);
+        break;
+    }
+    case 'v': {
+        size_t End = In.find('\0');
+        if (End == StringRef::npos)
+            return nullptr;
+        E = make_unique<VariableExprAST>(In.take_front(End).str());
+        In = In.drop_front(End + 1);
+        break;
+    }
+    default:
+        return nullptr;
+    }
+
+    for (char Op : llvm::reverse(Ops)) {
+        auto RHS = DeserializeRightOperand(In, Depth + 1);
+        if (!RHS)
+            return nullptr;
+        E = make_unique<BinaryExprAST>(Op, move(E), move(RHS));
+    }
+    return E;
+}
+
+unique_ptr<ExprAST> DeserializeExpr(StringRef &In) {
+    return DeserializeRightOperand(In, 0);
+}
+
+// Code Generation
+
+thread_local unique_ptr<LLVMContext> TheContext;
+thread_local unique_ptr<Module> TheModule;
+thread_local unique_ptr<IRBuilder<>> Builder;
+static thread_local map<string, Value *> NamedValues;
+thread_local orc::LLJIT *TheJIT;
+/// PerfLabels - Whether modules are named after their expression; set by EnablePerfSupport.
+static bool PerfLabels = false;
+ExitOnError ExitOnErr;
+
+Value *LogErrorV(const char *Str) {
+    LogError(Str);
+    return nullptr;
+}
+
+Value *NumberExprAST::codegen() {
+    // All types will be of type double.
+    return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+void NumberExprAST::print(raw_ostream &OS) const {
+    OS << format("%g", Val);
+}
+
+Value *VariableExprAST::codegen() {
+    // Look this variable up in the function.
+    auto It = NamedValues.find(Name);
+    if (It == NamedValues.end())
+        return LogErrorV("Unknown variable name");
+    return It->second;
+}
+
+ExprAST *BinaryExprAST::leftSpine(SmallVectorImpl<const BinaryExprAST *> &Spine) const {
+    const BinaryExprAST *B = this;
+    Spine.push_back(B);
+    while (auto *L = dyn_cast<BinaryExprAST>(B->LHS.get())) {
+        Spine.push_back(L);
+        B = L;
+    }
+    return B->LHS.get();
+}
+
+BinaryExprAST::~BinaryExprAST() {
+    // Free the left spine one node at a time. Each node's LHS is detached before the node is destroyed, so its own destructor finds nothing left to walk.
+    unique_ptr<ExprAST> Next = move(LHS);
+    while (auto *B = dyn_cast_or_null<BinaryExprAST>(Next.get())) {
+        unique_ptr<ExprAST> L = move(B->LHS);
+        Next = move(L);
+    }
+}
+
+void BinaryExprAST::serialize(string &Out) const {
+    SmallVector<const BinaryExprAST *, 8> Spine;
+    const ExprAST *Leftmost = leftSpine(Spine);
+    for (const BinaryExprAST *B : Spine) {
+        Out += 'b';
+        Out += B->Op;
+    }
+    Leftmost->serialize(Out);
+    for (const BinaryExprAST *B : llvm::reverse(Spine))
+        B->RHS->serialize(Out);
+}
+
+void BinaryExprAST::print(raw_ostream &OS) const {
+    SmallVector<const BinaryExprAST *, 8> Spine;
+    const ExprAST *Leftmost = leftSpine(Spine);
+    OS << string(Spine.size(), '(');
+    Leftmost->print(OS);
+    for (const BinaryExprAST *B : llvm::reverse(Spine)) {
+        OS << ' ' << B->Op << ' ';
+        B->RHS->print(OS);
+        OS << ')';
+    }
+}
+
+/// EmitBinaryOp - The instructions for L Op R.
+static Value *EmitBinaryOp(char Op, Value *L, Value *R) {
+    switch (Op) {
+    case '+':
+        return Builder->CreateFAdd(L, R, "addtmp");
+    case '-':
+        return Builder->CreateFSub(L, R, "subtmp");
+    case '*':
+        return Builder->CreateFMul(L, R, "multmp");
+    case '/':
+        return Builder->CreateFDiv(L, R, "divtmp");
+    case '<':
+        L = Builder->CreateFCmpULT(L, R, "cmptmp");
+        // Convert boolean 0/1 to double 0.0 or 1.0
+        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    case '>':
+        L = Builder->CreateFCmpUGT(L, R, "cmptmp");
+        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    case '=':
+        // Handle equality comparison (==)
+        L = Builder->CreateFCmpUEQ(L, R, "cmptmp");
+        return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+    default:
+        return LogErrorV("invalid binary operator");
+    }
+}
+
+Value *BinaryExprAST::codegen() {
+    SmallVector<const BinaryExprAST *, 8> Spine;
+    Value *L = leftSpine(Spine)->codegen();
+    for (const BinaryExprAST *B : llvm::reverse(Spine)) {
+        Value *R = B->RHS->codegen();
+        if (!L || !R)
+            return nullptr;
+        L = EmitBinaryOp(B->Op, L, R);
+    }
+    return L;
+}
+
+/// ApplyBinaryOp - The value of L Op R. Comparisons are unordered, as in codegen: true when either side is NaN.
+static double ApplyBinaryOp(char Op, double L, double R) {
+    switch (Op) {
+    case '+':
+        return L + R;
+    case '-':
+        return L - R;
+    case '*':
+        return L * R;
+    case '/':
+        return L / R;
+    case '<':
+        return !(L >= R);
+    case '>':
+        return !(L <= R);
+    case '=':
+        return L == R || L != L || R != R;
+    default:
+        return NAN;
+    }
+}
+
+double BinaryExprAST::interpret(const double *Args) const {
+    SmallVector<const BinaryExprAST *, 8> Spine;
+    double L = leftSpine(Spine)->interpret(Args);
+    for (const BinaryExprAST *B : llvm::reverse(Spine))
+        L = ApplyBinaryOp(B->Op, L, B->RHS->interpret(Args));
+    return L;
+}
+
+Function *PrototypeAST::codegen() {
+    // Create the function type: double(double,double) etc.
+    vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
+    FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+
+    Function *F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+
+    // Assign names to all arguments.
+    unsigned Idx = 0;
+    for (auto &Arg : F->args())
+        Arg.setName(Args[Idx++]);
+
+    return F;
+}
+
+Function *FunctionAST::codegen() {
+    PhaseTimer Timer(PhaseCodegen);
+    // First, check if there is an existing function from a previous 'extern' declaration.
+    Function *TheFunction = TheModule->getFunction(Proto->getName());
+
+    if (!TheFunction)
+        TheFunction = Proto->codegen();
+    if (!TheFunction)
+        return nullptr;
+
+    // Create a new basic block to start inserting into.
+    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+    Builder->SetInsertPoint(BB);
+
+    // Record the function arguments in the NamedValues map.
+    NamedValues.clear();
+    for (auto &Arg : TheFunction->args())
+        NamedValues[string(Arg.getName())] = &Arg;
+
+    if (Value *RetVal = Body->codegen()) {
+        // Complete the function.
+        Builder->CreateRet(RetVal);
+
+        LastExprMemory.IRInstructions = TheFunction->getInstructionCount();
+        IRInstructions.add(LastExprMemory.IRInstructions);
+        if (MeasureModuleHeap) {
+            int64_t Growth = int64_t(HeapBytes() - ModuleHeapBase);
+            LastExprMemory.ModuleHeapBytes = Growth;
+            ModulesMeasured.fetch_add(1, memory_order_relaxed);
+            ModuleHeapTotal.fetch_add(Growth, memory_order_relaxed);
+            int64_t Peak = ModuleHeapPeak.load(memory_order_relaxed);
+            while (Growth > Peak && !ModuleHeapPeak.compare_exchange_weak(Peak, Growth, memory_order_relaxed))
+                ;
+        }
+
+        // The module's identifier names its object code, which is how profilers get to see the expression.
+        if (PerfLabels)
+            TheModule->setModuleIdentifier(ExprLabel(*Body));
+
+        // Verify the generated code to ensure consistency.
+        PhaseTimer VerifyTimer(PhaseVerify);
+        verifyFunction(*TheFunction);
+
+        return TheFunction;
+    }
+
+    // Error reading body, remove function.
+    TheFunction->eraseFromParent();
+    return nullptr;
+}
+
+Function *CodegenBatchEntry(Function *F) {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    Type *PtrTy = PointerType::getUnqual(DoubleTy);
+    Type *IndexTy = Type::getInt64Ty(*TheContext);
+    FunctionType *FT = FunctionType::get(Type::getVoidTy(*TheContext), {PtrTy, PtrTy, IndexTy}, false);
+    Function *Batch = Function::Create(FT, Function::ExternalLinkage, F->getName() + "_batch", TheModule.get());
+    Argument *ArgsPtr = Batch->getArg(0), *ResultsPtr = Batch->getArg(1), *Count = Batch->getArg(2);
+    ArgsPtr->setName("args");
+    ResultsPtr->setName("results");
+    Count->setName("count");
+    // The columns and the results never overlap, which spares the vectorizer its runtime checks.
+    Batch->addParamAttr(0, Attribute::NoAlias);
+    Batch->addParamAttr(1, Attribute::NoAlias);
+
+    BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", Batch);
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", Batch);
+    BasicBlock *ExitBB = BasicBlock::Create(*TheContext, "exit", Batch);
+    Builder->SetInsertPoint(EntryBB);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(Count, ConstantInt::get(IndexTy, 0)), ExitBB, LoopBB);
+
+    // for (i = 0; i != count; ++i) results[i] = F(args[0 * count + i], args[1 * count + i], ...)
+    Builder->SetInsertPoint(LoopBB);
+    PHINode *Row = Builder->CreatePHI(IndexTy, 2, "i");
+    Row->addIncoming(ConstantInt::get(IndexTy, 0), EntryBB);
+    vector<Value *> Args;
+    for (auto &Arg : F->args()) {
+        Value *Column = Builder->CreateMul(ConstantInt::get(IndexTy, Arg.getArgNo()), Count);
+        Value *Ptr = Builder->CreateInBoundsGEP(DoubleTy, ArgsPtr, Builder->CreateAdd(Column, Row));
+        Args.push_back(Builder->CreateLoad(DoubleTy, Ptr, Arg.getName()));
+    }
+    Value *Result = Builder->CreateCall(F, Args, "calltmp");
+    Builder->CreateStore(Result, Builder->CreateInBoundsGEP(DoubleTy, ResultsPtr, Row));
+    Value *Next = Builder->CreateAdd(Row, ConstantInt::get(IndexTy, 1), "nexti");
+    Row->addIncoming(Next, LoopBB);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(Next, Count), ExitBB, LoopBB);
+
+    Builder->SetInsertPoint(ExitBB);
+    Builder->CreateRetVoid();
+
+    PhaseTimer Timer(PhaseVerify);
+    verifyFunction(*Batch);
+    return Batch;
+}
+
+Function *CodegenArgsEntry(Function *F) {
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    FunctionType *FT = FunctionType::get(DoubleTy, {PointerType::getUnqual(DoubleTy)}, false);
+    Function *Entry = Function::Create(FT, Function::ExternalLinkage, F->getName() + "_entry", TheModule.get());
+    Argument *ArgsPtr = Entry->getArg(0);
+    ArgsPtr->setName("args");
+
+    Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Entry));
+    vector<Value *> Args;
+    for (auto &Arg : F->args())
+        Args.push_back(Builder->CreateLoad(DoubleTy, Builder->CreateConstInBoundsGEP1_64(DoubleTy, ArgsPtr, Arg.getArgNo()),
+                                           Arg.getName()));
+    Builder->CreateRet(Builder->CreateCall(F, Args, "calltmp"));
+
+    PhaseTimer Timer(PhaseVerify);
+    verifyFunction(*Entry);
+    return Entry;
+}
+
+void InitializeModule() {
+    // Drop any module still open before the context that owns it.
+    Builder.reset();
+    TheModule.reset();
+    TheContext.reset();
+
+    // Open a new context and module.
+    if (MeasureModuleHeap)
+        ModuleHeapBase = HeapBytes();
+    TheContext = make_unique<LLVMContext>();
+    TheModule = make_unique<Module>("jit", *TheContext);
+    if (TheJIT)
+        TheModule->setDataLayout(TheJIT->getDataLayout());
+
+    // Create a new builder for the module.
+    Builder = make_unique<IRBuilder<>>(*TheContext);
+}
+
+// Shared Compiled-Code Cache
+
+SharedObjectStore::~SharedObjectStore() {
+    {
+        OpenStoreList &Open = OpenStores();
+        lock_guard<mutex> Lock(Open.Lock);
+        Open.Stores.erase(find(Open.Stores.begin(), Open.Stores.end(), this));
+    }
+    munmap(Hdr, MappedSize);
+}
+
+unique_ptr<SharedObjectStore> SharedObjectStore::open(const string &Path) {
+    int FD = ::open(Path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (FD < 0) {
+        fprintf(stderr, "Error: cannot open object cache '%s': %s\n", Path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    // Initialization is the only step that takes a lock; lookups and inserts never do.
+    flock(FD, LOCK_EX);
+    struct stat St;
+    void *Base = MAP_FAILED;
+    if (fstat(FD, &St) == 0 && (St.st_size == 0 ? ftruncate(FD, MappedSize) == 0 : St.st_size == (off_t)MappedSize))
+        Base = mmap(nullptr, MappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, FD, 0);
+    if (Base == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map object cache '%s'\n", Path.c_str());
+        flock(FD, LOCK_UN);
+        ::close(FD);
+        return nullptr;
+    }
+
+    auto *H = static_cast<Header *>(Base);
+    if (H->Magic.load(memory_order_acquire) == 0) {
+        H->Version = StoreVersion;
+        H->NumSlots = NumSlots;
+        H->ArenaSize = ArenaSize;
+        H->Magic.store(StoreMagic, memory_order_release);
+    }
+    bool Valid = H->Magic.load(memory_order_acquire) == StoreMagic && H->Version == StoreVersion &&
+                 H->NumSlots == NumSlots && H->ArenaSize == ArenaSize;
+    flock(FD, LOCK_UN);
+    ::close(FD);
+
+    if (!Valid) {
+        fprintf(stderr, "Error: '%s' is not a compatible object cache\n", Path.c_str());
+        munmap(Base, MappedSize);
+        return nullptr;
+    }
+    unique_ptr<SharedObjectStore> Store(new SharedObjectStore(Base));
+    OpenStoreList &Open = OpenStores();
+    lock_guard<mutex> Lock(Open.Lock);
+    Open.Stores.push_back(Store.get());
+    return Store;
+}
+
+bool SharedObjectStore::isAbandoned(const Slot &S) {
+    int32_t State = S.State.load(memory_order_acquire);
+    return State == SlotEmpty || (State > 0 && kill(State, 0) != 0 && errno == ESRCH);
+}
+
+StringRef SharedObjectStore::lookup(ObjectKey Key) const {
+    for (uint32_t I = 0; I < NumSlots; ++I) {
+        const Slot &S = Slots[(Key.Hash + I) % NumSlots];
+        uint64_t SlotKey = S.Key.load(memory_order_acquire);
+        if (SlotKey == 0)
+            return StringRef();
+        // A slot with our hash may hold a colliding module, or be unpublished; ours can then only be further on.
+        if (SlotKey == Key.Hash && S.State.load(memory_order_acquire) == SlotPublished && S.Check == Key.Check)
+            return StringRef(Arena + S.Offset, S.Size);
+    }
+    return StringRef();
+}
+
+void SharedObjectStore::insert(ObjectKey Key, StringRef Obj) {
+    for (uint32_t I = 0; I < NumSlots; ++I) {
+        Slot &S = Slots[(Key.Hash + I) % NumSlots];
+        uint64_t SlotKey = S.Key.load(memory_order_acquire);
+        if (SlotKey == 0 && S.Key.compare_exchange_strong(SlotKey, Key.Hash, memory_order_acq_rel)) {
+            // The slot is ours. Space is only reserved now, so that a writer that loses a race spends none.
+            S.State.store(getpid(), memory_order_release);
+            uint64_t Reserved = alignTo(Obj.size(), 16);
+            uint64_t Offset = Hdr->ArenaUsed.fetch_add(Reserved, memory_order_relaxed);
+            if (Offset + Reserved > ArenaSize) {
+                S.State.store(SlotEmpty, memory_order_release);
+                return;
+            }
+            memcpy(Arena + Offset, Obj.data(), Obj.size());
+            S.Check = Key.Check;
+            S.Offset = Offset;
+            S.Size = Obj.size();
+            S.State.store(SlotPublished, memory_order_release);
+            return;
+        }
+        // SlotKey is now the slot's key, whether loaded or left by the failed CAS. Skip collisions and slots that will never be published.
+        if (SlotKey != Key.Hash || isAbandoned(S))
+            continue;
+        if (S.State.load(memory_order_acquire) != SlotPublished || S.Check == Key.Check)
+            return; // Published already, or being written by a live process.
+    }
+}
+
+ObjectKey JITObjectCache::getModuleKey(const Module &M) {
+    string IR;
+    raw_string_ostream OS(IR);
+    OS << LLVM_VERSION_STRING << ' ' << sys::getHostCPUName() << '\n';
+    M.print(OS, nullptr);
+    ObjectKey Key;
+    Key.Hash = max<uint64_t>(xxHash64(OS.str()), 1);
+    MD5 Check;
+    MD5::MD5Result Digest;
+    Check.update(OS.str());
+    Check.final(Digest);
+    Key.Check = Digest.low();
+    return Key;
+}
+
+JITObjectCache::~JITObjectCache() {
+    for (auto &Entry : LocalObjects)
+        ObjectCacheBytes.add(-int64_t(Entry.second->getBufferSize()));
+}
+
+void JITObjectCache::addObject(ObjectKey Key, StringRef Obj) {
+    lock_guard<mutex> Lock(LocalLock);
+    auto &Slot = LocalObjects[Key];
+    if (!Slot) {
+        Slot = MemoryBuffer::getMemBufferCopy(Obj);
+        ObjectCacheBytes.add(Obj.size());
+    }
+}
+
+StringRef JITObjectCache::lookupObject(ObjectKey Key) {
+    {
+        lock_guard<mutex> Lock(LocalLock);
+        auto It = LocalObjects.find(Key);
+        if (It != LocalObjects.end())
+            return It->second->getBuffer();
+    }
+    return Store ? Store->lookup(Key) : StringRef();
+}
+
+void JITObjectCache::notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) {
+    ObjectKey Key;
+    {
+        lock_guard<mutex> Lock(LocalLock);
+        auto It = PendingKeys.find(M);
+        if (It == PendingKeys.end())
+            return;
+        Key = It->second;
+        PendingKeys.erase(It);
+    }
+    if (KeepLocal)
+        addObject(Key, Obj.getBuffer());
+    if (Store)
+        Store->insert(Key, Obj.getBuffer());
+}
+
+unique_ptr<MemoryBuffer> JITObjectCache::getObject(const Module *M) {
+    ObjectKey Key = getModuleKey(*M);
+    StringRef Obj = lookupObject(Key);
+    (Obj.empty() ? CacheMisses : CacheHits).add();
+    if (Obj.empty()) {
+        lock_guard<mutex> Lock(LocalLock);
+        PendingKeys[M] = Key;
+        return nullptr;
+    }
+    // Cached objects are never modified or freed, so they can be linked in place.
+    return MemoryBuffer::getMemBuffer(Obj, M->getModuleIdentifier(), /*RequiresNullTerminator=*/false);
+}
+
+// Profiler Support
+// perf finds symbols for JIT code in /tmp/perf-<pid>.map, or in a jitdump file merged into its recording by "perf inject --jit". The map is written here, so that each function can be named after its expression; the jitdump writer is LLVM's own and uses plain symbol names.
+
+string ExprLabel(const ExprAST &Body) {
+    static const size_t MaxSnippet = 48;
+    string Canonical, Source;
+    Body.serialize(Canonical);
+    raw_string_ostream OS(Source);
+    Body.print(OS);
+    StringRef Snippet = OS.str();
+    if (Snippet.startswith("("))
+        Snippet = Snippet.drop_front().drop_back();
+    string Label;
+    raw_string_ostream(Label) << '[' << format_hex_no_prefix(xxHash64(Canonical) & 0xffffffff, 8) << "] "
+                              << Snippet.take_front(MaxSnippet) << (Snippet.size() > MaxSnippet ? "..." : "");
+    return Label;
+}
+
+/// PerfMapListener - Appends every function the JIT loads to this process's perf map. Entries are never removed, as perf maps have no way to express that; the jitdump file records unloads.
+class PerfMapListener : public JITEventListener {
+    mutex Lock;
+    FILE *Map = nullptr;
+    pid_t MapPid = 0; // The process Map belongs to; a forked child starts a map of its own.
+
+public:
+    void notifyObjectLoaded(ObjectKey, const object::ObjectFile &Obj,
+                            const RuntimeDyld::LoadedObjectInfo &L) override {
+        // The object's name is its module's identifier, which ExprLabel set; objects the JIT compiled itself carry a suffix.
+        StringRef Label = Obj.getFileName();
+        Label.consume_back("-jitted-objectbuffer");
+
+        // The debug copy of the object has its symbols at their load addresses.
+        object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+        if (!DebugObj.getBinary())
+            return;
+        lock_guard<mutex> Guard(Lock);
+        if (MapPid != getpid()) {
+            MapPid = getpid();
+            string Path = "/tmp/perf-" + to_string(MapPid) + ".map";
+            Map = fopen(Path.c_str(), "a");
+            if (!Map) {
+                fprintf(stderr, "Error: cannot open perf map '%s': %s\n", Path.c_str(), strerror(errno));
+                return;
+            }
+        }
+        if (!Map)
+            return;
+        for (const auto &SymAndSize : object::computeSymbolSizes(*DebugObj.getBinary())) {
+            const object::SymbolRef &Sym = SymAndSize.first;
+            auto Type = Sym.getType();
+            auto Name = Sym.getName();
+            auto Addr = Sym.getAddress();
+            if (!Type || !Name || !Addr || *Type != object::SymbolRef::ST_Function) {
+                consumeError(Type.takeError());
+                consumeError(Name.takeError());
+                consumeError(Addr.takeError());
+                continue;
+            }
+            fprintf(Map, "%" PRIx64 " %" PRIx64 " %s %s\n", *Addr, SymAndSize.second, Name->str().c_str(),
+                    Label.str().c_str());
+        }
+        fflush(Map);
+    }
+};
+
+/// PerfListeners - The listeners EnablePerfSupport chose, registered with every JIT created afterwards.
+static vector<JITEventListener *> PerfListeners;
+
+void EnablePerfSupport(bool PerfMap, bool JITDump) {
+    PerfLabels = PerfMap;
+    if (PerfMap)
+        PerfListeners.push_back(new PerfMapListener);
+    if (JITDump) {
+        if (JITEventListener *L = JITEventListener::createPerfJITEventListener())
+            PerfListeners.push_back(L);
+        else
+            fprintf(stderr, "Error: this LLVM was built without perf jitdump support\n");
+    }
+}
+
+/// TimedCompiler - The JIT's compiler, with its work charged to the jit-emit phase.
+class TimedCompiler : public orc::TMOwningSimpleCompiler {
+public:
+    using TMOwningSimpleCompiler::TMOwningSimpleCompiler;
+
+    Expected<CompileResult> operator()(Module &M) override {
+        PhaseTimer Timer(PhaseEmit);
+        auto Obj = TMOwningSimpleCompiler::operator()(M);
+        NativeCompiles.add();
+        if (Obj)
+            ObjectBytes.add((*Obj)->getBufferSize());
+        return Obj;
+    }
+};
+
+/// CountingMemoryManager - Keeps calc_jit_code_bytes and the JIT's calc_memory_bytes up to date. The JIT gives every object a memory manager of its own, and destroys it along with the object's code.
+class CountingMemoryManager : public SectionMemoryManager {
+    uint64_t Code = 0, ROData = 0, RWData = 0;
+
+public:
+    ~CountingMemoryManager() override {
+        CodeBytes.add(-int64_t(Code + ROData + RWData));
+        JITCodeBytes.add(-int64_t(Code));
+        JITRODataBytes.add(-int64_t(ROData));
+        JITRWDataBytes.add(-int64_t(RWData));
+    }
+
+    uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID,
+                                 StringRef SectionName) override {
+        Code += Size;
+        CodeBytes.add(Size);
+        JITCodeBytes.add(Size);
+        return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID, SectionName);
+    }
+
+    uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, StringRef SectionName,
+                                 bool IsReadOnly) override {
+        (IsReadOnly ? ROData : RWData) += Size;
+        CodeBytes.add(Size);
+        (IsReadOnly ? JITRODataBytes : JITRWDataBytes).add(Size);
+        return SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID, SectionName, IsReadOnly);
+    }
+};
+
+Expected<unique_ptr<orc::LLJIT>> CreateJIT(ObjectCache *Cache) {
+    orc::LLJITBuilder JB;
+    JB.setCompileFunctionCreator(
+        [Cache](orc::JITTargetMachineBuilder JTMB) -> Expected<unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+            auto TM = JTMB.createTargetMachine();
+            if (!TM)
+                return TM.takeError();
+            return make_unique<TimedCompiler>(move(*TM), Cache);
+        });
+    // The linking layer is set up explicitly rather than left to LLJIT, to count the code's memory and to register the profiler listeners.
+    JB.setObjectLinkingLayerCreator(
+        [](orc::ExecutionSession &ES, const Triple &) -> Expected<unique_ptr<orc::ObjectLayer>> {
+            auto Layer = make_unique<orc::RTDyldObjectLinkingLayer>(
+                ES, [] { return make_unique<CountingMemoryManager>(); });
+            for (JITEventListener *L : PerfListeners)
+                Layer->registerJITEventListener(*L);
+            return Layer;
+        });
+    auto JIT = JB.create();
+    if (!JIT)
+        return JIT.takeError();
+    // The optimizer turns a batch kernel that only copies its argument column into a call to memcpy, and may use the other memory intrinsics' library functions likewise. Those, and nothing else, come from the process.
+    char Prefix = (*JIT)->getDataLayout().getGlobalPrefix();
+    auto Generator = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        Prefix, [Prefix](const orc::SymbolStringPtr &Name) {
+            StringRef Symbol = *Name;
+            if (Prefix && !Symbol.consume_front(StringRef(&Prefix, 1)))
+                return false;
+            return Symbol == "memcpy" || Symbol == "memmove" || Symbol == "memset";
+        });
+    if (!Generator)
+        return Generator.takeError();
+    (*JIT)->getMainJITDylib().addGenerator(move(*Generator));
+    return JIT;
+}
+
+ObjectCache *EngineObjectCache = nullptr;
+
+void InitializeCalculator() {
+    static std::once_flag Once;
+    std::call_once(Once, [] {
+        InitializeNativeTarget();
+        InitializeNativeTargetAsmPrinter();
+        InitializeNativeTargetAsmParser();
+
+        // Set up standard binary operators.
+        BinopPrecedence['<'] = 10;
+        BinopPrecedence['>'] = 10;
+        BinopPrecedence['='] = 10; // For checking if the two sides are equal
+        BinopPrecedence['+'] = 20;
+        BinopPrecedence['-'] = 20;
+        BinopPrecedence['*'] = 40;
+        BinopPrecedence['/'] = 40;
+    });
+}
+
+// Engine
+// The library interface. An Engine owns a JIT; compiled expressions stay in it until the Engine is destroyed.
+
+/// CompileScope - Runs a compile on the calling thread without disturbing whatever that thread was doing: the thread's lexer, parser and code generation state are set aside on entry and put back on exit. The tool's own threads can therefore use an Engine mid-session.
+class CompileScope {
+    bool SavedLexFromBuffer = LexFromBuffer;
+    const char *SavedLexBuffer = LexBuffer;
+    const char *SavedLexBufferEnd = LexBufferEnd;
+    int SavedLastChar = LastChar;
+    int SavedCurTok = CurTok;
+    double SavedNumVal = NumVal;
+    string SavedIdentifierStr = move(IdentifierStr);
+    bool SavedCollectErrors = CollectErrors;
+    string SavedPendingError = move(PendingError);
+    unique_ptr<LLVMContext> SavedContext = move(TheContext);
+    unique_ptr<Module> SavedModule = move(TheModule);
+    unique_ptr<IRBuilder<>> SavedBuilder = move(Builder);
+    orc::LLJIT *SavedJIT = TheJIT;
+
+public:
+    /// CompileScope - Start a compile for JIT. Scopes that only parse, or hand code generation to a compile server, need no module.
+    CompileScope(orc::LLJIT *JIT, bool OpenModule = true) {
+        CollectErrors = true;
+        PendingError.clear();
+        TheJIT = JIT;
+        if (OpenModule)
+            InitializeModule();
+    }
+
+    ~CompileScope() {
+        Builder.reset();
+        TheModule.reset();
+        TheContext = move(SavedContext);
+        TheModule = move(SavedModule);
+        Builder = move(SavedBuilder);
+        TheJIT = SavedJIT;
+        PendingError = move(SavedPendingError);
+        CollectErrors = SavedCollectErrors;
+        IdentifierStr = move(SavedIdentifierStr);
+        NumVal = SavedNumVal;
+        CurTok = SavedCurTok;
+        LastChar = SavedLastChar;
+        LexBufferEnd = SavedLexBufferEnd;
+        LexBuffer = SavedLexBuffer;
+        LexFromBuffer = SavedLexFromBuffer;
+    }
+};
+
+/// EntryFn/BatchFn - The entry points CodegenArgsEntry and CodegenBatchEntry give a compiled expression.
+using EntryFn = double (*)(const double *Args);
+using BatchFn = void (*)(const double *Args, double *Results, uint64_t Count);
+
+/// OptimizeModule - Run the standard -O2 pipeline over M, tuned for TM, so that the expression is inlined into its batch kernel and the kernel's loop is vectorized.
+static void OptimizeModule(Module &M, TargetMachine &TM) {
+    PhaseTimer Timer(PhaseOptimize);
+    OptimizedCompiles.add();
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PassBuilder PB(&TM);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2).run(M, MAM);
+}
+
+/// CreateHostTargetMachine - A target machine for the host CPU, or null with the error reported.
+static unique_ptr<TargetMachine> CreateHostTargetMachine() {
+    auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+    auto TM = JTMB ? JTMB->createTargetMachine() : JTMB.takeError();
+    if (!TM) {
+        ReportError(("cannot target the host: " + toString(TM.takeError())).c_str());
+        return nullptr;
+    }
+    return move(*TM);
+}
+
+/// HostTargetMachine - The calling thread's target machine for the host CPU, created on first use, or null with the error reported. Compile server threads generate their objects with it; explain analyses code for it.
+static TargetMachine *HostTargetMachine() {
+    static thread_local unique_ptr<TargetMachine> TM;
+    if (!TM)
+        TM = CreateHostTargetMachine();
+    return TM.get();
+}
+
+// Remote Compilation
+// The server side of the protocol described in engine_internal.h, and the socket plumbing shared with the client side in Engine.
+
+int ConnectUnix(const string &Path) {
+    sockaddr_un Addr;
+    memset(&Addr, 0, sizeof(Addr));
+    Addr.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(Addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(Addr.sun_path, Path.c_str(), Path.size());
+    int Sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (Sock < 0)
+        return -1;
+    if (connect(Sock, (sockaddr *)&Addr, sizeof(Addr)) < 0) {
+        int Saved = errno;
+        close(Sock);
+        errno = Saved;
+        return -1;
+    }
+    return Sock;
+}
+
+/// SendAll/ReceiveAll - Transfer exactly Size bytes, retrying short transfers. Sends never raise SIGPIPE, since a library must not kill its host when a peer goes away.
+static bool SendAll(int FD, const char *Buf, size_t Size) {
+    while (Size) {
+        ssize_t N = send(FD, Buf, Size, MSG_NOSIGNAL);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Buf += N;
+        Size -= N;
+    }
+    return true;
+}
+
+static bool ReceiveAll(int FD, char *Buf, size_t Size) {
+    while (Size) {
+        ssize_t N = recv(FD, Buf, Size, 0);
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Buf += N;
+        Size -= N;
+    }
+    return true;
+}
+
+bool SendFrame(int FD, StringRef Payload) {
+    char Len[4];
+    support::endian::write32le(Len, Payload.size());
+    return SendAll(FD, Len, sizeof(Len)) && SendAll(FD, Payload.data(), Payload.size());
+}
+
+bool ReceiveFrame(int FD, string &Payload) {
+    char Len[4];
+    if (!ReceiveAll(FD, Len, sizeof(Len)))
+        return false;
+    uint32_t Size = support::endian::read32le(Len);
+    if (Size > MaxCompileFrame)
+        return false;
+    Payload.resize(Size);
+    return ReceiveAll(FD, &Payload[0], Size);
+}
+
+void ServeCompileRequest(StringRef Request, string &Response) {
+    auto Fail = [&Response](StringRef Message) {
+        Response = "error";
+        Response += '\0';
+        Response += Message;
+    };
+
+    CompileScope Scope(nullptr, /*OpenModule=*/false);
+    char Kind = Request.empty() ? 0 : Request.front();
+    if (Kind != 'e' && Kind != 'b')
+        return Fail("malformed compile request");
+    StringRef Name;
+    tie(Name, Request) = Request.drop_front().split('\0');
+    vector<string> Params;
+    while (!Request.empty() && Request.front() != '\0') {
+        StringRef Param;
+        tie(Param, Request) = Request.split('\0');
+        Params.push_back(Param.str());
+    }
+    Request = Request.drop_front();
+    auto Body = DeserializeExpr(Request);
+    if (Name.empty() || !Body || !Request.empty())
+        return Fail("malformed compile request");
+
+    TargetMachine *HostTM = HostTargetMachine();
+    if (!HostTM)
+        return Fail(PendingError);
+    TargetMachine &TM = *HostTM;
+    InitializeModule();
+    TheModule->setDataLayout(TM.createDataLayout());
+
+    FunctionAST FnAST(make_unique<PrototypeAST>(Name.str(), move(Params)), move(Body));
+    Function *F = FnAST.codegen();
+    if (!F)
+        return Fail(PendingError.empty() ? "invalid expression" : PendingError);
+    CodegenArgsEntry(F);
+    if (Kind == 'b') {
+        CodegenBatchEntry(F);
+        TheModule->setTargetTriple(TM.getTargetTriple().str());
+        OptimizeModule(*TheModule, TM);
+    }
+
+    auto Obj = orc::SimpleCompiler(TM, EngineObjectCache)(*TheModule);
+    if (!Obj)
+        return Fail(toString(Obj.takeError()));
+    Response = "ok";
+    Response += '\0';
+    Response += (*Obj)->getBuffer();
+}
+
+// Explain
+// An explained expression is compiled as Engine::compile would compile it, into a batch kernel optimized for the host CPU. Its loop is then assembled back into machine instructions and run through llvm-mca's model of the CPU's pipeline, which estimates what a row costs without running anything.
+
+/// ExplainIterations - How many iterations of the loop llvm-mca simulates; llvm-mca's own default.
+static constexpr unsigned ExplainIterations = 100;
+
+/// FindHotLoop - The header of the loop in Batch that handles the most rows per iteration: the vector body when the loop was vectorized. Sets Rows to its rows per iteration. Returns null if Batch has no counted loop.
+static BasicBlock *FindHotLoop(Function &Batch, unsigned &Rows) {
+    DominatorTree DT(Batch);
+    LoopInfo LI(DT);
+    BasicBlock *Hot = nullptr;
+    Rows = 0;
+    for (Loop *L : LI) {
+        BasicBlock *Latch = L->getLoopLatch();
+        if (!Latch)
+            continue;
+        // The row index steps by 1 in a scalar loop, and by the vector width times the interleave count in a vector body.
+        for (PHINode &Phi : L->getHeader()->phis()) {
+            auto *Next = dyn_cast<BinaryOperator>(Phi.getIncomingValueForBlock(Latch));
+            if (!Next || Next->getOpcode() != Instruction::Add || Next->getOperand(0) != &Phi)
+                continue;
+            auto *Step = dyn_cast<ConstantInt>(Next->getOperand(1));
+            if (Step && Step->getZExtValue() > Rows) {
+                Hot = L->getHeader();
+                Rows = Step->getZExtValue();
+            }
+        }
+    }
+    return Hot;
+}
+
+/// LoopAssembly - The lines of Asm from the label of the block named Header to the branch back to it, or an empty string if there are none. Block labels name their IR block in a comment.
+static string LoopAssembly(StringRef Asm, StringRef Header) {
+    SmallVector<StringRef, 64> Lines;
+    Asm.split(Lines, '\n');
+    string Comment = ("# %" + Header).str();
+    for (size_t I = 0; I < Lines.size(); ++I) {
+        if (!Lines[I].rtrim().endswith(Comment) || !Lines[I].contains(':'))
+            continue;
+        StringRef Label = Lines[I].split(':').first.trim();
+        string Text = Lines[I].str() + '\n';
+        for (size_t J = I + 1; J < Lines.size(); ++J) {
+            Text += Lines[J].str() + '\n';
+            StringRef Operands = Lines[J].split('#').first.rtrim();
+            if (Operands.endswith(Label) && isSpace(Operands.drop_back(Label.size()).back()))
+                return Text;
+        }
+        return string();
+    }
+    return string();
+}
+
+/// InstCollector - Keeps the instructions the assembly parser emits and ignores everything else.
+class InstCollector : public MCStreamer {
+public:
+    vector<MCInst> Insts;
+
+    InstCollector(MCContext &Ctx) : MCStreamer(Ctx) {}
+    void emitInstruction(const MCInst &Inst, const MCSubtargetInfo &) override { Insts.push_back(Inst); }
+    bool emitSymbolAttribute(MCSymbol *, MCSymbolAttr) override { return true; }
+    void emitCommonSymbol(MCSymbol *, uint64_t, unsigned) override {}
+    void emitZerofill(MCSection *, MCSymbol *, uint64_t, unsigned, SMLoc) override {}
+};
+
+/// PressureListener - Tallies the events of llvm-mca's pipeline: the cycles each resource unit is busy, and the cycles in which ready instructions could not issue, by reason and by the resources they waited for.
+class PressureListener : public mca::HWEventListener {
+    vector<unsigned> StateToResource; // Resource state index to processor resource index.
+    unsigned Reasons = 0;             // This cycle's reasons, as 1 << HWPressureEvent::GenericReason.
+    uint64_t Busy = 0;                // This cycle's unavailable resources, as resource masks.
+
+public:
+    uint64_t Cycles = 0, PressureCycles = 0;
+    uint64_t ReasonCycles[mca::HWPressureEvent::MEMORY_DEPS + 1] = {};
+    vector<uint64_t> BusyCycles;              // By processor resource index.
+    map<pair<unsigned, unsigned>, double> UnitCycles; // By processor resource index and unit.
+
+    PressureListener(const MCSchedModel &SM) : StateToResource(64), BusyCycles(SM.getNumProcResourceKinds()) {
+        SmallVector<uint64_t, 32> Masks(SM.getNumProcResourceKinds());
+        mca::computeProcResourceMasks(SM, Masks);
+        for (unsigned I = 1; I < Masks.size(); ++I)
+            StateToResource[mca::getResourceStateIndex(Masks[I])] = I;
+    }
+
+    /// resourceOf - The processor resource index of the resource with the given mask.
+    unsigned resourceOf(uint64_t Mask) const { return StateToResource[mca::getResourceStateIndex(Mask)]; }
+
+    using mca::HWEventListener::onEvent;
+    void onEvent(const mca::HWInstructionEvent &Event) override {
+        if (Event.Type != mca::HWInstructionEvent::Issued)
+            return;
+        for (const mca::ResourceUse &Use : static_cast<const mca::HWInstructionIssuedEvent &>(Event).UsedResources)
+            UnitCycles[{unsigned(Use.first.first), countTrailingZeros(Use.first.second)}] += double(Use.second);
+    }
+    void onEvent(const mca::HWPressureEvent &Event) override {
+        Reasons |= 1u << Event.Reason;
+        Busy |= Event.ResourceMask;
+    }
+    void onCycleEnd() override {
+        ++Cycles;
+        if (Reasons) {
+            ++PressureCycles;
+            for (unsigned R = mca::HWPressureEvent::RESOURCES; R <= mca::HWPressureEvent::MEMORY_DEPS; ++R)
+                ReasonCycles[R] += (Reasons >> R) & 1;
+            for (uint64_t M = Busy; M; M &= M - 1)
+                ++BusyCycles[resourceOf(M & -M)];
+        }
+        Reasons = 0;
+        Busy = 0;
+    }
+};
+
+/// ResourceName - The name of unit Unit of processor resource Resource, numbered only when the resource has several.
+static string ResourceName(const MCSchedModel &SM, unsigned Resource, unsigned Unit) {
+    const MCProcResourceDesc &Desc = *SM.getProcResource(Resource);
+    return Desc.NumUnits > 1 ? string(Desc.Name) + "." + to_string(Unit) : string(Desc.Name);
+}
+
+/// AnalyzeLoop - Simulate the loop of Asm whose header is the block named Header, and which handles Rows rows per iteration, on the host CPU, and write the estimate to OS.
+static void AnalyzeLoop(TargetMachine &TM, StringRef Asm, StringRef Header, unsigned Rows, raw_ostream &OS) {
+    string CPU = TM.getTargetCPU().str();
+    OS << "Loop analysis (llvm-mca, " << CPU << "):\n";
+    auto Unavailable = [&OS](const Twine &Why) { OS << "  unavailable: " << Why << '\n'; };
+    string LoopAsm = Header.empty() ? string() : LoopAssembly(Asm, Header);
+    if (LoopAsm.empty())
+        return Unavailable("the batch kernel's loop is not in its assembly");
+    const MCSubtargetInfo &STI = *TM.getMCSubtargetInfo();
+    const MCSchedModel &SM = STI.getSchedModel();
+    if (!SM.hasInstrSchedModel())
+        return Unavailable("LLVM has no scheduling model for " + CPU);
+
+    // Assemble the loop back into machine instructions, as llvm-mca does with its input.
+    const Target &T = TM.getTarget();
+    const MCRegisterInfo &MRI = *TM.getMCRegisterInfo();
+    const MCInstrInfo &MCII = *TM.getMCInstrInfo();
+    llvm::SourceMgr Sources;
+    Sources.AddNewSourceBuffer(MemoryBuffer::getMemBufferCopy(LoopAsm, "loop"), SMLoc());
+    MCContext Ctx(TM.getTargetTriple(), TM.getMCAsmInfo(), &MRI, &STI, &Sources);
+    unique_ptr<MCObjectFileInfo> MOFI(T.createMCObjectFileInfo(Ctx, /*PIC=*/false));
+    Ctx.setObjectFileInfo(MOFI.get());
+    InstCollector Collector(Ctx);
+    unique_ptr<MCAsmParser> Parser(createMCAsmParser(Sources, Ctx, Collector, *TM.getMCAsmInfo()));
+    unique_ptr<MCTargetAsmParser> TargetParser(T.createMCAsmParser(STI, *Parser, MCII, MCTargetOptions()));
+    if (!TargetParser)
+        return Unavailable("the host target has no assembly parser");
+    Parser->setTargetParser(*TargetParser);
+    if (Parser->Run(/*NoInitialTextSection=*/false) || Collector.Insts.empty())
+        return Unavailable("the loop's assembly does not parse");
+
+    // The block's micro-ops and resource cycles give the throughput it could reach with no dependencies between instructions.
+    unique_ptr<MCInstrAnalysis> MCIA(T.createMCInstrAnalysis(&MCII));
+    mca::InstrBuilder IB(STI, MCII, MRI, MCIA.get());
+    PressureListener Listener(SM);
+    vector<unique_ptr<mca::Instruction>> Insts;
+    vector<unsigned> Usage(SM.getNumProcResourceKinds());
+    unsigned MicroOps = 0;
+    for (const MCInst &MI : Collector.Insts) {
+        auto Inst = IB.createInstruction(MI);
+        if (!Inst)
+            return Unavailable(toString(Inst.takeError()));
+        const mca::InstrDesc &Desc = (*Inst)->getDesc();
+        MicroOps += Desc.NumMicroOps;
+        for (const auto &Use : Desc.Resources)
+            if (Use.second.size())
+                Usage[Listener.resourceOf(Use.first)] += Use.second.size();
+        Insts.push_back(move(*Inst));
+    }
+
+    mca::SourceMgr Source(Insts, ExplainIterations);
+    mca::Context MCA(MRI, STI);
+    mca::PipelineOptions Options(/*UOPQSize=*/0, /*DecThr=*/0, SM.IssueWidth, /*RFS=*/0, /*LQS=*/0, /*SQS=*/0,
+                                 /*NoAlias=*/true, /*ShouldEnableBottleneckAnalysis=*/true);
+    mca::CustomBehaviour CB(STI, Source, MCII);
+    auto Pipeline = SM.isOutOfOrder() ? MCA.createDefaultPipeline(Options, Source, CB)
+                                      : MCA.createInOrderPipeline(Options, Source, CB);
+    Pipeline->addEventListener(&Listener);
+    auto Cycles = Pipeline->run();
+    if (!Cycles)
+        return Unavailable(toString(Cycles.takeError()));
+
+    // Name the bottleneck after what most often kept ready instructions from issuing; with little such pressure, the loop is limited by how fast it dispatches.
+    using Pressure = mca::HWPressureEvent;
+    string Bottleneck = "dispatch width";
+    if (Listener.PressureCycles * 10 >= *Cycles) {
+        unsigned Reason = Pressure::RESOURCES;
+        for (unsigned R : {Pressure::REGISTER_DEPS, Pressure::MEMORY_DEPS})
+            if (Listener.ReasonCycles[R] > Listener.ReasonCycles[Reason])
+                Reason = R;
+        if (Reason == Pressure::REGISTER_DEPS) {
+            Bottleneck = "register dependencies";
+        } else if (Reason == Pressure::MEMORY_DEPS) {
+            Bottleneck = "memory dependencies";
+        } else {
+            vector<unsigned> Resources;
+            for (unsigned I = 1; I < Listener.BusyCycles.size(); ++I)
+                if (Listener.BusyCycles[I])
+                    Resources.push_back(I);
+            llvm::sort(Resources, [&](unsigned A, unsigned B) { return Listener.BusyCycles[A] > Listener.BusyCycles[B]; });
+            Bottleneck = "execution resources";
+            for (size_t I = 0; I < Resources.size() && I < 3; ++I)
+                Bottleneck += (I ? ", " : " (") + string(SM.getProcResource(Resources[I])->Name);
+            if (!Resources.empty())
+                Bottleneck += ")";
+        }
+    }
+
+    double PerIteration = double(*Cycles) / ExplainIterations;
+    OS << format("  %-28s %%%s, %u rows per iteration, %u iterations\n", (const char *)"loop", Header.str().c_str(),
+                 Rows, ExplainIterations)
+       << format("  %-28s %zu\n", (const char *)"instructions per iteration", Insts.size())
+       << format("  %-28s %u\n", (const char *)"micro-ops per iteration", MicroOps)
+       << format("  %-28s %u\n", (const char *)"dispatch width", SM.IssueWidth)
+       << format("  %-28s %.2f\n", (const char *)"cycles per iteration", PerIteration)
+       << format("  %-28s %.3f\n", (const char *)"cycles per row", PerIteration / Rows)
+       << format("  %-28s %.2f\n", (const char *)"IPC", double(Insts.size()) * ExplainIterations / *Cycles)
+       << format("  %-28s %.2f\n", (const char *)"block reciprocal throughput",
+                 mca::computeBlockRThroughput(SM, SM.IssueWidth, MicroOps, Usage))
+       << format("  %-28s %s\n", (const char *)"bottleneck", Bottleneck.c_str());
+
+    OS << format("\n  %-28s %13s %9s\n", (const char *)"Resource pressure", (const char *)"per iteration",
+                 (const char *)"per row");
+    for (const auto &Unit : Listener.UnitCycles) {
+        double PerIteration = Unit.second / ExplainIterations;
+        OS << format("  %-28s %13.2f %9.3f\n", ResourceName(SM, Unit.first.first, Unit.first.second).c_str(),
+                     PerIteration, PerIteration / Rows);
+    }
+
+    OS << format("\n  %-28s %13s %9s\n", (const char *)"Backend pressure", (const char *)"cycles", (const char *)"share");
+    auto PrintPressure = [&](const char *Name, uint64_t N) {
+        OS << format("  %-28s %13" PRIu64 " %8.1f%%\n", Name, N, 100.0 * N / *Cycles);
+    };
+    PrintPressure("any", Listener.PressureCycles);
+    PrintPressure("resources", Listener.ReasonCycles[Pressure::RESOURCES]);
+    PrintPressure("register dependencies", Listener.ReasonCycles[Pressure::REGISTER_DEPS]);
+    PrintPressure("memory dependencies", Listener.ReasonCycles[Pressure::MEMORY_DEPS]);
+}
+
+bool ExplainBody(unique_ptr<ExprAST> Body, vector<string> Params, raw_ostream &OS) {
+    TargetMachine *HostTM = HostTargetMachine();
+    if (!HostTM)
+        return false;
+    TargetMachine &TM = *HostTM;
+    InitializeModule();
+    TheModule->setDataLayout(TM.createDataLayout());
+    TheModule->setTargetTriple(TM.getTargetTriple().str());
+
+    FunctionAST FnAST(make_unique<PrototypeAST>("__explain", move(Params)), move(Body));
+    Function *F = FnAST.codegen();
+    if (!F) {
+        InitializeModule();
+        return false;
+    }
+    Function *Batch = CodegenBatchEntry(F);
+    OptimizeModule(*TheModule, TM);
+    // Code generation rewrites the IR, so the loop is found first.
+    unsigned Rows;
+    BasicBlock *Hot = FindHotLoop(*Batch, Rows);
+    string Header = Hot ? Hot->getName().str() : string();
+    OS << "Optimized IR:\n" << *TheModule;
+
+    SmallString<0> Asm;
+    raw_svector_ostream AsmOS(Asm);
+    legacy::PassManager PM;
+    TM.Options.MCOptions.AsmVerbose = true; // For the comments that name each block's IR block.
+    if (TM.addPassesToEmitFile(PM, AsmOS, nullptr, CGFT_AssemblyFile)) {
+        OS << "\nThe host target cannot emit assembly.\n";
+    } else {
+        PM.run(*TheModule);
+        OS << "\nAssembly (" << TM.getTargetCPU() << "):\n" << Asm << '\n';
+        AnalyzeLoop(TM, Asm, Header, Rows, OS);
+    }
+    InitializeModule();
+    return true;
+}
+
+// Named Expressions
+// Named definitions are published through an immutable table; writers replace the whole table with an updated copy. Calls therefore look names up without taking a lock. Replaced tables and the code of replaced definitions are retired, and freed by epoch-based reclamation once no call can still reach them.
+
+/// ReaderRecord - Announces the epoch in which a thread entered a registry read, or 0 while it is outside one. Records are never freed: a thread claims one on its first read and hands it back when it exits.
+struct ReaderRecord {
+    atomic<uint64_t> Epoch{0};
+    atomic<bool> InUse{false};
+    ReaderRecord *Next = nullptr;
+};
+
+static atomic<uint64_t> GlobalEpoch{1};
+static atomic<ReaderRecord *> ReaderRecords{nullptr};
+
+/// ClaimReaderRecord - Reuse a record released by an exited thread, or push a new one onto the list.
+static ReaderRecord *ClaimReaderRecord() {
+    for (ReaderRecord *R = ReaderRecords.load(memory_order_acquire); R; R = R->Next) {
+        bool Expected = false;
+        if (!R->InUse.load(memory_order_relaxed) && R->InUse.compare_exchange_strong(Expected, true))
+            return R;
+    }
+    auto *R = new ReaderRecord;
+    R->InUse.store(true, memory_order_relaxed);
+    R->Next = ReaderRecords.load(memory_order_relaxed);
+    while (!ReaderRecords.compare_exchange_weak(R->Next, R, memory_order_release, memory_order_relaxed))
+        ;
+    return R;
+}
+
+/// ThreadReaderRecord - Holds the calling thread's record and releases it at thread exit.
+struct ThreadReaderRecord {
+    ReaderRecord *R = nullptr;
+    ~ThreadReaderRecord() {
+        if (R)
+            R->InUse.store(false, memory_order_release);
+    }
+};
+static thread_local ThreadReaderRecord ThreadReader;
+
+/// EpochGuard - Marks the calling thread as reading the registry while it lives. Guards do not nest.
+class EpochGuard {
+    ReaderRecord *R;
+
+public:
+    EpochGuard() {
+        if (!ThreadReader.R)
+            ThreadReader.R = ClaimReaderRecord();
+        R = ThreadReader.R;
+        R->Epoch.store(GlobalEpoch.load(memory_order_acquire), memory_order_relaxed);
+        // The announcement must be visible to writers before the read loads anything they might retire.
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    ~EpochGuard() { R->Epoch.store(0, memory_order_release); }
+};
+
+/// MinActiveEpoch - The oldest epoch a thread is still reading in, or UINT64_MAX if no thread is reading.
+static uint64_t MinActiveEpoch() {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t Min = UINT64_MAX;
+    for (ReaderRecord *R = ReaderRecords.load(memory_order_acquire); R; R = R->Next) {
+        uint64_t Epoch = R->Epoch.load(memory_order_acquire);
+        if (Epoch && Epoch < Min)
+            Min = Epoch;
+    }
+    return Min;
+}
+
+/// NamedExpr - One definition. RT owns its code, so that the code can be freed when the definition is replaced.
+struct NamedExpr {
+    EntryFn Entry = nullptr;
+    uint32_t NumArgs = 0;
+    orc::ResourceTrackerSP RT;
+};
+using NamedTable = StringMap<NamedExpr>;
+
+/// MaxFinishedFlights - How many finished compiles an engine remembers, so that identical later requests get the same handle.
+static const size_t MaxFinishedFlights = 4096;
+
+struct Engine::Impl {
+    unique_ptr<orc::LLJIT> JIT;
+    unique_ptr<TargetMachine> TM; // Host machine the batch kernels are tuned for; null with a compile server.
+    mutable mutex Lock; // Serializes code generation, which shares JIT, NextId, Error and ServerFD.
+    uint64_t NextId = 0;
+    string Error;
+    string InitError; // Why the JIT or target machine could not be created; if set, every compile fails with it.
+
+    string CompileServer; // Socket path of the compile server, or empty to compile in-process.
+    int ServerFD = -1;    // Connection to it, opened on first use and reopened after a failure.
+
+    // Background compiles queued by compileAsync, run in order on one executor thread, started on first use.
+    mutex QueueLock;
+    condition_variable QueueReady;
+    deque<function<void()>> Queue;
+    bool Stopping = false;
+    std::thread Executor;
+
+    /// Flight - A compile of one canonical expression, either in flight or finished.
+    struct Flight {
+        string Canonical;
+        shared_future<ExprHandle> Handle;
+    };
+    mutex FlightsLock;
+    map<uint64_t, Flight> Flights; // Keyed by hash of the canonical form.
+    deque<uint64_t> Finished;      // Keys of finished flights, oldest first; at most MaxFinishedFlights are kept.
+
+    ExprHandle compileShared(unique_ptr<ExprAST> Body, vector<string> Params);
+
+    void enqueue(function<void()> Task);
+    void runExecutor();
+    void stopExecutor();
+
+    // Named definitions. Named is read without a lock; RegistryLock serializes the writers, which also own Limbo.
+    atomic<NamedTable *> Named{new NamedTable};
+    mutex RegistryLock;
+    struct Retired {
+        uint64_t Epoch; // Reachable by readers that entered in this epoch or earlier.
+        NamedTable *Table;
+        orc::ResourceTrackerSP Code; // May be null.
+    };
+    deque<Retired> Limbo;
+    atomic<bool> HasRetired{false}; // Limbo is not empty; lets calls check without the lock.
+
+    void publish(NamedTable *Table, orc::ResourceTrackerSP OldCode);
+    void reclaim(uint64_t Before);
+    void reclaimAfterRead();
+};
+
+/// publish - Replace the named table with Table and retire the old one, along with OldCode. The caller holds RegistryLock.
+void Engine::Impl::publish(NamedTable *Table, orc::ResourceTrackerSP OldCode) {
+    NamedTable *Old = Named.exchange(Table, memory_order_seq_cst);
+    // Readers that announce a later epoch are guaranteed to see Table.
+    uint64_t Epoch = GlobalEpoch.fetch_add(1, memory_order_seq_cst);
+    Limbo.push_back({Epoch, Old, move(OldCode)});
+    reclaim(MinActiveEpoch());
+}
+
+/// reclaim - Free everything retired before epoch Before. The caller holds RegistryLock.
+void Engine::Impl::reclaim(uint64_t Before) {
+    while (!Limbo.empty() && Limbo.front().Epoch < Before) {
+        delete Limbo.front().Table;
+        // Code the JIT cannot remove stays mapped, which is harmless; the tracker is dropped either way.
+        if (Limbo.front().Code)
+            if (llvm::Error Err = Limbo.front().Code->remove())
+                fprintf(stderr, "Error: cannot free replaced code: %s\n", toString(move(Err)).c_str());
+        Limbo.pop_front();
+    }
+    HasRetired.store(!Limbo.empty(), memory_order_relaxed);
+}
+
+/// reclaimAfterRead - Called by a reader on its way out while something is retired, so that what an earlier reader held back is freed without waiting for the next write. Limbo therefore holds at most what was retired while the oldest call still running entered. Skipped if a writer has the lock, since that writer reclaims itself.
+void Engine::Impl::reclaimAfterRead() {
+    unique_lock<mutex> Guard(RegistryLock, try_to_lock);
+    if (Guard)
+        reclaim(MinActiveEpoch());
+}
+
+/// SetEngineError - Record the calling thread's pending error as the engine's most recent one.
+static void SetEngineError(Engine::Impl &I) {
+    lock_guard<mutex> Guard(I.Lock);
+    I.Error = PendingError.empty() ? "invalid expression" : PendingError;
+}
+
+/// CheckUsable - True if I was set up; otherwise records the reason as the engine's error.
+static bool CheckUsable(Engine::Impl &I) {
+    if (I.InitError.empty())
+        return true;
+    lock_guard<mutex> Guard(I.Lock);
+    I.Error = I.InitError;
+    return false;
+}
+
+void Engine::Impl::enqueue(function<void()> Task) {
+    {
+        lock_guard<mutex> Guard(QueueLock);
+        Queue.push_back(move(Task));
+        if (TraceEvents.load(memory_order_relaxed))
+            RecordTraceCounter("compile queue", Queue.size());
+        if (!Executor.joinable())
+            Executor = std::thread(&Impl::runExecutor, this);
+    }
+    QueueReady.notify_one();
+}
+
+void Engine::Impl::runExecutor() {
+    SetTraceThreadName("engine compiler");
+    while (true) {
+        function<void()> Task;
+        {
+            unique_lock<mutex> Guard(QueueLock);
+            QueueReady.wait(Guard, [this] { return Stopping || !Queue.empty(); });
+            // Finish whatever is queued before stopping, so that no future is left unfulfilled.
+            if (Queue.empty())
+                return;
+            Task = move(Queue.front());
+            Queue.pop_front();
+            if (TraceEvents.load(memory_order_relaxed))
+                RecordTraceCounter("compile queue", Queue.size());
+        }
+        TraceSpan Job("compile job", "engine");
+        Task();
+    }
+}
+
+void Engine::Impl::stopExecutor() {
+    {
+        lock_guard<mutex> Guard(QueueLock);
+        Stopping = true;
+    }
+    QueueReady.notify_one();
+    if (Executor.joinable())
+        Executor.join();
+}
+
+/// PendingExpr::State - Shared by every copy of a PendingExpr and by its background compile. Entry is published once the compiled code is ready.
+struct PendingExpr::State {
+    unique_ptr<ExprAST> Body;
+    uint32_t NumArgs = 0;
+    atomic<EntryFn> Entry{nullptr};
+    promise<ExprHandle> Compiled;
+};
+
+uint32_t PendingExpr::getNumArgs() const {
+    return S->NumArgs;
+}
+
+bool PendingExpr::isReady() const {
+    return S->Entry.load(memory_order_acquire) != nullptr;
+}
+
+double PendingExpr::eval(const double *Args) const {
+    if (auto Entry = S->Entry.load(memory_order_acquire)) {
+        LatencyTimer Timer(LatencyNative);
+        return Entry(Args);
+    }
+    LatencyTimer Timer(LatencyInterpreter);
+    return S->Body->interpret(Args);
+}
+
+Engine::Engine() : Engine(nullptr) {}
+
+Engine::Engine(const char *CompileServer) : TheImpl(new Impl) {
+    InitializeCalculator();
+    // Nothing here may end the host. A failure is kept instead, and every compile reports it.
+    CompileScope Scope(nullptr, /*OpenModule=*/false);
+    if (auto JIT = CreateJIT(EngineObjectCache))
+        TheImpl->JIT = move(*JIT);
+    else
+        ReportError(("cannot create the JIT: " + toString(JIT.takeError())).c_str());
+    if (CompileServer)
+        TheImpl->CompileServer = CompileServer;
+    else if (TheImpl->JIT)
+        TheImpl->TM = CreateHostTargetMachine();
+    if (!PendingError.empty())
+        TheImpl->InitError = TheImpl->Error = PendingError;
+}
+
+Engine::~Engine() {
+    // Queued compiles still use the engine, so they must finish first.
+    TheImpl->stopExecutor();
+    // No call may run during destruction, so everything retired can go, while the JIT still exists.
+    TheImpl->reclaim(UINT64_MAX);
+    delete TheImpl->Named.load(memory_order_relaxed);
+    if (TheImpl->ServerFD >= 0)
+        close(TheImpl->ServerFD);
+}
+
+/// ExchangeWithServer - Send Request to I's compile server and wait for its response. A broken connection is reopened once, so that a restarted server is picked up. The caller holds I's lock.
+static bool ExchangeWithServer(Engine::Impl &I, StringRef Request, string &Response) {
+    for (int Attempt = 0; Attempt < 2; ++Attempt) {
+        if (I.ServerFD < 0 && (I.ServerFD = ConnectUnix(I.CompileServer)) < 0)
+            return false;
+        if (SendFrame(I.ServerFD, Request) && ReceiveFrame(I.ServerFD, Response))
+            return true;
+        close(I.ServerFD);
+        I.ServerFD = -1;
+    }
+    return false;
+}
+
+/// CompileRemote - CompileBody for an engine with a compile server: send the server the expression's tree and load the object code it returns, so that no IR is generated in this process. The caller holds I's lock.
+static EntryFn CompileRemote(Engine::Impl &I, const string &Name, const ExprAST &Body, const vector<string> &Params,
+                             orc::ResourceTrackerSP RT, BatchFn *Batch) {
+    string Request(1, Batch ? 'b' : 'e');
+    Request += Name;
+    Request += '\0';
+    for (const string &Param : Params) {
+        Request += Param;
+        Request += '\0';
+    }
+    Request += '\0';
+    Body.serialize(Request);
+
+    string Response;
+    if (!ExchangeWithServer(I, Request, Response)) {
+        ReportError(("cannot reach compile server '" + I.CompileServer + "': " + strerror(errno)).c_str());
+        return nullptr;
+    }
+    StringRef Status, Payload;
+    tie(Status, Payload) = StringRef(Response).split('\0');
+    if (Status != "ok") {
+        ReportError(Payload.str().c_str());
+        return nullptr;
+    }
+    RemoteCompiles.add();
+    ObjectBytes.add(Payload.size());
+
+    // The object code comes from another process, so anything wrong with it fails this compile rather than the host.
+    PhaseTimer Timer(PhaseLink);
+    auto Obj = MemoryBuffer::getMemBufferCopy(Payload, PerfLabels ? ExprLabel(Body) : Name);
+    if (Error Err = RT ? I.JIT->addObjectFile(RT, move(Obj)) : I.JIT->addObjectFile(move(Obj))) {
+        ReportError(("unusable object code from compile server: " + toString(move(Err))).c_str());
+        return nullptr;
+    }
+    auto Lookup = [&](const string &Symbol) -> uint64_t {
+        auto Sym = I.JIT->lookup(Symbol);
+        if (!Sym) {
+            ReportError(("unusable object code from compile server: " + toString(Sym.takeError())).c_str());
+            return 0;
+        }
+        return Sym->getAddress();
+    };
+    if (Batch && !(*Batch = (BatchFn)(intptr_t)Lookup(Name + "_batch")))
+        return nullptr;
+    return (EntryFn)(intptr_t)Lookup(Name + "_entry");
+}
+
+/// CompileBody - Generate and JIT-compile Body as the next expression of I, under I's lock. The code goes under RT when one is given, and stays for the engine's lifetime otherwise. With Batch, the expression also gets an optimized batch kernel. Returns the entry point, or null with the error left in PendingError.
+static EntryFn CompileBody(Engine::Impl &I, unique_ptr<ExprAST> Body, vector<string> Params,
+                           orc::ResourceTrackerSP RT = nullptr, BatchFn *Batch = nullptr) {
+    lock_guard<mutex> Guard(I.Lock);
+    string Name = "__expr" + to_string(I.NextId++);
+    if (!I.CompileServer.empty())
+        return CompileRemote(I, Name, *Body, Params, move(RT), Batch);
+    FunctionAST FnAST(make_unique<PrototypeAST>(Name, move(Params)), move(Body));
+    Function *F = FnAST.codegen();
+    if (!F)
+        return nullptr;
+    CodegenArgsEntry(F);
+    if (Batch) {
+        CodegenBatchEntry(F);
+        TheModule->setTargetTriple(I.TM->getTargetTriple().str());
+        OptimizeModule(*TheModule, *I.TM);
+    }
+
+    PhaseTimer Timer(PhaseLink);
+    auto TSM = orc::ThreadSafeModule(move(TheModule), move(TheContext));
+    if (Error Err = RT ? TheJIT->addIRModule(RT, move(TSM)) : TheJIT->addIRModule(move(TSM))) {
+        ReportError(("cannot add the expression to the JIT: " + toString(move(Err))).c_str());
+        return nullptr;
+    }
+    auto Lookup = [](const string &Symbol) -> uint64_t {
+        auto Sym = TheJIT->lookup(Symbol);
+        if (!Sym) {
+            ReportError(("cannot link the expression: " + toString(Sym.takeError())).c_str());
+            return 0;
+        }
+        return Sym->getAddress();
+    };
+    if (Batch && !(*Batch = (BatchFn)(intptr_t)Lookup(Name + "_batch")))
+        return nullptr;
+    return (EntryFn)(intptr_t)Lookup(Name + "_entry");
+}
+
+/// compileShared - Compile the parsed expression Body, or share the compile of an identical one. Runs inside the caller's CompileScope; on failure returns an invalid handle with the engine's error set.
+ExprHandle Engine::Impl::compileShared(unique_ptr<ExprAST> Body, vector<string> Params) {
+    ExprHandle H;
+
+    // Identical expressions share one compile. Requests that arrive while it is in flight wait for its handle; later ones reuse it. The canonical form is the serialized tree, so spacing, redundant parentheses and a trailing ';' do not matter.
+    string Canonical;
+    Body->serialize(Canonical);
+    uint64_t Key = xxHash64(Canonical);
+    promise<ExprHandle> Result;
+    bool Leader = false;
+    {
+        unique_lock<mutex> Guard(FlightsLock);
+        auto It = Flights.find(Key);
+        if (It == Flights.end()) {
+            Flights.emplace(Key, Flight{Canonical, Result.get_future().share()});
+            Leader = true;
+        } else if (It->second.Canonical == Canonical) {
+            shared_future<ExprHandle> Shared = It->second.Handle;
+            Guard.unlock();
+            return Shared.get();
+        }
+        // Otherwise another expression hashes to Key; compile this one on its own.
+    }
+
+    uint32_t NumArgs = Params.size();
+    if (auto Entry = CompileBody(*this, move(Body), move(Params), nullptr, &H.Batch)) {
+        H.Entry = Entry;
+        H.NumArgs = NumArgs;
+    } else {
+        SetEngineError(*this);
+    }
+
+    if (Leader) {
+        Result.set_value(H);
+        lock_guard<mutex> Guard(FlightsLock);
+        // Failures are not remembered, so that a later request reports its own error. Of the successes, only the most recent are, so that the table stays small however many distinct expressions an engine sees; an evicted one is compiled again if it comes back.
+        if (!H) {
+            Flights.erase(Key);
+        } else {
+            Finished.push_back(Key);
+            if (Finished.size() > MaxFinishedFlights) {
+                Flights.erase(Finished.front());
+                Finished.pop_front();
+            }
+        }
+    }
+    return H;
+}
+
+ExprHandle Engine::compile(const char *Src, size_t Len) {
+    if (!CheckUsable(*TheImpl))
+        return ExprHandle();
+    CompileScope Scope(TheImpl->JIT.get(), TheImpl->CompileServer.empty());
+    vector<string> Params;
+    auto Body = ParseSource(StringRef(Src, Len), &Params);
+    if (!Body) {
+        SetEngineError(*TheImpl);
+        return ExprHandle();
+    }
+    return TheImpl->compileShared(move(Body), move(Params));
+}
+
+PendingExpr Engine::compileAsync(const char *Src, size_t Len) {
+    PendingExpr P;
+    if (!CheckUsable(*TheImpl))
+        return P;
+    auto S = make_shared<PendingExpr::State>();
+    vector<string> Params;
+    {
+        // Parsing is cheap and gives the interpreter its tree, so it happens now, on the caller's thread.
+        CompileScope Scope(TheImpl->JIT.get(), /*OpenModule=*/false);
+        S->Body = ParseSource(StringRef(Src, Len), &Params);
+        if (!S->Body) {
+            SetEngineError(*TheImpl);
+            return P;
+        }
+        S->NumArgs = Params.size();
+    }
+
+    InterpretedCompiles.add();
+    P.S = S;
+    P.Compiled = S->Compiled.get_future().share();
+    // The interpreter keeps S->Body, so the compile gets a copy of the tree rather than parsing the source again.
+    string Tree;
+    S->Body->serialize(Tree);
+    TheImpl->enqueue([this, S, Tree, Params] {
+        CompileScope Scope(TheImpl->JIT.get(), TheImpl->CompileServer.empty());
+        StringRef In = Tree;
+        ExprHandle H = TheImpl->compileShared(DeserializeExpr(In), Params);
+        S->Entry.store(H.Entry, memory_order_release);
+        S->Compiled.set_value(H);
+    });
+    return P;
+}
+
+bool Engine::explain(const char *Src, size_t Len, string &Report) {
+    // The analysis runs on this thread for the host CPU, even when a compile server builds the engine's code.
+    CompileScope Scope(TheImpl->JIT.get(), /*OpenModule=*/false);
+    vector<string> Params;
+    auto Body = ParseSource(StringRef(Src, Len), &Params);
+    raw_string_ostream OS(Report);
+    if (!Body || !ExplainBody(move(Body), move(Params), OS)) {
+        SetEngineError(*TheImpl);
+        return false;
+    }
+    OS.flush();
+    return true;
+}
+
+bool Engine::define(const char *Name, const char *Src, size_t Len) {
+    if (!CheckUsable(*TheImpl))
+        return false;
+    CompileScope Scope(TheImpl->JIT.get(), TheImpl->CompileServer.empty());
+    vector<string> Params;
+    auto Body = ParseSource(StringRef(Src, Len), &Params);
+    uint32_t NumArgs = Params.size();
+    // Definitions get code of their own, outside the shared compiles, so that redefining one can free it.
+    auto RT = TheImpl->JIT->getMainJITDylib().createResourceTracker();
+    EntryFn Entry = Body ? CompileBody(*TheImpl, move(Body), move(Params), RT) : nullptr;
+    if (!Entry) {
+        SetEngineError(*TheImpl);
+        return false;
+    }
+
+    lock_guard<mutex> Guard(TheImpl->RegistryLock);
+    auto *Table = new NamedTable(*TheImpl->Named.load(memory_order_relaxed));
+    NamedExpr &Def = (*Table)[Name];
+    orc::ResourceTrackerSP OldCode = move(Def.RT);
+    Def = {Entry, NumArgs, move(RT)};
+    TheImpl->publish(Table, move(OldCode));
+    return true;
+}
+
+bool Engine::undefine(const char *Name) {
+    lock_guard<mutex> Guard(TheImpl->RegistryLock);
+    NamedTable *Cur = TheImpl->Named.load(memory_order_relaxed);
+    auto It = Cur->find(Name);
+    if (It == Cur->end())
+        return false;
+    orc::ResourceTrackerSP OldCode = It->second.RT;
+    auto *Table = new NamedTable(*Cur);
+    Table->erase(Name);
+    TheImpl->publish(Table, move(OldCode));
+    return true;
+}
+
+bool Engine::call(const char *Name, const double *Args, uint32_t NumArgs, double &Result) const {
+    bool Found = false;
+    {
+        EpochGuard Guard;
+        const NamedTable *Table = TheImpl->Named.load(memory_order_acquire);
+        auto It = Table->find(Name);
+        if (It != Table->end() && It->second.NumArgs == NumArgs) {
+            LatencyTimer Timer(LatencyNative);
+            Result = It->second.Entry(Args);
+            Found = true;
+        }
+    }
+    if (TheImpl->HasRetired.load(memory_order_relaxed))
+        TheImpl->reclaimAfterRead();
+    return Found;
+}
+
+string Engine::getError() const {
+    lock_guard<mutex> Guard(TheImpl->Lock);
+    return TheImpl->Error;
+}
+
+void EnableLatencyStats() {
+    RecordLatencies.store(true, memory_order_relaxed);
+}
+
+string FormatLatencyStats() {
+    string Text;
+    raw_string_ostream OS(Text);
+    WriteLatencyStats(OS);
+    return move(OS.str());
+}
+
+bool StartTrace(const char *Path) {
+    return StartTracing(Path);
+}
+
+void FinishTrace() {
+    FinishTracing();
+}
+
+string FormatMetrics() {
+    string Text;
+    raw_string_ostream OS(Text);
+    WriteMetrics(OS);
+    return move(OS.str());
+}
+
+} // namespace calculator
+
+// C Interface
+
+using calculator::Engine;
+using calculator::ExprHandle;
+
+/// CalcOpaqueEngine - An Engine plus the storage the C interface hands out pointers into. Handles live in a deque so that they never move.
+struct CalcOpaqueEngine {
+    Engine E;
+    mutex Lock;
+    deque<ExprHandle> Exprs;
+    string Error;
+
+    explicit CalcOpaqueEngine(const char *CompileServer) : E(CompileServer) {}
+};
+
+static const ExprHandle *unwrap(CalcExprRef Expr) {
+    return reinterpret_cast<const ExprHandle *>(Expr);
+}
+
+CalcEngineRef CalcCreateEngine(void) {
+    return new CalcOpaqueEngine(nullptr);
+}
+
+CalcEngineRef CalcCreateRemoteEngine(const char *CompileServer) {
+    return new CalcOpaqueEngine(CompileServer);
+}
+
+void CalcDisposeEngine(CalcEngineRef Engine) {
+    delete Engine;
+}
+
+CalcExprRef CalcCompile(CalcEngineRef Engine, const char *Src, size_t Len) {
+    ExprHandle H = Engine->E.compile(Src, Len);
+    lock_guard<mutex> Guard(Engine->Lock);
+    if (!H) {
+        Engine->Error = Engine->E.getError();
+        return nullptr;
+    }
+    Engine->Exprs.push_back(H);
+    return reinterpret_cast<CalcExprRef>(&Engine->Exprs.back());
+}
+
+const char *CalcGetError(CalcEngineRef Engine) {
+    lock_guard<mutex> Guard(Engine->Lock);
+    return Engine->Error.c_str();
+}
+
+int CalcDefine(CalcEngineRef Engine, const char *Name, const char *Src, size_t Len) {
+    if (Engine->E.define(Name, Src, Len))
+        return 1;
+    lock_guard<mutex> Guard(Engine->Lock);
+    Engine->Error = Engine->E.getError();
+    return 0;
+}
+
+int CalcUndefine(CalcEngineRef Engine, const char *Name) {
+    return Engine->E.undefine(Name);
+}
+
+int CalcCall(CalcEngineRef Engine, const char *Name, const double *Args, uint32_t NumArgs, double *Result) {
+    return Engine->E.call(Name, Args, NumArgs, *Result);
+}
+
+uint32_t CalcGetNumArgs(CalcExprRef Expr) {
+    return unwrap(Expr)->getNumArgs();
+}
+
+double CalcEval(CalcExprRef Expr, const double *Args) {
+    return unwrap(Expr)->eval(Args);
+}
+
+void CalcEvalBatch(CalcExprRef Expr, const double *Args, double *Results, size_t Count) {
+    unwrap(Expr)->evalBatch(Args, Results, Count);
+}
+
+size_t CalcFormatMetrics(char *Buf, size_t Size) {
+    string Text = calculator::FormatMetrics();
+    if (Size) {
+        size_t N = min(Size - 1, Text.size());
+        memcpy(Buf, Text.data(), N);
+        Buf[N] = '\0';
+    }
+    return Text.size();
+}
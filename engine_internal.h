@@ -0,0 +1,579 @@
+//===- engine_internal.h - Internals shared by the library and the tool ---===//
+//
+// The lexer, parser, syntax tree, code generator and JIT plumbing behind the
+// calculator library. The calculator tool drives these directly; embedders
+// should use calculator.h or calculator_c.h instead, as nothing here is a
+// stable interface.
+//
+// Lexer, parser and code generation state is per thread, so that server
+// workers and pipeline stages can each run their own.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef CALCULATOR_ENGINE_INTERNAL_H
+#define CALCULATOR_ENGINE_INTERNAL_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace calculator {
+
+// Phase Timing
+// With --time-report, each thread times the phases of handling an expression. Timers nest, and each charges only its own time: the lexing a parser triggers counts as lexing, not parsing. With --hw-counters, they charge hardware events the same way.
+
+enum TimedPhase {
+    PhaseInput,   // Reading the lexer's input stream
+    PhaseLex,
+    PhaseParse,
+    PhaseCodegen, // Generating IR
+    PhaseVerify,
+    PhaseOptimize,
+    PhaseEmit,    // JIT: compiling IR to machine code
+    PhaseLink,    // JIT: everything else in materializing and freeing code
+    PhaseExecute,
+    NumTimedPhases
+};
+
+/// PhaseNames - The phases' names, as printed in reports.
+extern const char *const PhaseNames[NumTimedPhases];
+
+/// TimePhases - Whether phases are timed. Set at startup, or when tracing starts; timers cost a single relaxed load while it is false.
+extern std::atomic<bool> TimePhases;
+
+/// HardwareEvent - The events counted in each phase with hardware counters on. All of them count user space only.
+enum HardwareEvent {
+    EventCycles,
+    EventInstructions,
+    EventCacheMisses, // Last-level cache misses
+    EventBranchMisses,
+    EventITLBMisses,
+    NumHardwareEvents
+};
+
+/// HardwareEventNames - The events' names, as printed in reports.
+extern const char *const HardwareEventNames[NumHardwareEvents];
+
+/// CountHardwareEvents - Whether phase timers also read the hardware counters. Set by EnableHardwareCounters.
+extern bool CountHardwareEvents;
+
+/// HardwareEventAvailable - Which events this machine counts; the others always read zero.
+extern bool HardwareEventAvailable[NumHardwareEvents];
+
+/// EnableHardwareCounters - Count hardware events in every timed phase, on every thread, through perf_event_open. Also turns phase timing on. Call once at startup, before any thread starts. Reports an error and returns false if the machine, or its perf_event_paranoid setting, allows no hardware counters.
+bool EnableHardwareCounters();
+
+/// NoteExecutedRows - Count N rows evaluated in the execute phase: one per expression or call, or one per row of a batch kernel call. The execute phase's hardware events divided by these give events per row.
+void NoteExecutedRows(uint64_t N);
+
+/// PhaseTimes - Nanoseconds spent, and hardware events counted, in each phase.
+struct PhaseTimes {
+    uint64_t Nanos[NumTimedPhases] = {};
+    uint64_t Events[NumTimedPhases][NumHardwareEvents] = {};
+};
+
+/// ThreadPhaseTimes - The calling thread's accumulated phase times.
+extern thread_local PhaseTimes ThreadPhaseTimes;
+
+/// PhaseTimer - Charges the time until it is destroyed to one phase, pausing the enclosing timer meanwhile.
+class PhaseTimer {
+    bool Active = false;
+    int Outer;
+    uint64_t Start; // Feeds the phase's latency histogram.
+
+    void enter(TimedPhase Phase);
+    void leave();
+
+public:
+    explicit PhaseTimer(TimedPhase Phase) {
+        if (TimePhases.load(std::memory_order_relaxed))
+            enter(Phase);
+    }
+    ~PhaseTimer() {
+        if (Active)
+            leave();
+    }
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+/// WriteMetrics - Write every metric the library keeps in the Prometheus text format.
+void WriteMetrics(llvm::raw_ostream &OS);
+
+// Memory Accounting
+// Syntax trees, JIT code and the object caches keep live byte counts as they grow and shrink. The heap growth of each expression's context and module is only measured on request.
+
+/// ExprMemory - Memory that building one expression took, on the thread that parsed and generated it.
+struct ExprMemory {
+    uint64_t ASTNodes = 0;
+    uint64_t ASTBytes = 0;
+    uint64_t IRInstructions = 0;
+    int64_t ModuleHeapBytes = 0; // Heap growth from creating the LLVMContext and Module to finishing the IR; 0 unless MeasureModuleHeap.
+};
+
+/// LastExprMemory - The calling thread's figures for the expression it parsed, and then generated, most recently.
+extern thread_local ExprMemory LastExprMemory;
+
+/// MeasureModuleHeap - Whether InitializeModule and FunctionAST::codegen measure each module's heap growth. Reading malloc's statistics takes its arena locks, so this is off unless a report asks for it. Set once at startup.
+extern bool MeasureModuleHeap;
+
+/// MemoryUsage - The process's memory by subsystem now, and what its expressions have taken to build so far.
+struct MemoryUsage {
+    uint64_t ASTNodes = 0, ASTBytes = 0;                 // Syntax trees still allocated
+    uint64_t JITCode = 0, JITROData = 0, JITRWData = 0; // Sections of loaded JIT code
+    uint64_t ObjectCache = 0;       // Objects the in-process object caches hold
+    uint64_t SharedObjectCache = 0; // Arena in use in the shared object stores this process maps
+    uint64_t Heap = 0;              // malloc's bytes in use
+    uint64_t Resident = 0;          // Resident set size
+    uint64_t ASTNodesParsed = 0, ASTBytesParsed = 0, IRInstructions = 0;
+    uint64_t ModulesMeasured = 0;
+    int64_t ModuleHeapTotal = 0, ModuleHeapPeak = 0;
+};
+
+/// GetMemoryUsage - Take a MemoryUsage snapshot; callable from any thread at any time.
+MemoryUsage GetMemoryUsage();
+
+// Latency Recording
+// Latencies go into HDR histograms: exact below 128ns, and within 1/64 of the value above, up to 2^43ns (over two hours). Each thread records into histograms of its own, with no locks or read-modify-write operations; readers merge every thread's histograms.
+
+enum LatencyKind {
+    LatencyRequest,     // End to end: an expression at the prompt or in batch mode, or a server request, from being read to its result going out
+    LatencyInterpreter, // One evaluation by the tree-walking interpreter
+    LatencyNative,      // One call into JIT-compiled code
+    LatencyBatch,       // One call into a batch kernel, for any number of rows
+    NumLatencyKinds
+};
+
+/// LatencyNames - The kinds' names, as printed in reports.
+extern const char *const LatencyNames[NumLatencyKinds];
+
+/// RecordLatencies - Whether latencies are recorded; timers cost a single relaxed load while it is false.
+extern std::atomic<bool> RecordLatencies;
+
+/// HdrHistogram - A high-dynamic-range histogram of nanosecond values. One thread records into it while any number read it.
+class HdrHistogram {
+public:
+    static constexpr unsigned SubBucketBits = 7;
+    static constexpr unsigned MaxValueBits = 43;
+    static constexpr unsigned NumBuckets =
+        (1u << SubBucketBits) + (MaxValueBits - SubBucketBits) * (1u << (SubBucketBits - 1));
+
+private:
+    std::atomic<uint64_t> Counts[NumBuckets] = {};
+    std::atomic<uint64_t> Total{0};
+    std::atomic<uint64_t> Sum{0};
+    std::atomic<uint64_t> Max{0};
+
+    static unsigned bucketOf(uint64_t Value);
+    /// highestIn - The largest value that falls into Bucket.
+    static uint64_t highestIn(unsigned Bucket);
+
+public:
+    /// record - Count Value. Only the histogram's owner may record into it.
+    void record(uint64_t Value);
+    /// merge - Add Other's counts to this histogram, which must not be recorded into meanwhile.
+    void merge(const HdrHistogram &Other);
+
+    uint64_t getCount() const { return Total.load(std::memory_order_relaxed); }
+    uint64_t getSum() const { return Sum.load(std::memory_order_relaxed); }
+    uint64_t getMax() const { return Max.load(std::memory_order_relaxed); }
+    /// getPercentile - The value that P percent of the recorded values do not exceed, to the histogram's precision.
+    uint64_t getPercentile(double P) const;
+};
+
+/// RecordLatency - Record Nanos into the calling thread's histogram for Kind.
+void RecordLatency(LatencyKind Kind, uint64_t Nanos);
+
+/// LatencyClock - The time base of latency recording, in nanoseconds.
+inline uint64_t LatencyClock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/// LatencyTimer - Records the time until it is destroyed as one latency of its kind, if latencies are being recorded.
+class LatencyTimer {
+    LatencyKind Kind;
+    uint64_t Start = 0;
+
+public:
+    explicit LatencyTimer(LatencyKind Kind) : Kind(Kind) {
+        if (RecordLatencies.load(std::memory_order_relaxed))
+            Start = LatencyClock();
+    }
+    ~LatencyTimer() {
+        if (Start)
+            RecordLatency(Kind, LatencyClock() - Start);
+    }
+};
+
+/// MergeLatencies - Every thread's histogram for Kind, including those of threads that have exited, merged into one.
+std::unique_ptr<HdrHistogram> MergeLatencies(LatencyKind Kind);
+
+/// WriteLatencyStats - Write the count, p50, p99, p99.9 and maximum of each kind of latency as a table.
+void WriteLatencyStats(llvm::raw_ostream &OS);
+
+// Trace Events
+// With --trace, threads record what they do as Chrome trace events, for viewing in Perfetto or chrome://tracing: every timed phase, each expression, waits on the pipeline's queues and the queues' depths, background compile jobs, and shared-memory batches. Each thread buffers its events and appends them to the file now and then. The file is in the JSON array format, whose closing bracket is optional, so a server that is killed still leaves a trace to load.
+
+/// TraceEvents - Whether events are recorded. Set by StartTracing and cleared by FinishTracing, possibly while other threads run; spans cost a single relaxed load while it is false.
+extern std::atomic<bool> TraceEvents;
+
+/// TraceExpr - The number of the expression the calling thread is working on, attached to its events as "expr"; 0 for none.
+extern thread_local uint64_t TraceExpr;
+
+/// StartTracing - Create the trace file at Path and start recording. Also turns phase timing on. Call once at startup, before any thread starts. Reports an error and returns false if the file cannot be created.
+bool StartTracing(const std::string &Path);
+
+/// FinishTracing - Write out every thread's buffered events and complete the file. Call once every traced thread is idle.
+void FinishTracing();
+
+/// SetTraceThreadName - Name the calling thread's track in the trace. Name must be a string literal, as must every name and category below: they are written without escaping.
+void SetTraceThreadName(const char *Name);
+
+/// RecordTraceSpan - Record a complete event on the calling thread's track: Name ran from Start for Nanos, by LatencyClock. ArgName, if given, labels one more argument.
+void RecordTraceSpan(const char *Name, const char *Category, uint64_t Start, uint64_t Nanos,
+                     const char *ArgName = nullptr, uint64_t Arg = 0);
+
+/// RecordTraceCounter - Record that the counter Name now stands at Value.
+void RecordTraceCounter(const char *Name, int64_t Value);
+
+/// TraceSpan - Records the time until it is destroyed as one complete event, if events are being recorded.
+class TraceSpan {
+    const char *Name, *Category, *ArgName;
+    uint64_t Arg;
+    uint64_t Start = 0;
+
+public:
+    TraceSpan(const char *Name, const char *Category, const char *ArgName = nullptr, uint64_t Arg = 0)
+        : Name(Name), Category(Category), ArgName(ArgName), Arg(Arg) {
+        if (TraceEvents.load(std::memory_order_relaxed))
+            Start = LatencyClock();
+    }
+    ~TraceSpan() {
+        if (Start)
+            RecordTraceSpan(Name, Category, Start, LatencyClock() - Start, ArgName, Arg);
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+// Lexer
+// The lexer identifies tokens [0-255] for unknown characters, otherwise returns tokens for recognized items.
+enum Token {
+    tok_eof = -1,     // Token for end of input
+    tok_error = -2,   // Token for errors
+    tok_identifier = -3, // Token for variable names
+    tok_number = -4   // Token for numeric values
+};
+
+extern thread_local std::string IdentifierStr; // Filled in if tok_identifier
+extern thread_local double NumVal; // Stores the numeric value if tok_number is returned
+
+/// CollectErrors - Hold errors in PendingError instead of printing them; set in batch mode, on server workers and inside Engine::compile.
+extern thread_local bool CollectErrors;
+/// PendingError - The first error collected since the last one was reported to the client.
+extern thread_local std::string PendingError;
+
+/// ReportError - Print an error, or hold it for the next batch record or server response.
+void ReportError(const char *Str);
+/// SetLexBuffer - Restart the lexer on Src, which must outlive the tokens read from it.
+void SetLexBuffer(llvm::StringRef Src);
+/// gettok - Fetch the next token from the lexer input.
+int gettok();
+
+// Syntax Tree
+
+/// ExprAST - Base class for all expression nodes. Nodes carry their kind for isa<> and dyn_cast<>, as the tree is built without RTTI.
+class ExprAST {
+public:
+    enum ExprKind { EK_Number, EK_Variable, EK_Binary };
+
+private:
+    const ExprKind Kind;
+
+public:
+    /// ExprAST/~ExprAST - Count the node in and out of the live syntax tree memory.
+    explicit ExprAST(ExprKind Kind);
+    virtual ~ExprAST();
+    ExprKind getKind() const { return Kind; }
+    virtual llvm::Value *codegen() = 0;
+    /// serialize - Append a compact prefix encoding of the expression, read back by DeserializeExpr.
+    virtual void serialize(std::string &Out) const = 0;
+    /// interpret - Evaluate the expression by walking the tree, for use until its compiled code is ready.
+    virtual double interpret(const double *Args) const = 0;
+    /// print - Write the expression back out in source form, with every binary operation parenthesized.
+    virtual void print(llvm::raw_ostream &OS) const = 0;
+};
+
+/// NumberExprAST - Represents numeric literals like "1.0".
+class NumberExprAST : public ExprAST {
+public:
+    double Val;
+    NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
+    llvm::Value *codegen() override;
+    void serialize(std::string &Out) const override {
+        Out += 'n';
+        Out.append(reinterpret_cast<const char *>(&Val), sizeof(Val));
+    }
+    double interpret(const double *) const override { return Val; }
+    void print(llvm::raw_ostream &OS) const override;
+};
+
+/// VariableExprAST - Represents a reference to a variable, like "x". Only parameterized expressions may contain variables.
+class VariableExprAST : public ExprAST {
+    std::string Name;
+    unsigned Index; // Position among the expression's arguments.
+
+public:
+    VariableExprAST(const std::string &Name, unsigned Index = 0) : ExprAST(EK_Variable), Name(Name), Index(Index) {}
+    llvm::Value *codegen() override;
+    void serialize(std::string &Out) const override {
+        Out += 'v';
+        Out += Name;
+        Out += '\0';
+    }
+    double interpret(const double *Args) const override { return Args[Index]; }
+    void print(llvm::raw_ostream &OS) const override { OS << Name; }
+};
+
+/// BinaryExprAST - Represents binary operators.
+///
+/// A chain such as "a + b + c ..." parses left-deep, one node per term, so
+/// every walker loops down the left spine and recurses only into right
+/// operands. Those nest only as deep as the parentheses and precedence levels
+/// do, which the parser bounds with MaxParenDepth.
+class BinaryExprAST : public ExprAST {
+    char Op;
+    std::unique_ptr<ExprAST> LHS, RHS;
+
+    /// leftSpine - Collect this node and the binary nodes down its left operands, outermost first, and return the leftmost operand that is not one.
+    ExprAST *leftSpine(llvm::SmallVectorImpl<const BinaryExprAST *> &Spine) const;
+
+public:
+    BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
+        : ExprAST(EK_Binary), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    ~BinaryExprAST() override;
+    llvm::Value *codegen() override;
+    void serialize(std::string &Out) const override;
+    double interpret(const double *Args) const override;
+    void print(llvm::raw_ostream &OS) const override;
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
+};
+
+/// PrototypeAST - Describes a function's "prototype", capturing its name and argument names, thereby defining the number of arguments. Useful for parsing input as an anonymous function.
+class PrototypeAST {
+    std::string Name;
+    std::vector<std::string> Args;
+
+public:
+    PrototypeAST(const std::string &Name, std::vector<std::string> Args)
+        : Name(Name), Args(std::move(Args)) {}
+
+    llvm::Function *codegen();
+    const std::string &getName() const { return Name; }
+};
+
+/// FunctionAST - Represents a function definition. Useful for parsing input as an anonymous function.
+class FunctionAST {
+    std::unique_ptr<PrototypeAST> Proto;
+    std::unique_ptr<ExprAST> Body;
+
+public:
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, std::unique_ptr<ExprAST> Body)
+        : Proto(std::move(Proto)), Body(std::move(Body)) {}
+
+    llvm::Function *codegen();
+    void serialize(std::string &Out) const { Body->serialize(Out); }
+};
+
+// Parser
+
+/// CurTok/getNextToken - Provides a simple token buffer. CurTok is the current token being examined by the parser. getNextToken reads another token from the lexer and updates CurTok with the result.
+extern thread_local int CurTok;
+int getNextToken();
+
+/// BinopPrecedence - Stores the precedence level for each defined binary operator. Read-only once InitializeCalculator has set it up.
+extern std::map<int, int> BinopPrecedence;
+
+/// MaxParenDepth - How deeply parentheses may nest. Each level adds at most one right operand per precedence level plus one, so this bounds the recursion of every syntax tree walker.
+constexpr unsigned MaxParenDepth = 1000;
+
+std::unique_ptr<ExprAST> LogError(const char *Str);
+std::unique_ptr<ExprAST> ParseExpression();
+/// toplevelexpr ::= expression
+std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+/// ParseSource - Parse all of Src as one expression with an optional trailing ';'. Variables are only allowed, and are collected, when Params is given.
+std::unique_ptr<ExprAST> ParseSource(llvm::StringRef Src, std::vector<std::string> *Params);
+/// ParseParameterizedExpr - Parse one expression from the current token on, collecting its variables into Params.
+std::unique_ptr<ExprAST> ParseParameterizedExpr(std::vector<std::string> &Params);
+/// DeserializeExpr - Rebuild an expression written by ExprAST::serialize, consuming it from the front of In. Returns null on malformed input.
+std::unique_ptr<ExprAST> DeserializeExpr(llvm::StringRef &In);
+
+// Code Generation
+// Each thread owns its own context and module; TheJIT is the JIT the thread compiles for, owned by whoever created it.
+extern thread_local std::unique_ptr<llvm::LLVMContext> TheContext;
+extern thread_local std::unique_ptr<llvm::Module> TheModule;
+extern thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+extern thread_local llvm::orc::LLJIT *TheJIT;
+extern llvm::ExitOnError ExitOnErr;
+
+/// CodegenArgsEntry - Emit "<name>_entry(double *Args)", which loads F's arguments from an array and calls it. This gives every compiled expression the same signature whatever its arity.
+llvm::Function *CodegenArgsEntry(llvm::Function *F);
+
+/// CodegenBatchEntry - Emit "<name>_batch(const double *Args, double *Results, i64 Count)", which evaluates F on Count rows. Args holds one column per argument: argument J of row I is Args[J * Count + I].
+llvm::Function *CodegenBatchEntry(llvm::Function *F);
+
+/// ExplainBody - Write what Body costs on the host CPU to OS: the optimized IR of its batch kernel, the kernel's assembly, and llvm-mca's simulation of the kernel's loop, with cycles per row, port pressure and the bottleneck. Uses the calling thread's module state and leaves it fresh. Returns false, with the error in PendingError, if code generation fails.
+bool ExplainBody(std::unique_ptr<ExprAST> Body, std::vector<std::string> Params, llvm::raw_ostream &OS);
+
+/// ExprLabel - Name an expression for profilers: a hash of its tree, then its source form, shortened if long.
+std::string ExprLabel(const ExprAST &Body);
+
+/// EnablePerfSupport - Make JITs created from now on report their code to Linux perf. PerfMap appends every function to /tmp/perf-<pid>.map, named after its symbol and the ExprLabel of its expression. JITDump registers LLVM's jitdump writer, for "perf inject --jit". Call before creating any JIT.
+void EnablePerfSupport(bool PerfMap, bool JITDump);
+
+/// InitializeModule - Give the calling thread a fresh context, module and builder targeting TheJIT.
+void InitializeModule();
+
+// Shared Compiled-Code Cache
+
+/// ObjectKey - Names the object code of one module: a hash that places it in the stores, and a second, independent hash that confirms a match, so that a collision of the first cannot load the wrong code.
+struct ObjectKey {
+    uint64_t Hash = 0; // Never 0, which marks a free slot.
+    uint64_t Check = 0;
+
+    bool operator==(const ObjectKey &O) const { return Hash == O.Hash && Check == O.Check; }
+    bool operator<(const ObjectKey &O) const { return Hash != O.Hash ? Hash < O.Hash : Check < O.Check; }
+};
+
+/// SharedObjectStore - A file-backed mmap store of relocatable object files keyed by IR hash. Every calculator process that maps the same file sees the objects compiled by the others.
+/// Writers claim a slot of an open-addressed table, copy the object into a bump-allocated arena and then publish the slot. Readers only perform acquire loads and never take a lock.
+class SharedObjectStore {
+    static constexpr uint64_t StoreMagic = 0x45484341434c4143; // "CALCACHE"
+    static constexpr uint32_t StoreVersion = 1;
+    static constexpr uint32_t NumSlots = 4096;
+    static constexpr uint64_t ArenaSize = 64 << 20;
+
+    struct Header {
+        std::atomic<uint64_t> Magic; // Stored last, once the rest of the header is valid.
+        uint32_t Version;
+        uint32_t NumSlots;
+        uint64_t ArenaSize;
+        std::atomic<uint64_t> ArenaUsed;
+    };
+
+    /// SlotState - Where a claimed slot is in being written. Positive states are the process ID of the writer.
+    enum SlotState : int32_t { SlotClaimed = 0, SlotPublished = -1, SlotEmpty = -2 };
+
+    struct Slot {
+        std::atomic<uint64_t> Key; // ObjectKey::Hash; 0 while free, claimed by the first writer with a CAS.
+        uint64_t Check;            // ObjectKey::Check, valid once published.
+        uint64_t Offset;           // Arena offset of the object, valid once published.
+        uint64_t Size;
+        std::atomic<int32_t> State;
+    };
+
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared-memory atomics must be lock-free");
+
+    static constexpr uint64_t ArenaOffset = (sizeof(Header) + NumSlots * sizeof(Slot) + 63) & ~uint64_t(63);
+    static constexpr uint64_t MappedSize = ArenaOffset + ArenaSize;
+
+    Header *Hdr;
+    Slot *Slots;
+    char *Arena;
+
+    SharedObjectStore(void *Base)
+        : Hdr(static_cast<Header *>(Base)),
+          Slots(reinterpret_cast<Slot *>(Hdr + 1)),
+          Arena(static_cast<char *>(Base) + ArenaOffset) {}
+
+    /// isAbandoned - Whether S will never be published: its writer ran out of arena space, or died while writing.
+    static bool isAbandoned(const Slot &S);
+
+public:
+    ~SharedObjectStore();
+
+    /// getArenaUsed - Bytes of the arena holding objects, across every process sharing the store.
+    uint64_t getArenaUsed() const {
+        // Writers that found the arena full have still bumped the counter past its end.
+        uint64_t Used = Hdr->ArenaUsed.load(std::memory_order_relaxed);
+        return Used < ArenaSize ? Used : ArenaSize;
+    }
+
+    /// open - Map the store at Path, creating and initializing it if this is the first process to use it.
+    static std::unique_ptr<SharedObjectStore> open(const std::string &Path);
+    /// lookup - Return the object published under Key, or an empty reference if there is none (yet).
+    llvm::StringRef lookup(ObjectKey Key) const;
+    /// insert - Publish Obj under Key. If Key is already published, or being written by a live process, or the arena is full, the store is left unchanged.
+    void insert(ObjectKey Key, llvm::StringRef Obj);
+};
+
+/// JITObjectCache - Hooks the object stores into the JIT's compiler. Objects can be kept in-process for session snapshots and, when a shared store is configured, are published to every other process on the host.
+class JITObjectCache : public llvm::ObjectCache {
+    std::unique_ptr<SharedObjectStore> Store; // May be null.
+    bool KeepLocal;
+    std::mutex LocalLock;
+    std::map<ObjectKey, std::unique_ptr<llvm::MemoryBuffer>> LocalObjects;
+    /// PendingKeys - The key of each module getObject missed on, until it is compiled. Code generation rewrites the module, so hashing it again afterwards would give a key no lookup computes.
+    llvm::DenseMap<const llvm::Module *, ObjectKey> PendingKeys;
+
+public:
+    JITObjectCache(std::unique_ptr<SharedObjectStore> Store, bool KeepLocal)
+        : Store(std::move(Store)), KeepLocal(KeepLocal) {}
+    ~JITObjectCache() override;
+
+    /// getModuleKey - Hash the module's IR together with the host and LLVM version, since objects are only interchangeable between identical code generators.
+    static ObjectKey getModuleKey(const llvm::Module &M);
+    /// addObject - Keep a private copy of Obj under Key, e.g. when restoring a snapshot.
+    void addObject(ObjectKey Key, llvm::StringRef Obj);
+    /// lookupObject - Find the object for Key in this process, then in the shared store. Objects are never evicted, so the result stays valid.
+    llvm::StringRef lookupObject(ObjectKey Key);
+
+    void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override;
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+};
+
+/// CreateJIT - Build a JIT, routing compilation through the object cache when one is given.
+llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> CreateJIT(llvm::ObjectCache *Cache);
+
+/// EngineObjectCache - The object cache that Engines created from now on compile through; null by default. The tool points it at its own cache so that compiled expressions are shared like everything else.
+extern llvm::ObjectCache *EngineObjectCache;
+
+// Remote Compilation
+// An Engine created with a compile server hands code generation to it and only loads the object code that comes back. Messages in both directions are frames: a 32-bit little-endian length, then the payload.
+// A request is a kind byte ('e' for the entry point alone, 'b' for the batch kernel as well), then the function name and each parameter name, NUL-terminated, then an empty name, then the body in ExprAST::serialize form. A response is "ok", NUL and the relocatable object, or "error", NUL and the message.
+
+constexpr uint32_t MaxCompileFrame = 64 << 20;
+
+/// ConnectUnix - Connect a stream socket to Path. Returns -1 with errno set on error.
+int ConnectUnix(const std::string &Path);
+/// SendFrame/ReceiveFrame - Write or read one frame on a socket. Both return false once the peer has gone, and ReceiveFrame also when the frame is larger than MaxCompileFrame.
+bool SendFrame(int FD, llvm::StringRef Payload);
+bool ReceiveFrame(int FD, std::string &Payload);
+/// ServeCompileRequest - Carry out one compile request on the calling thread and build its response. Compile servers call this; objects go through EngineObjectCache.
+void ServeCompileRequest(llvm::StringRef Request, std::string &Response);
+
+/// InitializeCalculator - One-time process setup: the native target and the operator table. Safe to call repeatedly and from any thread.
+void InitializeCalculator();
+
+} // namespace calculator
+
+#endif // CALCULATOR_ENGINE_INTERNAL_H